@@ -3,6 +3,7 @@ local core = require "core"
 local common = require "core.common"
 local config = require "core.config"
 local style = require "core.style"
+local command = require "core.command"
 local Object = require "core.object"
 local process = require "process"
 
@@ -31,6 +32,23 @@ end
 ---@field monitor_paths string[]
 ---@field class_name string
 ---@field min_contrast_ratio number
+---@field binary_protocol boolean
+---@field event_debounce integer
+---@field daemon_socket string | nil
+---@field stats_interval integer
+---@field single_thread boolean
+---@field native_module boolean
+---@field max_message_size integer | nil
+---@field poll_interval_max number
+---@field cache_file string | false
+---@field native_paths string[]
+---The name of the monitor binary, which watches the Settings portal over D-Bus outside of Windows.
+local MONITOR_NAME = PLATFORM == "Windows" and "monitor.exe" or "monitor"
+
+---The name of the monitor core built as a Lua module, see monitor_native.c.
+---It isn't built on Windows.
+local NATIVE_NAME = "monitor_native.so"
+
 config.plugins.immersive_title = common.merge(config.plugins.immersive_title, {
   -- extend window frame into client area
   extend_frame = true,
@@ -48,13 +66,48 @@ config.plugins.immersive_title = common.merge(config.plugins.immersive_title, {
   theme_light = "colors.summer",
   -- default path to the monitor
   monitor_paths = {
-    USERDIR .. "/plugins/immersive-title/monitor.exe",
-    DATADIR .. "/plugins/immersive-title/monitor.exe"
+    USERDIR .. "/plugins/immersive-title/" .. MONITOR_NAME,
+    DATADIR .. "/plugins/immersive-title/" .. MONITOR_NAME
   },
   -- class name of the window
   class_name = "SDL_app",
   -- the minimum contrast ratio for the accent
   min_contrast_ratio = 5.0,
+  -- talk to the monitor with binary records instead of text,
+  -- only takes effect when the monitor is started
+  binary_protocol = false,
+  -- theme and accent changes within this many milliseconds are coalesced
+  -- into a single change, 0 to disable
+  event_debounce = 50,
+  -- if set, every editor instance shares a single monitor daemon listening on this socket,
+  -- which is started by the first instance; only the Linux monitor has a daemon
+  -- (there is no named-pipe transport), so every instance still starts its own monitor on Windows
+  daemon_socket = nil,
+  -- if not 0, the monitor reports its stats every this many milliseconds,
+  -- which are kept in the stats field of the monitor
+  stats_interval = 0,
+  -- runs the monitor from a single thread waiting on everything at once instead of three,
+  -- only supported outside of Windows and takes effect when the monitor is started
+  single_thread = false,
+  -- loads the monitor into the editor process if the native module is found,
+  -- the monitor process is started if it isn't or can't be loaded; not used with daemon_socket.
+  -- Off on Windows, where the module has no backend for the window frame and isn't built
+  native_module = PLATFORM ~= "Windows",
+  -- if set, the longest message in bytes the monitor accepts before answering with an error,
+  -- newline or record header included; batches are split to fit it.
+  -- Only takes effect when the monitor is started or attached to the daemon
+  max_message_size = nil,
+  -- the longest time in seconds between two polls of an idle monitor,
+  -- which is polled every frame while it is busy
+  poll_interval_max = 0.25,
+  -- the theme and the accent last applied are kept in this file and applied on startup,
+  -- before the monitor answers; false to disable
+  cache_file = USERDIR .. "/immersive_title.cache",
+  -- default path to the native module
+  native_paths = {
+    USERDIR .. "/plugins/immersive-title/" .. NATIVE_NAME,
+    DATADIR .. "/plugins/immersive-title/" .. NATIVE_NAME
+  },
 
   config_spec = {
     name = "Mica",
@@ -154,6 +207,68 @@ local BACKDROP_TYPE = {
   tabbed = 4,
 }
 
+---Types of the binary records sent to the monitor, see monitor_core.h.
+local BINARY_TYPE = {
+  config = 0x01,
+  theme = 0x02,
+  accent = 0x03,
+  exit = 0x04,
+  batch = 0x05,
+  debounce = 0x06,
+  contrast = 0x07,
+  stats = 0x08,
+  subscribe = 0x09,
+  unsubscribe = 0x0A,
+  override = 0x0B,
+  windows = 0x0C,
+}
+
+---Names of the binary records received from the monitor.
+local BINARY_TYPE_NAME = {
+  [0x80] = "ok",
+  [0x81] = "error",
+  [0xC0] = "ready",
+  [0xC1] = "themechange",
+  [0xC2] = "accentchange",
+  [0xC3] = "stats",
+}
+
+---The broadcasts a client can subscribe to, as bits of a mask.
+local TOPIC = {
+  theme = 1,
+  accent = 2,
+}
+
+---Every topic, which the monitor starts subscribed to.
+local TOPIC_ALL = TOPIC.theme | TOPIC.accent
+
+---The size of the header of a binary record.
+local BINARY_HEADER_SIZE = 8
+
+---The maximum number of commands the monitor accepts in a batch.
+local MAX_BATCH_SIZE = 32
+
+---The longest message in bytes the monitor accepts unless max_message_size is set,
+---including the newline or the header of a binary record.
+local DEFAULT_MAX_MESSAGE_SIZE = 4096
+
+---The maximum number of commands (or batches) awaiting a response.
+---Commands are held back once every slot is taken.
+local MAX_IN_FLIGHT = 16
+
+---The maximum number of commands waiting to be sent, or for the monitor to be ready.
+local MAX_QUEUED = 64
+
+---The number of seconds to wait for a response, or for the monitor to be ready.
+local REQUEST_TIMEOUT = 5
+
+---The number of seconds changes to the cache are held back, so they are written together.
+local CACHE_WRITE_DELAY = 2
+
+---The number of seconds between polls once the monitor is idle,
+---which doubles with every idle poll up to poll_interval_max.
+local POLL_IDLE_INTERVAL = 1 / 60
+
 ---Monitors theme change and reports various stuffs.
 ---@class Monitor
 local Monitor = Object:extend()
@@ -172,25 +287,270 @@ local function get_exe_path(possible_paths)
 end
 
 
+---Parses the color returned from the monitor.
+---The color returned from the monitor is a 32-bit unsigned integer
+---in the format 0xRRGGBBAA.
+---@param v integer the color
+---@returns Color the parsed color
+local function parse_color(v)
+  return { (v & 0xFF000000) >> 24, (v & 0xFF0000) >> 16, (v & 0xFF00) >> 8, v & 0xFF }
+end
+
+
+---Encodes a color into the format used by the monitor.
+---@param color Color the color
+---@returns integer
+local function encode_color(color)
+  local r, g, b, a = math.floor(color[1]), math.floor(color[2]), math.floor(color[3]), math.floor(color[4] or 0xFF)
+  return (r & 0xFF) << 24 | (g & 0xFF) << 16 | (b & 0xFF) << 8 | (a & 0xFF)
+end
+
+
+---Encodes and decodes the messages of a protocol spoken by the monitor.
+---@class Protocol
+---@field encode fun(serial: integer, cmd: Command): string encodes a command
+---@field encode_batch fun(serial: integer, cmds: Command[]): string encodes several commands in a batch
+---@field batch_overhead fun(serial: integer): integer the size of a batch without its commands
+---@field batch_entry_size fun(cmd: Command): integer the most a command adds to the size of a batch
+---@field next fun(buf: string, pos: integer, scan: integer): string?, integer returns the message at pos and the position after it,
+---or nil and the position to resume scanning from once more data arrives
+---@field decode fun(msg: string): integer, string, string returns the serial, type and content of a message
+---@field results fun(content: string): string[] decodes the response of a batch into status and content pairs
+---@field theme fun(content: string): boolean decodes a theme, true if dark
+---@field fields fun(content: string): table<string, integer> decodes the fields of the ready broadcast and stats
+---@field accent fun(content: string): Color, boolean, Color[] decodes an accent color, whether it is opaque
+---and its variants for the backgrounds set with Monitor:set_contrast()
+
+---The newline-delimited text protocol.
+---@type Protocol
+local text_protocol = {}
+
+---Encodes a command without the serial.
+---@param cmd Command
+---@return string
+local function text_command(cmd)
+  if cmd.type == "config" then
+    return string.format("config %d%d", cmd[1], cmd[2])
+  elseif cmd.type == "debounce" then
+    return string.format("debounce %d", cmd[1])
+  elseif cmd.type == "contrast" then
+    return "contrast " .. table.concat(cmd, " ")
+  elseif cmd.type == "stats" and cmd[1] then
+    return string.format("stats %d", cmd[1])
+  elseif cmd.type == "subscribe" or cmd.type == "unsubscribe" then
+    return string.format("%s %d", cmd.type, cmd[1])
+  elseif cmd.type == "override" then
+    -- false follows the config and the theme
+    local attrs = {}
+    for i = 2, 4 do
+      attrs[#attrs + 1] = cmd[i] and string.format("%d", cmd[i]) or "-"
+    end
+    return string.format("override %d %s", cmd[1], table.concat(attrs))
+  end
+  return cmd.type .. " "
+end
+
+function text_protocol.encode(serial, cmd)
+  return string.format("%d %s\n", serial, text_command(cmd))
+end
+
+function text_protocol.encode_batch(serial, cmds)
+  local parts = {}
+  for i, cmd in ipairs(cmds) do
+    parts[i] = text_command(cmd)
+  end
+  return string.format("%d batch %s\n", serial, table.concat(parts, "\t"))
+end
+
+function text_protocol.batch_overhead(serial)
+  return #string.format("%d batch \n", serial)
+end
+
+function text_protocol.batch_entry_size(cmd)
+  -- the tab before it
+  return #text_command(cmd) + 1
+end
+
+function text_protocol.next(buf, pos, scan)
+  -- only scan bytes that haven't been scanned before
+  local nl = buf:find("\n", scan, true)
+  if not nl then return nil, #buf + 1 end
+  local last = nl - 1
+  if last >= pos and buf:byte(last) == 13 then last = last - 1 end
+  return buf:sub(pos, last), nl + 1
+end
+
+function text_protocol.decode(msg)
+  local serial, type, content = msg:match("^([^ ]+) ([^ ]+) (.*)$")
+  return tonumber(serial), type, content
+end
+
+function text_protocol.results(content)
+  local results = {}
+  for status, msg in (content .. "\t"):gmatch("([^ \t]+) ([^\t]*)\t") do
+    results[#results + 1] = status
+    results[#results + 1] = msg
+  end
+  return results
+end
+
+function text_protocol.fields(content)
+  local fields = {}
+  for name, value in content:gmatch("([%w_]+)=(%d+)") do
+    fields[name] = tonumber(value)
+  end
+  return fields
+end
+
+function text_protocol.theme(content)
+  return content == "1"
+end
+
+function text_protocol.accent(content)
+  local opaque, color, rest = content:match("^(%d) (%d+)(.*)$")
+  local variants = {}
+  for variant in rest:gmatch("%d+") do
+    variants[#variants + 1] = parse_color(tonumber(variant, 10))
+  end
+  return parse_color(tonumber(color, 10)), opaque == "1", variants
+end
+
+---The binary protocol, enabled by starting the monitor with --binary.
+---@type Protocol
+local binary_protocol = {}
+
+---Encodes a command into its type and payload.
+---@param cmd Command
+---@return integer, string
+local function binary_command(cmd)
+  if cmd.type == "config" then
+    return BINARY_TYPE.config, string.pack("BB", cmd[1], cmd[2])
+  elseif cmd.type == "debounce" then
+    return BINARY_TYPE.debounce, string.pack("<I4", cmd[1])
+  elseif cmd.type == "contrast" then
+    return BINARY_TYPE.contrast, string.pack("<I2" .. string.rep("I4", #cmd - 1), table.unpack(cmd))
+  elseif cmd.type == "stats" and cmd[1] then
+    return BINARY_TYPE.stats, string.pack("<I4", cmd[1])
+  elseif cmd.type == "subscribe" or cmd.type == "unsubscribe" then
+    return BINARY_TYPE[cmd.type], string.pack("B", cmd[1])
+  elseif cmd.type == "override" then
+    return BINARY_TYPE.override, string.pack("<I8BBB", cmd[1], cmd[2] or 0xFF, cmd[3] or 0xFF, cmd[4] or 0xFF)
+  end
+  return BINARY_TYPE[cmd.type], ""
+end
+
+function binary_protocol.encode(serial, cmd)
+  local type, payload = binary_command(cmd)
+  return string.pack("<i4BBs2", serial, type, 0, payload)
+end
+
+function binary_protocol.encode_batch(serial, cmds)
+  local parts = {}
+  for i, cmd in ipairs(cmds) do
+    parts[i] = string.pack("Bs1", binary_command(cmd))
+  end
+  return string.pack("<i4BBs2", serial, BINARY_TYPE.batch, 0, table.concat(parts))
+end
+
+function binary_protocol.batch_overhead()
+  return BINARY_HEADER_SIZE
+end
+
+function binary_protocol.batch_entry_size(cmd)
+  local _, payload = binary_command(cmd)
+  return 2 + #payload
+end
+
+function binary_protocol.next(buf, pos, scan)
+  if #buf - pos + 1 < BINARY_HEADER_SIZE then return nil, pos end
+  local next_pos = pos + BINARY_HEADER_SIZE + string.unpack("<I2", buf, pos + 6)
+  if next_pos - 1 > #buf then return nil, pos end
+  return buf:sub(pos, next_pos - 1), next_pos
+end
+
+function binary_protocol.decode(msg)
+  local serial, type = string.unpack("<i4B", msg)
+  return serial, BINARY_TYPE_NAME[type], msg:sub(BINARY_HEADER_SIZE + 1)
+end
+
+function binary_protocol.results(content)
+  local results, pos = {}, 1
+  while pos <= #content do
+    local status, msg
+    status, msg, pos = string.unpack("Bs1", content, pos)
+    results[#results + 1] = BINARY_TYPE_NAME[status]
+    results[#results + 1] = msg
+  end
+  return results
+end
+
+function binary_protocol.fields(content)
+  local fields, pos = {}, 1
+  while pos <= #content do
+    local name, value
+    name, value, pos = string.unpack("<s1I8", content, pos)
+    fields[name] = value
+  end
+  return fields
+end
+
+function binary_protocol.theme(content)
+  return content:byte(1) == 1
+end
+
+function binary_protocol.accent(content)
+  local opaque, color, pos = string.unpack("<BI4", content)
+  local variants = {}
+  while pos + 3 <= #content do
+    variants[#variants + 1], pos = parse_color(string.unpack("<I4", content, pos)), pos + 4
+  end
+  return parse_color(color), opaque == 1, variants
+end
+
+
 --- Creates the new monitor process.
 function Monitor:new()
   ---A command to be sent to the monitor.
+  ---The arguments of the command are stored in the array part.
   ---@class Command
-  ---@field cmd string the command
+  ---@field type string the command type
+  ---@field unbatched boolean? if true, the command is never sent in a batch, as its response can be large
+  ---@field ordered boolean? if true, the command is never merged with an identical queued one,
+  ---as its effect depends on the commands sent before it
   ---@field cb fun(res: string, err: string): nil the callback to run when a response is received
 
+  ---A command (or batch of commands) that has been sent and is awaiting results.
+  ---@class InFlight
+  ---@field batch Command[]? the commands of a batch
+  ---@field deadline number the time after which the commands time out
+
   ---A queue of items should be sent when the monitor is ready.
   ---@type Command[]
   self.pending = {}
-  ---A map of commands that have been sent and is awaiting results, identified by their serial.
-  ---@type {string: Command}
+  ---A queue of commands sent during the current frame, flushed by Monitor:flush().
+  ---@type Command[]
+  self.queue = {}
+  ---The commands awaiting results, in the slot serial % MAX_IN_FLIGHT + 1, or false.
+  ---@type (Command | InFlight | false)[]
   self.sent = {}
-  ---A queue of received responses from the monitor waiting to be processed.
-  ---@type string[]
+  ---The serial of the command in each slot of self.sent.
+  ---@type integer[]
+  self.sent_serial = {}
+  for i = 1, MAX_IN_FLIGHT do
+    self.sent[i], self.sent_serial[i] = false, -1
+  end
+  ---The number of commands awaiting results, and the oldest serial that might be one of them.
+  self.sent_count, self.sent_oldest = 0, 0
+  ---A queue of received responses from the monitor waiting to be processed,
+  ---from self.recv_head to self.recv_tail.
+  ---@type {integer: string}
   self.received = {}
-  ---The last fragment received from the monitor.
+  self.recv_head, self.recv_tail = 1, 0
+  ---The data received from the monitor that has not been parsed into messages yet,
+  ---starting at self.buf_pos. Bytes before self.buf_scan are known to not complete a message.
   ---@type string
-  self.last_fragment = ""
+  self.buf = ""
+  self.buf_pos, self.buf_scan = 1, 1
   ---Indicates whether the monitor is ready to receive commands.
   ---@type boolean
   self.ready = false
@@ -200,14 +560,86 @@ function Monitor:new()
   ---The monitor process.
   ----@type Process
   self.proc = nil
+  ---The monitor loaded in the editor process, used instead of self.proc if set.
+  ---@type userdata | nil
+  self.native = nil
+  ---The protocol used to talk to the monitor.
+  ---@type Protocol
+  self.protocol = text_protocol
+  ---The handle of the window, reported by the monitor so that the next one can skip looking for it.
+  ---@type integer | nil
+  self.window = nil
+  ---The time the monitor was started.
+  ---@type number
+  self.start_time = 0
+  ---The topics the monitor will be subscribed to once every command sent is handled.
+  ---@type integer
+  self.topics = TOPIC_ALL
 end
 
 
----Starts the monitor process.
+---Loads the monitor into the editor process.
+---@return boolean true if it was loaded
+function Monitor:_open_native()
+  local path = get_exe_path(C.native_paths)
+  if not path then return false end
+  local native, err
+  local open_module, load_err = package.loadlib(path, "luaopen_monitor_native")
+  if open_module then
+    -- a module that raises while opening is no worse than one that can't be loaded
+    local ok, result, open_err = pcall(function() return open_module().open() end)
+    if ok then
+      native, err = result, open_err
+    else
+      err = result
+    end
+  end
+  if not native then
+    core.log_quiet("immersive_title: cannot load %s, starting the monitor instead: %s", path, err or load_err)
+    return false
+  end
+  self.native = native
+  self.protocol = binary_protocol
+  self.topics = TOPIC_ALL
+  self.start_time = system.get_time()
+  return true
+end
+
+
+---Starts the monitor process, or loads the monitor into the editor process.
 function Monitor:start()
-  if self.proc then return end
+  if self.proc or self.native then return end
+  -- the Windows monitor has no daemon and would refuse --attach
+  local daemon_socket = PLATFORM ~= "Windows" and C.daemon_socket
+  if C.native_module and not daemon_socket and self:_open_native() then return end
   local exec_path = assert(get_exe_path(C.monitor_paths), "cannot find monitor")
-  self.proc = assert(process.start({ exec_path, system.get_process_id(), C.class_name }, {
+  local args = { exec_path, system.get_process_id(), C.class_name }
+  if C.binary_protocol then
+    args[#args+1] = "--binary"
+    self.protocol = binary_protocol
+  else
+    self.protocol = text_protocol
+  end
+  if daemon_socket then
+    -- the monitor only relays to the daemon, and starts it if there is none
+    args[#args+1] = "--attach"
+    args[#args+1] = daemon_socket
+  end
+  if C.single_thread and PLATFORM ~= "Windows" then
+    args[#args+1] = "--reactor"
+  end
+  if C.max_message_size then
+    args[#args+1] = "--max-message"
+    args[#args+1] = tostring(C.max_message_size)
+  end
+  if self.window then
+    args[#args+1] = "--window"
+    args[#args+1] = tostring(self.window)
+  end
+  self.buf, self.buf_pos, self.buf_scan = "", 1, 1
+  self.topics = TOPIC_ALL
+  self.start_time = system.get_time()
+  self.proc = assert(process.start(args, {
     stdin = process.REDIRECT_PIPE,
     stdout = process.REDIRECT_PIPE,
     stderr = process.REDIRECT_STDOUT
@@ -215,16 +647,66 @@ function Monitor:start()
 end
 
 
+---Checks if two commands have the same type and arguments.
+---@param a Command
+---@param b Command
+---@return boolean
+local function same_command(a, b)
+  if a.ordered or b.ordered then return false end
+  if a.type ~= b.type or #a ~= #b or a.unbatched ~= b.unbatched then return false end
+  for i = 1, #a do
+    if a[i] ~= b[i] then return false end
+  end
+  return true
+end
+
+
+---Adds a command to a queue, unless an identical one is already queued,
+---in which case both callbacks get its response, like for repeated configure calls.
+---@param queue Command[]
+---@param cmd Command
+local function enqueue(queue, cmd)
+  for _, queued in ipairs(queue) do
+    if same_command(queued, cmd) then
+      if queued.cb ~= cmd.cb then
+        local queued_cb, cb = queued.cb, cmd.cb
+        queued.cb = function(res, err)
+          queued_cb(res, err)
+          cb(res, err)
+        end
+      end
+      return
+    end
+  end
+  if #queue >= MAX_QUEUED then
+    return cmd.cb(nil, "too many queued commands")
+  end
+  queue[#queue+1] = cmd
+end
+
+
 ---Sends a command to the monitor and returns the response
----@param cmd string the command
+---@param cmd Command the command, without the callback
 ---@param cb fun(response: string): nil the callback to call after a response had been received
 function Monitor:send(cmd, cb)
-  local cmd = { cmd = cmd, cb = cb }
-  if self.ready then
-    self:_send(cmd)
-  else
-    self.pending[#self.pending+1] = cmd
-  end
+  cmd.cb = cb
+  enqueue(self.ready and self.queue or self.pending, cmd)
+  self:_wake()
+end
+
+
+---Makes the polling thread run in the next frame, if it is waiting.
+function Monitor:_wake()
+  local thread = core.threads[self]
+  if thread then thread.wake = 0 end
+end
+
+
+---Checks if the monitor is expected to have something to say soon,
+---as commands are waiting to be sent, for a response or for the monitor to be ready.
+---@return boolean
+function Monitor:busy()
+  return self.sent_count > 0 or #self.queue > 0 or #self.pending > 0
 end
 
 
@@ -237,163 +719,574 @@ local function noop() end
 ---extended into the application, giving a frosted glass look.
 ---@param backdrop_type BackdropType program backdrop type.
 function Monitor:configure(extend_frame, backdrop_type)
-  self:send(string.format("config %d%d", extend_frame and 1 or 0, BACKDROP_TYPE[backdrop_type]), noop)
+  self:send({ type = "config", extend_frame and 1 or 0, BACKDROP_TYPE[backdrop_type] }, noop)
+end
+
+
+---Sets the window in which theme and accent changes are coalesced.
+---@param ms integer the window in milliseconds, 0 to disable
+function Monitor:set_debounce(ms)
+  self:send({ type = "debounce", ms }, noop)
 end
 
 
 ---Gets the current Windows App theme.
 ---@param cb fun(theme: ThemeType): nil the result callback.
 function Monitor:get_theme(cb)
-  self:send("theme ", function(res) cb(res == "1" and "dark" or "light") end)
+  self:send({ type = "theme" }, function(res, err)
+    if res then
+      cb(self.protocol.theme(res) and "dark" or "light")
+    else
+      self:on_error(err)
+    end
+  end)
 end
 
 
----Parses the color returned from the monitor.
----The color returned from the monitor is a 32-bit unsigned integer
----in the format 0xRRGGBBAA.
----@param str string the color string
----@returns Color the parsed color
-local function parse_color(str)
-  local v = tonumber(str, 10)
-  return { (v & 0xFF000000) >> 24, (v & 0xFF0000) >> 16, (v & 0xFF00) >> 8, v & 0xFF }
+---Gets the current accent color.
+---@param cb fun(color: Color, opaque: boolean, variants: Color[]): nil the result callback
+function Monitor:get_accent_color(cb)
+  self:send({ type = "accent" }, function(res, err)
+    if res then
+      cb(self.protocol.accent(res))
+    else
+      self:on_error(err)
+    end
+  end)
 end
 
 
----Gets the current accent color.
----@param cb fun(color: Color, opaque: boolean): nil the result callback
-function Monitor:get_accent_color(cb)
-  self:send("accent ", function(res)
-    local opaque, color = res:match("^(%d) (%d+)$")
-    cb(parse_color(color), opaque == "1")
+---Sets the backgrounds that the monitor calculates accent variants for.
+---Every accent is followed by a variant with sufficient contrast against each background.
+---@param ratio number the minimum contrast ratio
+---@param backgrounds Color[] the backgrounds, none to stop calculating variants
+---@param cb fun(color: Color, opaque: boolean, variants: Color[]): nil the result callback, with the current accent
+function Monitor:set_contrast(ratio, backgrounds, cb)
+  local cmd = { type = "contrast", math.floor(ratio * 100 + 0.5) }
+  for i, color in ipairs(backgrounds) do
+    cmd[i + 1] = encode_color(color)
+  end
+  self:send(cmd, function(res, err)
+    if res then
+      cb(self.protocol.accent(res))
+    else
+      self:on_error(err)
+    end
+  end)
+end
+
+
+---Gets the counters and latency histograms of the monitor.
+---@param interval integer? if set, the stats are also broadcasted every interval milliseconds, 0 to stop
+---@param cb fun(stats: table<string, integer>): nil the result callback
+function Monitor:get_stats(interval, cb)
+  -- a response in a binary batch can't hold every field
+  self:send({ type = "stats", interval, unbatched = true }, function(res, err)
+    if res then
+      cb(self.protocol.fields(res))
+    else
+      self:on_error(err)
+    end
   end)
 end
 
 
+---Sets the topics the monitor broadcasts events for, so it doesn't bother with the others.
+---Only the topics that changed since the last call are sent.
+---@param topics integer the topics, see TOPIC
+function Monitor:set_topics(topics)
+  local added, removed = topics & ~self.topics, self.topics & ~topics
+  self.topics = topics
+  if added ~= 0 then
+    self:send({ type = "subscribe", added, ordered = true }, noop)
+  end
+  if removed ~= 0 then
+    self:send({ type = "unsubscribe", removed, ordered = true }, noop)
+  end
+end
+
+
+---Gets the topics needed by the current configuration.
+---The title bar follows the system theme either way, the topics only decide what the editor is told.
+---@return integer
+local function wanted_topics()
+  return (C.adaptive_theme and TOPIC.theme or 0) | (C.adaptive_accent and TOPIC.accent or 0)
+end
+
+
+---Checks if the next serial has a free slot in the in-flight table.
+---@return boolean
+function Monitor:_can_send()
+  return not self.sent[self.serial % MAX_IN_FLIGHT + 1]
+end
+
+
+---Puts a command (or batch) in the in-flight table under the next serial.
+---@param entry Command | InFlight
+function Monitor:_track(entry)
+  local slot = self.serial % MAX_IN_FLIGHT + 1
+  entry.deadline = system.get_time() + REQUEST_TIMEOUT
+  self.sent[slot], self.sent_serial[slot] = entry, self.serial
+  self.sent_count = self.sent_count + 1
+  self.serial = self.serial + 1
+end
+
+
+---Removes a command (or batch) from the in-flight table.
+---@param serial integer
+---@return Command | InFlight | nil entry nil if the serial isn't awaiting results
+function Monitor:_untrack(serial)
+  local slot = serial % MAX_IN_FLIGHT + 1
+  local entry = self.sent[slot]
+  if not entry or self.sent_serial[slot] ~= serial then return nil end
+  self.sent[slot] = false
+  self.sent_count = self.sent_count - 1
+  if self.sent_count == 0 then
+    self.sent_oldest = self.serial
+  end
+  return entry
+end
+
+
+---Fails a command (or every command of a batch) without a response.
+---@param entry Command | InFlight
+---@param err string
+local function fail_command(entry, err)
+  if entry.batch then
+    for _, cmd in ipairs(entry.batch) do cmd.cb(nil, err) end
+  else
+    entry.cb(nil, err)
+  end
+end
+
+
+---Times out the commands whose deadline passed.
+---Commands are sent in order and have the same timeout, so only the oldest ones are checked.
+function Monitor:_expire()
+  local now
+  if self.sent_count > 0 then
+    now = system.get_time()
+    while self.sent_count > 0 do
+      local slot = self.sent_oldest % MAX_IN_FLIGHT + 1
+      local entry = self.sent[slot]
+      if entry and self.sent_serial[slot] == self.sent_oldest then
+        if entry.deadline > now then break end
+        -- the slot is free afterwards, so the next iteration moves on
+        self:_untrack(self.sent_oldest)
+        fail_command(entry, "timeout")
+      else
+        self.sent_oldest = self.sent_oldest + 1
+      end
+    end
+  end
+  if not self.ready and #self.pending > 0
+      and (now or system.get_time()) > self.start_time + REQUEST_TIMEOUT then
+    self:_fail_queued(self.pending, "timeout")
+  end
+end
+
+
+---Fails every command in a queue, which is emptied.
+---@param queue Command[]
+---@param err string
+function Monitor:_fail_queued(queue, err)
+  local cmds = table.move(queue, 1, #queue, 1, {})
+  for i = #queue, 1, -1 do queue[i] = nil end
+  for _, cmd in ipairs(cmds) do cmd.cb(nil, err) end
+end
+
+
+---Fails every command that is waiting to be sent or for a response,
+---as there won't be any.
+---@param err string
+function Monitor:_fail_all(err)
+  for slot = 1, MAX_IN_FLIGHT do
+    local entry = self.sent[slot]
+    if entry then
+      self:_untrack(self.sent_serial[slot])
+      fail_command(entry, err)
+    end
+  end
+  self:_fail_queued(self.queue, err)
+  self:_fail_queued(self.pending, err)
+end
+
+
 ---Sends a command to the monitor.
 ---@param cmd Command the command to send.
 function Monitor:_send(cmd)
-  self.proc:write(string.format("%d %s\n", self.serial, cmd.cmd))
-  self.sent[tostring(self.serial)] = cmd
-  self.serial = self.serial + 1
+  self.proc:write(self.protocol.encode(self.serial, cmd))
+  self:_track(cmd)
 end
 
 
----Sets the current theme based on Windows' theme
----if adaptive theming is enabled.
----@param type ThemeType
-local function set_theme(type)
-  -- if adaptive theming is used, change the theme
-  if C.adaptive_theme then
-    local theme = type == "dark" and C.theme_dark or C.theme_light
-    core.reload_module(theme)
+---Sends several commands to the monitor as a single batch.
+---@param cmds Command[] the commands to send.
+function Monitor:_send_batch(cmds)
+  self.proc:write(self.protocol.encode_batch(self.serial, cmds))
+  self:_track({ batch = cmds })
+end
+
+
+---Sends the commands queued during this frame, batching consecutive ones
+---as long as the batch fits in a message the monitor accepts.
+---Commands that don't fit in the in-flight table are kept for a later frame.
+function Monitor:flush()
+  if self.native then return self:_flush_native() end
+  if not self.proc then return end
+  local queue, protocol = self.queue, self.protocol
+  local max_size = C.max_message_size or DEFAULT_MAX_MESSAGE_SIZE
+  local n, i = #queue, 1
+  while i <= n and self:_can_send() do
+    local j = i
+    if not queue[i].unbatched then
+      local size = protocol.batch_overhead(self.serial) + protocol.batch_entry_size(queue[i])
+      while j < n and j - i + 1 < MAX_BATCH_SIZE and not queue[j + 1].unbatched do
+        size = size + protocol.batch_entry_size(queue[j + 1])
+        if size > max_size then break end
+        j = j + 1
+      end
+    end
+    if i == j then
+      self:_send(queue[i])
+    else
+      self:_send_batch(table.move(queue, i, j, 1, {}))
+    end
+    i = j + 1
+  end
+  if i > 1 then
+    table.move(queue, i, n, 1)
+    for k = n - i + 2, n do queue[k] = nil end
   end
 end
 
 
----Calculates the relative luminance of a color.
----@param color Color the color
----@returns number
-local function relative_luminance(color)
-  local r, g, b = table.unpack(color)
-  r = r / 255
-  g = g / 255
-  b = b / 255
-  if r <= 0.03928 then
-    r = r / 12.92
-  else
-    r = ((r + 0.055) / 1.055) ^ 2.4
+---The style fields set by a color module, captured without touching the style.
+---Namespaces such as style.syntax are captured as nested palettes.
+---@alias Palette table<string, any>
+
+---Palettes loaded from color modules, keyed by module name.
+---@type table<string, Palette | false>
+local palettes = {}
+
+---The theme names the palettes were loaded for.
+local palette_names = { dark = C.theme_dark, light = C.theme_light }
+
+---The theme whose palette was last applied, or nil if it should be applied again.
+---@type ThemeType | nil
+local applied_theme = nil
+
+
+---Creates a proxy of a style table that records writes into palette
+---and reads from palette before falling back to target.
+---@param palette Palette
+---@param target table
+---@return table
+local function palette_recorder(palette, target)
+  return setmetatable({}, {
+    __index = function(_, k)
+      local v = palette[k]
+      if v == nil then v = target[k] end
+      -- colors are arrays, everything else in a table is a namespace
+      if type(v) == "table" and v[1] == nil and getmetatable(v) == nil then
+        local nested = type(palette[k]) == "table" and palette[k] or {}
+        palette[k] = nested
+        return palette_recorder(nested, v)
+      end
+      return v
+    end,
+    __newindex = function(_, k, v) palette[k] = v end
+  })
+end
+
+
+---Loads a color module into a palette by running it against a recording style.
+---@param name string the module name, e.g. colors.default
+---@return Palette?, string?
+local function load_palette(name)
+  local path, err = package.searchpath(name, package.path)
+  if not path then return nil, err end
+  local chunk, load_err = loadfile(path)
+  if not chunk then return nil, load_err end
+
+  local palette = {}
+  local loaded_style = package.loaded["core.style"]
+  package.loaded["core.style"] = palette_recorder(palette, style)
+  local ok, run_err = pcall(chunk, name, path)
+  package.loaded["core.style"] = loaded_style
+  if not ok then return nil, run_err end
+  return palette
+end
+
+
+---Gets the palette of a color module, loading it on first use.
+---@param name string
+---@return Palette?
+local function get_palette(name)
+  if palettes[name] == nil then
+    local palette, err = load_palette(name)
+    if not palette then
+      -- remember the failure so that it is reported once
+      core.error("cannot load theme %s: %s", name, err)
+      palette = false
+    end
+    palettes[name] = palette
   end
-  if g <= 0.03928 then
-    g = g / 12.92
-  else
-    g = ((g + 0.055) / 1.055) ^ 2.4
+  return palettes[name] or nil
+end
+
+
+---Drops the cached palettes if the theme names changed.
+---@return boolean true if the palettes were dropped
+local function invalidate_palettes()
+  if C.theme_dark == palette_names.dark and C.theme_light == palette_names.light then
+    return false
   end
-  if b <= 0.03928 then
-    b = b / 12.92
-  else
-    b = ((b + 0.055) / 1.055) ^ 2.4
+  palettes = {}
+  applied_theme = nil
+  palette_names.dark, palette_names.light = C.theme_dark, C.theme_light
+  return true
+end
+
+
+---Applies the fields of a palette that differ from target.
+---@param palette Palette
+---@param target table
+local function apply_palette(palette, target)
+  for k, v in pairs(palette) do
+    local current = target[k]
+    if type(v) == "table" and v[1] == nil and type(current) == "table" then
+      apply_palette(v, current)
+    elseif current ~= v then
+      target[k] = v
+    end
   end
-  return 0.2126 * r + 0.7152 * g + 0.0722 * b
 end
 
 
----Calculates the contrast ratio between two colors.
----@param a Color the first color
----@param b Color the second color
----@returns number
-local function contrast_ratio(a, b)
-  local L1, L2 = relative_luminance(a), relative_luminance(b)
-  L1, L2 = math.max(L1, L2), math.min(L1, L2)
-  return (L1 + 0.05) / (L2 + 0.05)
+---The theme and the accent last applied, kept in C.cache_file.
+---@class ThemeCache
+---@field theme ThemeType?
+---@field accent Color? the accent reported by the monitor
+---@field caret Color? the accent, or its variant, applied to the caret
+local cache = {}
+
+---The content of the cache file when it was last read or written, so unchanged caches aren't written.
+---@type string | nil
+local cache_written = nil
+
+---When the cache changed since it was last written, or nil.
+---@type number | nil
+local cache_changed_at = nil
+
+
+---Checks if two colors are the same.
+---@param a Color?
+---@param b Color?
+---@return boolean
+local function same_color(a, b)
+  if a == nil or b == nil then return a == b end
+  for i = 1, 4 do
+    if (a[i] or 0xFF) ~= (b[i] or 0xFF) then return false end
+  end
+  return true
 end
 
 
----Gets a tint or shade of a color based on the percentage.
----@param color Color the color
----@param percentage number the percentage from 0 to 100
----@retuns Color a color that is percentage brighter/darker than the input
-local function color_shade(color, percentage)
-  percentage = 1 + percentage / 100
-  return {
-    math.min(255, math.floor(color[1] * percentage)),
-    math.min(255, math.floor(color[2] * percentage)),
-    math.min(255, math.floor(color[3] * percentage)),
-    color[4]
-  }
+---Formats the cache as lines of a name and its values.
+---@return string
+local function format_cache()
+  local lines = {}
+  if cache.theme then lines[#lines + 1] = "theme " .. cache.theme end
+  for _, name in ipairs({ "accent", "caret" }) do
+    local color = cache[name]
+    if color then
+      lines[#lines + 1] = string.format("%s %d %d %d %d", name, color[1], color[2], color[3], color[4] or 0xFF)
+    end
+  end
+  return table.concat(lines, "\n") .. "\n"
 end
 
 
----Gets the best accent color that has sufficient contrast.
----@param color Color the initial accent color
----@param background Color the background
-local function get_best_accent_color(color, background)
-  local low, high = -100, 100
-  local result = nil
-  while low <= high do
-    local mid = math.floor((low + high) / 2)
-    local c = color_shade(color, mid)
-    if contrast_ratio(c, background) >= C.min_contrast_ratio then
-      result = c
-      high = mid - 1
+---Reads the cache file, if there is one.
+local function load_cache()
+  if not C.cache_file then return end
+  -- a replacement that was cut short on Windows leaves only the temporary file
+  local fp = io.open(C.cache_file, "rb") or io.open(C.cache_file .. ".tmp", "rb")
+  if not fp then return end
+  local content = fp:read("a") or ""
+  fp:close()
+
+  for name, values in content:gmatch("(%a+) ([^\n]*)") do
+    if name == "theme" and (values == "dark" or values == "light") then
+      cache.theme = values
+    elseif name == "accent" or name == "caret" then
+      local r, g, b, a = values:match("^(%d+) (%d+) (%d+) (%d+)$")
+      if r then
+        cache[name] = { tonumber(r), tonumber(g), tonumber(b), tonumber(a) }
+      end
+    end
+  end
+  cache_written = format_cache()
+end
+
+
+---Writes the cache file if the cache changed since it was last read or written.
+---The file is replaced by renaming a complete copy over it, so it is never seen half-written.
+local function write_cache()
+  cache_changed_at = nil
+  local content = format_cache()
+  if not C.cache_file or content == cache_written then return end
+
+  local tmp = C.cache_file .. ".tmp"
+  local fp, err = io.open(tmp, "wb")
+  if fp then
+    local ok, write_err = fp:write(content)
+    fp:close()
+    if ok then
+      ok, err = os.rename(tmp, C.cache_file)
+      if not ok and PLATFORM == "Windows" then
+        -- rename can't replace a file there
+        os.remove(C.cache_file)
+        ok, err = os.rename(tmp, C.cache_file)
+      end
     else
-      low = mid + 1
+      err = write_err
+    end
+    if ok then
+      cache_written = content
+      return
+    end
+  end
+  core.log_quiet("immersive_title: cannot write %s: %s", C.cache_file, err)
+end
+
+
+---Writes the cache if it changed long enough ago, so several changes are written at once.
+---@param force boolean? write it now, like when the editor quits
+local function flush_cache(force)
+  if cache_changed_at and (force or system.get_time() - cache_changed_at >= CACHE_WRITE_DELAY) then
+    write_cache()
+  end
+end
+
+
+---Records a value that was applied, to be written to the cache later.
+---@param name string
+---@param value ThemeType | Color
+local function update_cache(name, value)
+  if type(value) == "table" then
+    if same_color(cache[name], value) then return end
+    value = { value[1], value[2], value[3], value[4] or 0xFF }
+  elseif cache[name] == value then
+    return
+  end
+  cache[name] = value
+  cache_changed_at = cache_changed_at or system.get_time()
+end
+
+
+---Sets the current theme based on Windows' theme
+---if adaptive theming is enabled.
+---@param type ThemeType
+local function set_theme(type)
+  -- if adaptive theming is used, change the theme
+  if C.adaptive_theme then
+    -- the theme may have been applied from the cache already
+    if type == applied_theme then return end
+    local palette = get_palette(type == "dark" and C.theme_dark or C.theme_light)
+    if palette then
+      apply_palette(palette, style)
+      core.redraw = true
+      applied_theme = type
+      update_cache("theme", type)
     end
   end
-  return result
 end
 
 
 ---Sets the accent color if adaptive accent is enabled.
 ---@param color Color the new accent color
 ---@param opaque boolean true if the color is an opaque blend
-local function set_accent_color(color, opaque)
+---@param variants Color[] the variants calculated by the monitor, see Monitor:update_accent()
+local function set_accent_color(color, opaque, variants)
   -- if the color is opaque, we should set the alpha to 0xFF
   if opaque then
     color[4] = 0xFF
   end
 
   if C.adaptive_accent then
-    if C.adaptive_accent_contrast then
+    update_cache("accent", color)
+    if C.adaptive_accent_contrast and variants and variants[1] then
       -- FIXME: using only style.background is unreliable
-      color = get_best_accent_color(color, style.background)
+      color = variants[1]
     end
-    style.caret = color
+    if not same_color(style.caret, color) then
+      style.caret = color
+    end
+    update_cache("caret", color)
+  end
+end
+
+
+---Applies the theme and the accent from the cache, until the monitor reports the current ones.
+local function apply_cache()
+  load_cache()
+  if cache.theme then
+    set_theme(cache.theme)
+  end
+  if cache.caret and C.adaptive_accent then
+    style.caret = { table.unpack(cache.caret) }
+  end
+end
+
+
+---Updates the accent color, asking the monitor for a variant with sufficient contrast
+---against the current background if adaptive accent contrast is enabled.
+function Monitor:update_accent()
+  if C.adaptive_accent_contrast then
+    self:set_contrast(C.min_contrast_ratio, { style.background }, set_accent_color)
+  else
+    self:set_contrast(0, {}, set_accent_color)
   end
 end
 
 
 ---A function called when the monitor is ready for commands and events.
-function Monitor:on_ready()
+---@param fields table<string, integer> the window handle and the startup phases in microseconds
+function Monitor:on_ready(fields)
+  self.window = fields.window or self.window
+  local phases = {}
+  for _, name in ipairs({ "version", "find_window", "registry", "portal", "threads", "reactor", "total", "attach" }) do
+    if fields[name] then
+      phases[#phases + 1] = string.format("%s %.2fms", name, fields[name] / 1000)
+    end
+  end
+  core.log_quiet("immersive_title: monitor ready after %.2fms (%s)",
+                  (system.get_time() - self.start_time) * 1000, table.concat(phases, ", "))
+
   -- Send configuration to the monitor
   self:configure(C.extend_frame, C.backdrop_type)
-  self:get_theme(set_theme)
-  self:get_accent_color(set_accent_color)
+  self:set_topics(wanted_topics())
+  self:set_debounce(C.event_debounce)
+  if C.stats_interval > 0 then
+    self:get_stats(C.stats_interval, function(stats) self:on_stats(stats) end)
+  end
+  self:get_theme(function(type) self:on_theme_change(type) end)
+  self:update_accent()
 
-  -- send every pending message
-  for _, payload in ipairs(self.pending) do
-    self:_send(payload)
+  -- send every pending message along with the commands above
+  for _, cmd in ipairs(self.pending) do
+    enqueue(self.queue, cmd)
   end
   self.pending = {}
+  self:flush()
+
+  if C.adaptive_theme then
+    -- load both themes while waiting for the responses, so switching is cheap
+    get_palette(C.theme_dark)
+    get_palette(C.theme_light)
+  end
 end
 
 
@@ -401,14 +1294,26 @@ end
 ---@param type ThemeType the current theme
 function Monitor:on_theme_change(type)
   set_theme(type)
+  -- the background might have changed, so the accent needs a new variant
+  if C.adaptive_theme and C.adaptive_accent and C.adaptive_accent_contrast then
+    self:update_accent()
+  end
 end
 
 
 ---A function called when the accent color changed.
 ---@param color Color the current accent color
 ---@param opaque boolean if true, the alpha value of the color should be ignored
-function Monitor:on_accent_change(color, opaque)
-  set_accent_color(color, opaque)
+---@param variants Color[] the variants calculated by the monitor
+function Monitor:on_accent_change(color, opaque, variants)
+  set_accent_color(color, opaque, variants)
+end
+
+
+---A function called when the monitor reports its stats.
+---@param stats table<string, integer> the counters and histograms, see monitor_stats.h
+function Monitor:on_stats(stats)
+  self.stats = stats
 end
 
 
@@ -419,97 +1324,193 @@ function Monitor:on_error(err)
 end
 
 
----Parses the response from the monitor.
----@param resp string the response from monitor
----@returns string string, string the serial, type and actual response
-local function parse_message(resp)
-  return resp:match("^([^ ]+) ([^ ]+) (.*)$")
+---Runs the callback of a command with its response.
+---@param cmd Command the command
+---@param type string the response type
+---@param content string the response
+function Monitor:on_response(cmd, type, content)
+  if type == "ok" then
+    cmd.cb(content)
+  elseif type == "error" then
+    cmd.cb(nil, content)
+  else
+    local err = string.format("unknown response type: %q", type)
+    self:on_error(err)
+    cmd.cb(nil, err)
+  end
 end
 
 
 ---A function called when the monitor receives a response.
 function Monitor:on_recv()
   -- drain the queue
-  while #self.received > 0 do
-    local cmd = table.remove(self.received, 1)
-    local serial, type, content = parse_message(cmd)
+  while self.recv_head <= self.recv_tail do
+    local cmd = self.received[self.recv_head]
+    self.received[self.recv_head] = nil
+    self.recv_head = self.recv_head + 1
+    local serial, type, content = self.protocol.decode(cmd)
 
-    if serial == "-1" then
+    if serial == -1 then
       if type == "ready" then
         self.ready = true
-        self:on_ready()
+        self:on_ready(self.protocol.fields(content))
       elseif type == "themechange" then
-        self:on_theme_change(content == "1" and "dark" or "light")
+        self:on_theme_change(self.protocol.theme(content) and "dark" or "light")
       elseif type == "accentchange" then
-        local opaque, color = content:match("^(%d) (%d+)$")
-        self:on_accent_change(parse_color(color), opaque == "1")
+        self:on_accent_change(self.protocol.accent(content))
+      elseif type == "stats" then
+        self:on_stats(self.protocol.fields(content))
       elseif type == "error" then
         self:on_error(content)
       else
         self:on_error(string.format("unknown broadcast: %q", content))
       end
     else
-      -- remove message from sent queue
-      local sent_message = self.sent[serial]
-      self.sent[serial] = nil
-      if sent_message then
+      local sent_message = self:_untrack(serial)
+      if sent_message and sent_message.batch then
         if type == "ok" then
-          sent_message.cb(content)
-        elseif type == "error" then
-          sent_message.cb(nil, content)
+          -- failed commands get an error and the batch goes on,
+          -- but the commands after an exit are not executed and get no response
+          local results = self.protocol.results(content)
+          for i, batch_cmd in ipairs(sent_message.batch) do
+            if results[i * 2 - 1] then
+              self:on_response(batch_cmd, results[i * 2 - 1], results[i * 2])
+            else
+              batch_cmd.cb(nil, "no response in batch")
+            end
+          end
         else
-          self:on_error(string.format("unknown response type: %q", type))
+          for _, batch_cmd in ipairs(sent_message.batch) do
+            self:on_response(batch_cmd, type, content)
+          end
         end
-      else
-        self:on_error(string.format("unknown serial: %q", serial))
+      elseif sent_message then
+        self:on_response(sent_message, type, content)
+      elseif serial >= self.serial then
+        -- anything older timed out and already got its callback
+        self:on_error(string.format("unknown serial: %q", tostring(serial)))
       end
     end
   end
+  self.recv_head, self.recv_tail = 1, 0
+end
+
+
+---Runs the commands queued during this frame in the native monitor, which answers right away.
+---Commands queued by the callbacks are run in the next frame.
+function Monitor:_flush_native()
+  local queue = self.queue
+  self.queue = {}
+  for _, cmd in ipairs(queue) do
+    cmd.cb(self.native:request(binary_command(cmd)))
+  end
 end
 
 
 ---Stops the monitor.
 function Monitor:stop()
+  if not self.proc and not self.native then return end
   self:configure(false, "default")
-  self.proc:terminate()
-  self.proc:wait(50)
-  self.proc:kill()
-  self.proc = nil
+  self:flush()
+  if self.native then
+    self.native:close()
+    self.native = nil
+  else
+    self.proc:terminate()
+    self.proc:wait(50)
+    self.proc:kill()
+    self.proc = nil
+  end
   self.ready = false
+  -- nothing will answer, and the editor is going away anyway
+  for slot = 1, MAX_IN_FLIGHT do self.sent[slot] = false end
+  self.sent_count, self.sent_oldest = 0, self.serial
+  self.queue, self.pending = {}, {}
+end
+
+
+---Handles the events of the native monitor, which also runs its timers.
+---@return boolean true if there were any
+function Monitor:_poll_native()
+  local events, err = self.native:poll_events()
+  for _, event in ipairs(events) do
+    if event.type == "ready" then
+      self.ready = true
+      self:on_ready(event.fields)
+    elseif event.type == "themechange" then
+      self:on_theme_change(event.dark and "dark" or "light")
+    elseif event.type == "accentchange" then
+      for i, variant in ipairs(event.variants) do
+        event.variants[i] = parse_color(variant)
+      end
+      self:on_accent_change(parse_color(event.color), event.opaque, event.variants)
+    elseif event.type == "stats" then
+      self:on_stats(event.fields)
+    else
+      self:on_error(event.message)
+    end
+  end
+  if err then
+    self.native:close()
+    self.native = nil
+    self.ready = false
+    self:_fail_all(err)
+    self:on_error(err)
+  end
+  return #events > 0
 end
 
 
 ---Polls the monitor for more messages.
+---@return boolean true if anything was received
 function Monitor:poll()
+  if self.native then return self:_poll_native() end
+  if not self.proc then return false end
   local buf, err = self.proc:read_stdout()
   if not buf then
+    -- the monitor is gone, so stop reading from it every frame
+    self.proc = nil
     self.ready = false
-    return self:on_error(err)
+    self:_fail_all(err or "monitor exited")
+    self:on_error(err or "monitor exited")
+    return false
   end
 
-  buf = self.last_fragment .. buf
   if buf == "" then
-    return
+    self:_expire()
+    return false
   end
 
-  local last_pos
-  local n = #self.received
-  for cmd, pos in buf:gmatch("([^\r\n]+)\r?\n()") do
-    self.received[#self.received + 1] = cmd
-    last_pos = pos + 1
+  -- only keep the unparsed tail of the previous read around
+  if self.buf_pos > #self.buf then
+    self.buf, self.buf_scan = buf, 1
+  else
+    self.buf = self.buf:sub(self.buf_pos) .. buf
+    self.buf_scan = self.buf_scan - self.buf_pos + 1
   end
+  self.buf_pos = 1
 
-  -- if there is something left after parsing, we'll save it
-  if last_pos then
-    self.last_fragment = buf:sub(last_pos)
-  else
-    self.last_fragment = buf
+  local tail = self.recv_tail
+  while true do
+    local msg, pos = self.protocol.next(self.buf, self.buf_pos, self.buf_scan)
+    if not msg then
+      self.buf_scan = pos
+      break
+    end
+    -- empty lines carry nothing
+    if msg ~= "" then
+      self.recv_tail = self.recv_tail + 1
+      self.received[self.recv_tail] = msg
+    end
+    self.buf_pos, self.buf_scan = pos, pos
   end
 
   -- if there's something in the queue, process it
-  if #self.received ~= n then
+  if self.recv_tail ~= tail then
     self:on_recv()
   end
+  self:_expire()
+  return true
 end
 
 
@@ -519,18 +1520,41 @@ local monitor = Monitor()
 
 function on_config_change()
   if not monitor then return end
+  if not C.adaptive_theme then
+    -- the theme may be changed by hand until adaptive theming is back
+    applied_theme = nil
+  end
   monitor:configure(C.extend_frame, C.backdrop_type)
+  monitor:set_topics(wanted_topics())
+  if invalidate_palettes() and C.adaptive_theme then
+    monitor:get_theme(function(type) monitor:on_theme_change(type) end)
+  end
   if C.adaptive_accent then
-    monitor:get_accent_color(set_accent_color)
+    monitor:update_accent()
   elseif default_accent then
     style.caret = default_accent
   end
 end
 
 
+command.add(nil, {
+  ["immersive-title:show-stats"] = function()
+    monitor:get_stats(nil, function(stats)
+      monitor:on_stats(stats)
+      local names = {}
+      for name in pairs(stats) do names[#names + 1] = name end
+      table.sort(names)
+      for i, name in ipairs(names) do names[i] = name .. "=" .. stats[name] end
+      core.log("immersive_title: %s", table.concat(names, " "))
+    end)
+  end,
+})
+
+
 local core_quit = core.quit
 function core.quit(force)
   monitor:stop()
+  flush_cache(true)
   return core_quit(force)
 end
 
@@ -538,6 +1562,7 @@ end
 local core_restart = core.restart
 function core.restart()
   monitor:stop()
+  flush_cache(true)
   return core_restart()
 end
 
@@ -545,12 +1570,22 @@ end
 core.add_thread(function()
   -- save the color once again just in case someone tried to change the color
   default_accent = style.caret
+  apply_cache()
   monitor:start()
-  while true do
-    monitor:poll()
-    coroutine.yield(0)
+  local interval = 0
+  -- there is nothing left to poll once the monitor is gone
+  while monitor.proc or monitor.native do
+    local received = monitor:poll()
+    monitor:flush()
+    flush_cache()
+    if received or monitor:busy() then
+      interval = 0
+    else
+      interval = math.min(math.max(interval * 2, POLL_IDLE_INTERVAL), C.poll_interval_max)
+    end
+    coroutine.yield(interval)
   end
-end)
+end, monitor)
 
 
 return monitor
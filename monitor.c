@@ -3,10 +3,16 @@
 #endif
 
 #include <stdio.h>
-#include <stdarg.h>
+#include <string.h>
+#include <errno.h>
+#include <io.h>
+#include <fcntl.h>
 #include <windows.h>
 #include <dwmapi.h>
 
+#include "monitor_core.h"
+#include "monitor_trace.h"
+
 
 // definitions for DwmSetWindowAttribute
 #ifndef DWMWA_USE_IMMERSIVE_DARK_MODE
@@ -33,128 +39,28 @@ uintptr_t _beginthreadex( // NATIVE CODE
 
 
 #define MAX_CLASS_SIZE 512
-#define BUFFER_SIZE 512
-
-#define CMD_CONFIG "config"
-#define CMD_THEME "theme"
-#define CMD_EXIT "exit"
-#define CMD_ACCENT "accent"
-
-#define RESPONSE_OK "ok"
-#define RESPONSE_ERROR "error"
-
-#define BROADCAST_ACCENTCHANGE "accentchange"
-#define BROADCAST_THEMECHANGE "themechange"
-#define BROADCAST_ERROR "error"
-#define BROADCAST_READY "ready"
+#define MAX_READY_FIELDS 10
 
 #define WIN10_BUILD_NUMBER 18362
 #define WIN11_BUILD_NUMBER 22000
 #define WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER 22621
 
 
-typedef enum {
-    BACKDROP_DEFAULT,
-    BACKDROP_NONE,
-    BACKDROP_MICA,
-    BACKDROP_ACRYLIC,
-    BACKDROP_TABBED,
-    BACKDROP_MAX,
-} window_backdrop_e;
-
-typedef enum {
-    CONFIG_DARK_MODE = 1,
-    CONFIG_EXTEND_BORDER = 2,
-    CONFIG_BACKDROP_TYPE = 4
-} config_changed_e;
-
-typedef struct window_config_s {
+typedef struct platform_win32_s {
     DWORD pid;
+    // the first window found, the others are only known by config
     HWND window;
+    HANDLE process;
+    window_config_t *config;
     HKEY regkey;
-    int dark_mode, extend_border;
-    window_backdrop_e backdrop_type;
-    config_changed_e mask;
-    CONDITION_VARIABLE config_changed;
-    CRITICAL_SECTION mutex;
     OSVERSIONINFOEXA version;
     char class[MAX_CLASS_SIZE];
-} window_config_t;
-
-
-/**
- * This program communicates via newline (\n) terminated messages.
- * The message should not exceed 512 bytes in size, including the newline.
- * The message follows a specific format:
- * serial " " type " " response?
- * 
- * serial refers to an arbitary value that is sent via the client
- * that is used to identify the response.
- * This value is preferrably a number, but it can be anything that
- * does not contains a space (" ") character.
- * Note that -1 is reserved for broadcasts.
- * 
- * type is the type of message or response.
- * 
- * Anything after type is intepreted as the content.
- * This content is delimited by a single space (" ") and can be optional.
- * "-1 error " is a valid message.
- * 
- * A response have the format of:
- * serial " " status " " message
- * 
- * serial is the serial of the incoming message,
- * while status can be "ok" or "error" to denote a successful or failed operation
- * respectively.
- * message is optional, and in case of errors, will be the error message.
- */
-static void log_response(const char *serial, const char *type, const char *fmt, ...) {
-    va_list ap;
-    printf("%s %s ", serial, type);
-    va_start(ap, fmt);
-    vprintf(fmt, ap);
-    va_end(ap);
-    putc('\n', stdout);
-}
-
+    // every DWM call is timed here
+    monitor_stats_t *stats;
+} platform_win32_t;
 
-#define log_broadcast(type, fmt, ...) (printf("-1 " type " " fmt "\n", __VA_ARGS__))
-#define log_error(fmt, ...) (log_broadcast(BROADCAST_ERROR, fmt, __VA_ARGS__))
 
-
-static int parse_message(char *msg, char **serial, char **type, char **content) {
-    char *p, *_serial, *_type, *_content;
-    p = _serial = _type = _content = NULL;
-
-#define NEXT_TOKEN() do { \
-        p = strchr(msg, ' '); \
-        if (!p) return 0; \
-        *p = '\0'; \
-    } while (0)
-#define NEXT_TOKEN_END() msg = p + 1
-
-    // find the serial
-    NEXT_TOKEN();
-    _serial = msg;
-    NEXT_TOKEN_END();
-    // find the type
-    NEXT_TOKEN();
-    _type = msg;
-    NEXT_TOKEN_END();
-    // content is the rest of the string
-    _content = msg;
-
-    *serial = _serial;
-    *type = _type;
-    *content = _content;
-
-    return 1;
-#undef NEXT_TOKEN
-#undef NEXT_TOKEN_END
-}
-
-
-static void log_win32_response(const char *serial, const char *type, const char *function_name, DWORD rc) {
+static void win32_error(monitor_error_t *err, const char *function_name, DWORD rc) {
     LPSTR msg = NULL;
     FormatMessageA(FORMAT_MESSAGE_ALLOCATE_BUFFER
                     | FORMAT_MESSAGE_FROM_SYSTEM
@@ -165,17 +71,20 @@ static void log_win32_response(const char *serial, const char *type, const char
                     (LPSTR) &msg,
                     0,
                     NULL);
-    log_response(serial, type, "%s: %s", function_name, msg ? msg : "unknown error");
+    snprintf(err->message, sizeof(err->message), "%s: %s", function_name, msg ? msg : "unknown error");
     LocalFree(msg);
 }
 
 
-#define log_win32_error(name, rc) (log_win32_response("-1", BROADCAST_ERROR, name, rc))
+#define log_win32_error(config, name, rc) do { \
+        monitor_error_t err; \
+        win32_error(&err, (name), (rc)); \
+        log_error((config), "%s", err.message); \
+    } while (0)
 
 
 static LSTATUS is_dark_mode(HKEY regkey, int *is_dark) {
     LSTATUS rc;
-    HKEY key = NULL;
     DWORD type, value, size = 4;
 
     rc = RegQueryValueEx(regkey,
@@ -194,7 +103,188 @@ static LSTATUS is_dark_mode(HKEY regkey, int *is_dark) {
 }
 
 
-#define ARGB_RGBA(V) ((((V) & 0xFF000000) >> 24) | (((V) & 0x00FFFFFF) << 8))
+static int win32_is_window(void *ud) {
+    platform_win32_t *win32 = (platform_win32_t *) ud;
+    // windows come and go, the target is alive as long as its process is
+    return win32->process && WaitForSingleObject(win32->process, 0) == WAIT_TIMEOUT;
+}
+
+
+static int win32_supports_backdrop(void *ud, window_backdrop_e type, monitor_error_t *err) {
+    platform_win32_t *win32 = (platform_win32_t *) ud;
+    // windows 10 doesn't support backdrop,
+    // certain windows 11 version only supports mica
+    if ((win32->version.dwBuildNumber < WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER
+                && type != BACKDROP_MICA
+                && type != BACKDROP_DEFAULT
+                && type != BACKDROP_NONE)
+            || (win32->version.dwBuildNumber < WIN11_BUILD_NUMBER)) {
+        snprintf(err->message, sizeof(err->message), "backdrop type unsupported by Windows version");
+        return 0;
+    }
+    return 1;
+}
+
+
+static int win32_get_dark_mode(void *ud, int *is_dark, monitor_error_t *err) {
+    LSTATUS rc = is_dark_mode(((platform_win32_t *) ud)->regkey, is_dark);
+    if (rc != ERROR_SUCCESS) {
+        win32_error(err, "is_dark_mode", rc);
+        return 0;
+    }
+    return 1;
+}
+
+
+static int win32_get_accent(void *ud, unsigned long *color, int *opaque, monitor_error_t *err) {
+    HRESULT hr;
+    DWORD value;
+    BOOL is_opaque;
+    (void) ud;
+
+    hr = DwmGetColorizationColor(&value, &is_opaque);
+    if (FAILED(hr)) {
+        win32_error(err, "DwmGetColorizationColor", HRESULT_CODE(hr));
+        return 0;
+    }
+    *color = value;
+    *opaque = is_opaque;
+    return 1;
+}
+
+
+static int win32_apply(void *ud, uint64_t window, const window_attrs_t *attrs, config_changed_e mask, monitor_error_t *err) {
+    HWND hwnd = (HWND) (uintptr_t) window;
+    HRESULT hr;
+    MARGINS m = { 0 };
+    DWORD value;
+    uint64_t start;
+    platform_win32_t *win32 = (platform_win32_t *) ud;
+
+    // extend the frame
+    if (mask & CONFIG_EXTEND_BORDER) {
+        if (attrs->extend_border)
+            m.cxLeftWidth = m.cxRightWidth = m.cyBottomHeight = m.cyTopHeight = -1;
+        start = monitor_now_ns();
+        hr = DwmExtendFrameIntoClientArea(hwnd, &m);
+        monitor_stats_record(win32->stats, HIST_DWM_EXTEND_FRAME, monitor_now_ns() - start);
+        if (FAILED(hr)) {
+            win32_error(err, "DwmExtendFrameIntoClientArea", HRESULT_CODE(hr));
+            return 0;
+        }
+    }
+
+    // set window light/dark theme
+    if (mask & CONFIG_DARK_MODE) {
+        value = attrs->dark_mode;
+        start = monitor_now_ns();
+        hr = DwmSetWindowAttribute(hwnd,
+                                    DWMWA_USE_IMMERSIVE_DARK_MODE,
+                                    &value,
+                                    sizeof(DWORD));
+        monitor_stats_record(win32->stats, HIST_DWM_DARK_MODE, monitor_now_ns() - start);
+        if (FAILED(hr)) {
+            win32_error(err, "DwmSetWindowAttribute(DWMMA_USE_IMMERSIVE_DARK_MODE)", HRESULT_CODE(hr));
+            return 0;
+        }
+    }
+
+    // set window backdrop
+    if (mask & CONFIG_BACKDROP_TYPE) {
+        if (win32->version.dwBuildNumber >= WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER) {
+            value = attrs->backdrop_type;
+            start = monitor_now_ns();
+            hr = DwmSetWindowAttribute(hwnd,
+                                        DWMWA_SYSTEMBACKDROP_TYPE,
+                                        &value,
+                                        sizeof(DWORD));
+            monitor_stats_record(win32->stats, HIST_DWM_BACKDROP, monitor_now_ns() - start);
+            if (FAILED(hr)) {
+                win32_error(err, "DwmSetWindowAttribute(DWMWA_SYSTEMBACKDROP_TYPE)", HRESULT_CODE(hr));
+                return 0;
+            }
+        } else {
+            // on older versions we should use another method that only supports mica
+            value = attrs->backdrop_type == BACKDROP_MICA;
+            start = monitor_now_ns();
+            hr = DwmSetWindowAttribute(hwnd,
+                                        DWMWA_USE_MICA,
+                                        &value,
+                                        sizeof(DWORD));
+            monitor_stats_record(win32->stats, HIST_DWM_BACKDROP, monitor_now_ns() - start);
+            if (FAILED(hr)) {
+                win32_error(err, "DwmSetWindowAttribute(DWMWA_USE_MICA)", HRESULT_CODE(hr));
+                return 0;
+            }
+        }
+    }
+    return 1;
+}
+
+
+static const monitor_platform_t platform_win32 = {
+    &win32_is_window,
+    &win32_supports_backdrop,
+    &win32_get_dark_mode,
+    &win32_get_accent,
+    &win32_apply,
+};
+
+
+/**
+ * Checks if a window, like the one passed with --window, belongs to the target.
+ */
+static int is_target_window(platform_win32_t *target, HWND hwnd) {
+    DWORD pid;
+    char buffer[MAX_CLASS_SIZE];
+    return IsWindow(hwnd)
+            && GetWindowThreadProcessId(hwnd, &pid)
+            && pid == target->pid
+            && GetClassNameA(hwnd, buffer, MAX_CLASS_SIZE)
+            && strcmp(buffer, target->class) == 0;
+}
+
+
+/**
+ * Adds every window of the target to its config, the first one is also kept in target->window.
+ */
+BOOL CALLBACK enum_window_proc(HWND hwnd, LPARAM lparam) {
+    DWORD pid;
+    char buffer[MAX_CLASS_SIZE];
+    platform_win32_t *target = (platform_win32_t *) lparam;
+    if (!GetWindowThreadProcessId(hwnd, &pid)
+        || !GetClassNameA(hwnd, buffer, MAX_CLASS_SIZE))
+        return FALSE;
+    if (pid == target->pid && strcmp(buffer, target->class) == 0) {
+        if (!target->window)
+            target->window = hwnd;
+        monitor_on_window_created(target->config, (uintptr_t) hwnd);
+    }
+    return TRUE;
+}
+
+
+// WinEvent hooks have no userdata, and there is a single target
+static platform_win32_t *hook_target;
+
+/**
+ * Follows the top-level windows of the target as they are created and destroyed.
+ */
+void CALLBACK win_event_proc(HWINEVENTHOOK hook, DWORD event, HWND hwnd, LONG id_object, LONG id_child,
+                                DWORD thread, DWORD time) {
+    (void) hook;
+    (void) thread;
+    (void) time;
+
+    if (!hwnd || id_object != OBJID_WINDOW || id_child != CHILDID_SELF)
+        return;
+    if (event == EVENT_OBJECT_DESTROY) {
+        // the window is gone by now, so it can't be checked, but unknown windows are ignored
+        monitor_on_window_destroyed(hook_target->config, (uintptr_t) hwnd);
+    } else if (GetAncestor(hwnd, GA_ROOT) == hwnd && is_target_window(hook_target, hwnd)) {
+        monitor_on_window_created(hook_target->config, (uintptr_t) hwnd);
+    }
+}
 
 
 LRESULT CALLBACK theme_monitor_wndproc(HWND hwnd, UINT msg, WPARAM wparam, LPARAM lparam) {
@@ -211,30 +301,13 @@ LRESULT CALLBACK theme_monitor_wndproc(HWND hwnd, UINT msg, WPARAM wparam, LPARA
     case WM_SETTINGCHANGE:
         if (lparam && strcmp((char *) lparam, "ImmersiveColorSet") == 0) {
             // theme changed
-            int value = 0;
-            LRESULT rc;
-            EnterCriticalSection(&config->mutex);
-            if ((rc = is_dark_mode(config->regkey, &value)) != ERROR_SUCCESS) {
-                log_win32_error("is_dark_mode", rc);
-                LeaveCriticalSection(&config->mutex);
-                return FALSE;
-            }
-            if (value != config->dark_mode) {
-                config->dark_mode = value;
-                config->mask |= CONFIG_DARK_MODE;
-                log_broadcast(BROADCAST_THEMECHANGE, "%d", config->dark_mode);
-                WakeConditionVariable(&config->config_changed);
-            }
-            LeaveCriticalSection(&config->mutex);
+            monitor_on_theme_change(config);
             return FALSE;
         }
         break;
 
     case WM_DWMCOLORIZATIONCOLORCHANGED:
-        // lock the mutex so we don't interrupt a response
-        EnterCriticalSection(&config->mutex);
-        log_broadcast(BROADCAST_ACCENTCHANGE, "%d %lu", (BOOL) lparam, ARGB_RGBA((DWORD) wparam));
-        LeaveCriticalSection(&config->mutex);
+        monitor_on_accent_change(config, (DWORD) wparam, (BOOL) lparam);
         return 0;
     }
     return DefWindowProc(hwnd, msg, wparam, lparam);
@@ -245,6 +318,7 @@ static unsigned __stdcall theme_monitor_proc(void *ud) {
     MSG msg;
     WNDCLASS wc = { 0 };
     HWND dummy_window = NULL;
+    HWINEVENTHOOK hook;
     char class_name[] = "dummy";
     window_config_t *config = (window_config_t *) ud;
 
@@ -253,7 +327,7 @@ static unsigned __stdcall theme_monitor_proc(void *ud) {
     wc.lpszClassName = class_name;
 
     if (!RegisterClassA(&wc)) {
-        log_win32_error("RegisterClassA", GetLastError());
+        log_win32_error(config, "RegisterClassA", GetLastError());
         return 0;
     }
     dummy_window = CreateWindowExA(0,
@@ -269,327 +343,249 @@ static unsigned __stdcall theme_monitor_proc(void *ud) {
                                     NULL,
                                     ud);
     if (!dummy_window) {
-        log_win32_error("CreateWindowExA", GetLastError());
+        log_win32_error(config, "CreateWindowExA", GetLastError());
         return 0;
     }
 
-    while (GetMessageA(&msg, dummy_window, 0, 0)) {
+    hook_target = (platform_win32_t *) config->platform_ud;
+    hook = SetWinEventHook(EVENT_OBJECT_CREATE, EVENT_OBJECT_DESTROY, NULL, &win_event_proc,
+                            hook_target->pid, 0, WINEVENT_OUTOFCONTEXT);
+    if (!hook) {
+        log_win32_error(config, "SetWinEventHook", GetLastError());
+    } else if (!EnumWindows(&enum_window_proc, (LPARAM) hook_target) && GetLastError() != ERROR_SUCCESS) {
+        // windows opened before the hook, or skipped with --window, are found again
+        log_win32_error(config, "EnumWindows", GetLastError());
+    }
+
+    // the hook is called from this loop as well, so it isn't limited to the dummy window
+    while (GetMessageA(&msg, NULL, 0, 0)) {
         TranslateMessage(&msg);
         DispatchMessageA(&msg);
     }
 
+    if (hook)
+        UnhookWinEvent(hook);
     DestroyWindow(dummy_window);
+    monitor_stop(config);
     return 0;
 }
 
 
-static unsigned __stdcall config_change_proc(void *ud) {
-    HRESULT hr;
-    window_config_t *config = (window_config_t *) ud;
-
-    for (;;) {
-        MARGINS m = { 0 };
-        DWORD value;
-
-        // once again, we must call LeaveCriticalSection when breaking!
-        EnterCriticalSection(&config->mutex);
-
-        while (config->window && !config->mask)
-            SleepConditionVariableCS(&config->config_changed, &config->mutex, INFINITE);
-
-        if (!config->window) {
-            LeaveCriticalSection(&config->mutex);
-            break;
-        }
-
-        // extend the frame
-        if (config->mask & CONFIG_EXTEND_BORDER) {
-            if (config->extend_border)
-                m.cxLeftWidth = m.cxRightWidth = m.cyBottomHeight = m.cyTopHeight = -1;
-            hr = DwmExtendFrameIntoClientArea(config->window, &m);
-            if (FAILED(hr)) {
-                log_win32_error("DwmExtendFrameIntoClientArea", HRESULT_CODE(hr));
-                LeaveCriticalSection(&config->mutex);
-                break;
-            }
-        }
-
-        // set window light/dark theme
-        if (config->mask & CONFIG_DARK_MODE) {
-            value = config->dark_mode;
-            hr = DwmSetWindowAttribute(config->window,
-                                        DWMWA_USE_IMMERSIVE_DARK_MODE,
-                                        &value,
-                                        sizeof(DWORD));
-            if (FAILED(hr)) {
-                log_win32_error("DwmSetWindowAttribute(DWMMA_USE_IMMERSIVE_DARK_MODE)", HRESULT_CODE(hr));
-                LeaveCriticalSection(&config->mutex);
-                break;
-            }
-        }
-
-        // set window backdrop
-        if (config->mask & CONFIG_BACKDROP_TYPE) {
-            if (config->version.dwBuildNumber >= WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER) {
-                value = config->backdrop_type;
-                hr = DwmSetWindowAttribute(config->window,
-                                            DWMWA_SYSTEMBACKDROP_TYPE,
-                                            &value,
-                                            sizeof(DWORD));
-                if (FAILED(hr)) {
-                    log_win32_error("DwmSetWindowAttribute(DWMWA_SYSTEMBACKDROP_TYPE)", HRESULT_CODE(hr));
-                    LeaveCriticalSection(&config->mutex);
-                    break;
-                }
-            } else if (config->version.dwBuildNumber < WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER) {
-                // on older versions we should use another method that only supports mica
-                value = config->backdrop_type == BACKDROP_MICA;
-                hr = DwmSetWindowAttribute(config->window,
-                                            DWMWA_USE_MICA,
-                                            &value,
-                                            sizeof(DWORD));
-                if (FAILED(hr)) {
-                    log_win32_error("DwmSetWindowAttribute(DWMWA_USE_MICA)", HRESULT_CODE(hr));
-                    LeaveCriticalSection(&config->mutex);
-                    break;
-                }
-            } else {
-                log_error("unsupported windows version for backdrop type %d", config->backdrop_type);
-            }
-        }
-
-        // clear config mask
-        config->mask = 0;
-        LeaveCriticalSection(&config->mutex);
-    }
+static unsigned __stdcall read_input_proc(void *ud) {
+    monitor_read_loop((window_config_t *) ud, _fileno(stdin));
+    // let the apply loop in the main thread know that we're done
+    monitor_stop((window_config_t *) ud);
     return 0;
 }
 
 
-static unsigned __stdcall read_input_proc(void *ud) {
-    char buffer[BUFFER_SIZE];
-    window_config_t *config = (window_config_t *) ud;
-
-    while (fgets(buffer, sizeof(buffer), stdin)) {
-        char *serial, *type, *content, *p;
-
-        // if string ends with newline, remove it
-        p = strrchr(buffer, '\n');
-        if (p)
-            *p = '\0';
-
-        EnterCriticalSection(&config->mutex);
-        // check if window is valid before we continue processing
-        if (!config->window || !IsWindow(config->window)) {
-            LeaveCriticalSection(&config->mutex);
-            break;
-        }
-
-        if (!parse_message(buffer, &serial, &type, &content)) {
-            log_error("invalid command: \"%s\"", buffer);
-            LeaveCriticalSection(&config->mutex);
-            continue;
-        }
-
-        if (strcmp(type, CMD_CONFIG) == 0) {
-            int value;
-
-            if (strlen(content) != 2) {
-                log_response(serial, RESPONSE_ERROR, "invalid length: %d", strlen(content));
-                LeaveCriticalSection(&config->mutex);
-                continue;
-            }
-
-            // backdrop type
-            value = content[1] - '0';
-            if (value < 0 || value >= BACKDROP_MAX) {
-                log_response(serial, RESPONSE_ERROR, "invalid backdrop type: %c", content[1]);
-                LeaveCriticalSection(&config->mutex);
-                continue;
-            }
-            if ((config->version.dwBuildNumber < WIN11_SYSTEMBACKDROP_SUPPORTED_BUILD_NUMBER
-                    && value != BACKDROP_MICA
-                    && value != BACKDROP_DEFAULT
-                    && value != BACKDROP_NONE)
-                || (config->version.dwBuildNumber < WIN11_BUILD_NUMBER)) {
-                // windows 10 doesn't support backdrop,
-                // certain windows 11 version only supports mica
-                log_response(serial, RESPONSE_ERROR, "backdrop type unsupported by Windows version");
-                LeaveCriticalSection(&config->mutex);
-                continue;
-            }
-            if (value != config->backdrop_type) {
-                config->backdrop_type = value;
-                config->mask |= CONFIG_BACKDROP_TYPE;
-            }
-
-            // extend border
-            value = content[0] - '0';
-            if (value != config->extend_border) {
-                config->extend_border = !!value;
-                config->mask |= CONFIG_EXTEND_BORDER;
-            }
-
-            WakeConditionVariable(&config->config_changed);
-            log_response(serial, RESPONSE_OK, "");
-        } else if (strcmp(type, CMD_THEME) == 0) {
-            int value;
-            LRESULT rc;
-
-            rc = is_dark_mode(config->regkey, &value);
-            if (rc != ERROR_SUCCESS) {
-                log_win32_response(serial, RESPONSE_ERROR, "is_dark_mode", rc);
-                LeaveCriticalSection(&config->mutex);
-                break;
-            }
-
-            log_response(serial, RESPONSE_OK, "%d", value);
-        } else if (strcmp(type, CMD_ACCENT) == 0) {
-            HRESULT hr;
-            DWORD color;
-            BOOL opaque;
-
-            hr = DwmGetColorizationColor(&color, &opaque);
-            if (FAILED(hr)) {
-                log_win32_response(serial, RESPONSE_ERROR, "DwmGetColorizationColor", HRESULT_CODE(hr));
-                LeaveCriticalSection(&config->mutex);
-                break;
-            }
-            log_response(serial, RESPONSE_OK, "%d %lu", opaque, ARGB_RGBA(color));
-        } else if (strcmp(type, CMD_EXIT) == 0) {
-            log_response(serial, RESPONSE_OK, "");
-            LeaveCriticalSection(&config->mutex);
-            break;
-        } else {
-            log_response(serial, RESPONSE_ERROR, "invalid command: \"%s\"", type);
-        }
-        LeaveCriticalSection(&config->mutex);
+/**
+ * Records the time spent since the last phase, in microseconds.
+ */
+static void end_phase(monitor_field_t *fields, size_t *count, const char *name, uint64_t *phase_start) {
+    uint64_t now = monitor_now_ns();
+    if (*count < MAX_READY_FIELDS) {
+        fields[*count].name = name;
+        fields[*count].value = (now - *phase_start) / 1000;
+        (*count)++;
     }
-    return 0;
+    *phase_start = now;
 }
 
 
-BOOL CALLBACK enum_window_proc(HWND hwnd, LPARAM lparam) {  
-    DWORD pid;
-    char buffer[MAX_CLASS_SIZE];
-    window_config_t *target = (window_config_t *) lparam;
-    if (!GetWindowThreadProcessId(hwnd, &pid)
-        || !GetClassNameA(hwnd, buffer, MAX_CLASS_SIZE))
-        return FALSE;
-    if (pid == target->pid && strcmp(buffer, target->class) == 0) {
-        target->window = hwnd;
-        return FALSE;
+/**
+ * Publishes the state for the client, and adds the fields that tell it where to find it.
+ */
+static void share_state(window_config_t *config, monitor_field_t *fields, size_t *count) {
+    monitor_error_t err;
+
+    monitor_lock(config);
+    if (!monitor_share_state(config, GetCurrentProcessId(), 0, &err)) {
+        // the client asks over the pipe instead
+        log_error(config, "%s", err.message);
+    } else if (*count + 2 <= MAX_READY_FIELDS) {
+        fields[*count].name = "state_pid";
+        fields[(*count)++].value = GetCurrentProcessId();
+        fields[*count].name = "state_id";
+        fields[(*count)++].value = 0;
     }
-    return TRUE;
+    monitor_unlock(config);
 }
 
 
 int main(int argc, char **argv) {
     DWORD rc;
-    window_config_t config = { 0 };
-    HANDLE thread_handles[3] = { INVALID_HANDLE_VALUE };
+    window_config_t config;
+    platform_win32_t win32 = { 0 };
+    monitor_trace_t trace = { 0 };
+    monitor_error_t err;
+    const char *record_path = NULL;
+    HWND window_arg = NULL;
+    // the apply loop runs in the main thread, so only the threads that block are created
+    HANDLE thread_handles[2] = { INVALID_HANDLE_VALUE, INVALID_HANDLE_VALUE };
+    monitor_field_t fields[MAX_READY_FIELDS];
+    size_t field_count = 0;
+    uint64_t start = monitor_now_ns(), phase_start = start;
+
+    // a trace is replayed through the mock platform, without a window
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        if (argc > 4 || (argc == 4 && strcmp(argv[3], "--realtime") != 0)) {
+            fprintf(stderr, "usage: %s --replay <file> [--realtime]\n", argv[0]);
+            return 2;
+        }
+        return monitor_trace_replay(argv[2], argc == 4, stdout);
+    }
 
-    // reopen stdout in binary mode if possible
-    freopen(NULL, "wb", stdout);
-    // windows does not have _IOLBF per-se
-    setvbuf(stdout, NULL, _IONBF, 0);
+    // messages are written straight to the file descriptor, one write per message
+    _setmode(_fileno(stdout), _O_BINARY);
+
+    monitor_init(&config, &platform_win32, &win32, _fileno(stdout));
+    win32.stats = &config.stats;
+    win32.config = &config;
+
+    // options come after the pid and the class name
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            config.binary = 1;
+            _setmode(_fileno(stdin), _O_BINARY);
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            // the handle from the ready broadcast of a previous monitor, which saves EnumWindows
+            window_arg = (HWND) (uintptr_t) strtoull(argv[++i], NULL, 0);
+        } else if (strcmp(argv[i], "--max-message") == 0 && i + 1 < argc) {
+            unsigned long size = strtoul(argv[++i], NULL, 10);
+            if (size < MIN_MESSAGE_SIZE || size > MAX_MESSAGE_SIZE) {
+                log_error(&config, "invalid message size: %s", argv[i]);
+                goto exit;
+            }
+            config.max_message_size = size;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else {
+            log_error(&config, "invalid argument: %s", argv[i]);
+            goto exit;
+        }
+    }
 
-    if (argc != 3) {
-        log_error("invalid number of arguments: %d", argc);
-        return 0;
+    if (argc < 3) {
+        log_error(&config, "invalid number of arguments: %d", argc);
+        goto exit;
+    }
+    if (record_path && !monitor_trace_open(&trace, record_path, &err)) {
+        log_error(&config, "%s", err.message);
+        goto exit;
     }
 
     // get the OS version so we know how to set the correct attribute later
-    config.version.dwOSVersionInfoSize = sizeof(config.version);
-    if (!GetVersionExA((LPOSVERSIONINFOA) &config.version)) {
-        log_win32_error("GetVersionExA", GetLastError());
-        return 0;
+    win32.version.dwOSVersionInfoSize = sizeof(win32.version);
+    if (!GetVersionExA((LPOSVERSIONINFOA) &win32.version)) {
+        log_win32_error(&config, "GetVersionExA", GetLastError());
+        goto exit;
     }
 
-    if (config.version.dwBuildNumber < WIN10_BUILD_NUMBER) {
-        log_error("windows build unsupported: %ld", config.version.dwBuildNumber);
-        return 0;
+    if (win32.version.dwBuildNumber < WIN10_BUILD_NUMBER) {
+        log_error(&config, "windows build unsupported: %ld", win32.version.dwBuildNumber);
+        goto exit;
     }
+    end_phase(fields, &field_count, "version", &phase_start);
 
     // find the current window
-    config.pid = strtol(argv[1], NULL, 10);
-    snprintf(config.class, MAX_CLASS_SIZE, "%s", argv[2]);
-    InitializeCriticalSection(&config.mutex);
-    InitializeConditionVariable(&config.config_changed);
-    if (!EnumWindows(&enum_window_proc,(LPARAM) &config) && GetLastError() != ERROR_SUCCESS) {
-        log_win32_error("EnumWindows", GetLastError());
+    win32.pid = strtol(argv[1], NULL, 10);
+    snprintf(win32.class, MAX_CLASS_SIZE, "%s", argv[2]);
+    win32.process = OpenProcess(SYNCHRONIZE, FALSE, win32.pid);
+    if (!win32.process) {
+        log_win32_error(&config, "OpenProcess", GetLastError());
         goto exit;
     }
-    if (!config.window) {
-        log_error("cannot find window class %s owned by %ld", config.class, config.pid);
-        goto exit;
+    if (window_arg && is_target_window(&win32, window_arg)) {
+        // the other windows are found by the theme monitor thread
+        win32.window = window_arg;
+        monitor_on_window_created(&config, (uintptr_t) window_arg);
+    } else {
+        if (!EnumWindows(&enum_window_proc,(LPARAM) &win32) && GetLastError() != ERROR_SUCCESS) {
+            log_win32_error(&config, "EnumWindows", GetLastError());
+            goto exit;
+        }
+        if (!win32.window) {
+            log_error(&config, "cannot find window class %s owned by %ld", win32.class, win32.pid);
+            goto exit;
+        }
     }
+    end_phase(fields, &field_count, "find_window", &phase_start);
 
     rc = RegOpenKeyExA(HKEY_CURRENT_USER,
                         "SOFTWARE\\Microsoft\\Windows\\CurrentVersion\\Themes\\Personalize",
                         0,
                         KEY_READ | KEY_NOTIFY,
-                        &config.regkey);
+                        &win32.regkey);
     if (rc != ERROR_SUCCESS) {
-        log_win32_error("RegOpenKeyExA", rc);
+        log_win32_error(&config, "RegOpenKeyExA", rc);
         goto exit;
     }
 
-    rc = is_dark_mode(config.regkey, &config.dark_mode);
+    rc = is_dark_mode(win32.regkey, &config.desired.dark_mode);
     if (rc != ERROR_SUCCESS) {
-        log_win32_error("RegQueryValueExA", rc);
+        log_win32_error(&config, "RegQueryValueExA", rc);
+        goto exit;
+    }
+    end_phase(fields, &field_count, "registry", &phase_start);
+    share_state(&config, fields, &field_count);
+    // from here on, the window procedure may send events
+    if (record_path && !monitor_trace_attach(&trace, &config, &err)) {
+        log_error(&config, "%s", err.message);
         goto exit;
     }
-    config.mask |= CONFIG_DARK_MODE;
-    WakeConditionVariable(&config.config_changed);
 
     thread_handles[0] = (HANDLE) _beginthreadex(NULL, 0, &theme_monitor_proc, &config, 0, NULL);
-    thread_handles[1] = (HANDLE) _beginthreadex(NULL, 0, &config_change_proc, &config, 0, NULL);
-    thread_handles[2] = (HANDLE) _beginthreadex(NULL, 0, &read_input_proc, &config, 0, NULL);
+    thread_handles[1] = (HANDLE) _beginthreadex(NULL, 0, &read_input_proc, &config, 0, NULL);
 
     for (int i = 0;i < sizeof(thread_handles) / sizeof(*thread_handles); i++) {
         if (thread_handles[i] == INVALID_HANDLE_VALUE) {
-            log_error("cannot create threads: %s", strerror(errno));
+            log_error(&config, "cannot create threads: %s", strerror(errno));
             goto exit;
         }
     }
-
-    log_broadcast(BROADCAST_READY, "%s", "");
-
+    end_phase(fields, &field_count, "threads", &phase_start);
+
+    fields[field_count].name = "window";
+    fields[field_count].value = (uintptr_t) win32.window;
+    field_count++;
+    fields[field_count].name = "total";
+    fields[field_count].value = (monitor_now_ns() - start) / 1000;
+    field_count++;
+    monitor_broadcast_ready(&config, fields, field_count);
+
+    // runs until any of the threads is done
+    monitor_apply_loop(&config);
+
+    // close the regkey if any of the threads failed
+    monitor_lock(&config);
+    if (win32.regkey)
+        RegCloseKey(win32.regkey);
+    win32.regkey = NULL;
+    win32.window = NULL;
+    config.running = 0;
+    // workaround: cancel IO in the input thread so it can end immediately
+    CancelSynchronousIo(thread_handles[1]);
+    monitor_unlock(&config);
+
+    // wait for the rest of the threads to quit
     rc = WaitForMultipleObjects(sizeof(thread_handles) / sizeof(*thread_handles),
-                                thread_handles,
-                                FALSE,
-                                INFINITE);
-    if (rc >= WAIT_OBJECT_0 && rc <= WAIT_OBJECT_0 + 2) {
-        // close the regkey if any of the threads failed
-        EnterCriticalSection(&config.mutex);
-        if (config.regkey)
-            RegCloseKey(config.regkey);
-        config.regkey = NULL;
-        config.window = NULL;
-        WakeConditionVariable(&config.config_changed);
-        // workaround: cancel IO in the input thread so it can end immediately
-        CancelSynchronousIo(thread_handles[2]);
-        LeaveCriticalSection(&config.mutex);
-
-
-        // wait for the rest of the threads to quit
-        WaitForMultipleObjects(sizeof(thread_handles) / sizeof(*thread_handles),
                                 thread_handles,
                                 TRUE,
                                 INFINITE);
-    } else {
-        log_win32_error("WaitForMultipleObjects", GetLastError());
-        goto exit;
-    }
+    if (rc == WAIT_FAILED)
+        log_win32_error(&config, "WaitForMultipleObjects", GetLastError());
 
 exit:
     for (int i = 0; i < sizeof(thread_handles) / sizeof(*thread_handles); i++) {
         if (thread_handles[i] != INVALID_HANDLE_VALUE)
             CloseHandle(thread_handles[i]);
     }
-    if (config.regkey)
-        RegCloseKey(config.regkey);
-    DeleteCriticalSection(&config.mutex);
+    if (win32.regkey)
+        RegCloseKey(win32.regkey);
+    if (win32.process)
+        CloseHandle(win32.process);
+    monitor_trace_close(&trace);
+    monitor_destroy(&config);
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,884 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <poll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "monitor_core.h"
+#include "monitor_daemon.h"
+#include "monitor_reactor.h"
+#include "monitor_trace.h"
+#include "platform_mock.h"
+
+
+#define DEFAULT_ITERATIONS 1000000
+#define DEFAULT_ROUND_TRIPS 20000
+#define DEFAULT_STORM_EVENTS 10000
+#define STORM_INTERVAL_NS 10000
+#define BROADCAST_THREADS 4
+#define DAEMON_CLIENTS 8
+
+
+typedef struct bench_options_s {
+    unsigned long iterations;
+    unsigned long round_trips;
+    unsigned long storm_events;
+    // a trace to replay instead of running the benchmarks
+    const char *replay_path;
+    int realtime;
+} bench_options_t;
+
+
+typedef struct bench_pipe_s {
+    int binary, batch;
+    int to_monitor[2], from_monitor[2];
+    FILE *client_in;
+    // with a reactor, read_thread runs it and there is no apply thread
+    int use_reactor;
+    monitor_reactor_t reactor;
+    pthread_t read_thread, apply_thread;
+    platform_mock_t mock;
+    window_config_t config;
+    // output statistics, collected when the pipe is closed
+    unsigned long messages, syscalls, wakeups;
+} bench_pipe_t;
+
+
+// prevents the compiler from optimizing away the benchmarked expressions
+static volatile unsigned long sink;
+
+// commands sent during the round trip benchmarks
+static const char *round_trip_commands[] = { "theme ", "accent ", "config 12" };
+static const binary_type_e round_trip_records[] = { BINARY_THEME, BINARY_ACCENT, BINARY_CONFIG };
+
+#define ROUND_TRIP_COMMAND_COUNT (sizeof(round_trip_commands) / sizeof(*round_trip_commands))
+
+// every round trip command at once, like Monitor:on_ready sends them
+static const char round_trip_batch[] = "batch theme \taccent \tconfig 12";
+static const unsigned char round_trip_batch_record[] = {
+    BINARY_THEME, 0,
+    BINARY_ACCENT, 0,
+    BINARY_CONFIG, 2, 1, 2,
+};
+
+
+static int first_result = 1;
+
+static void report(const char *name, unsigned long iterations, uint64_t elapsed) {
+    printf("%s\n    { \"name\": \"%s\", \"iterations\": %lu, \"ns_per_op\": %.2f }",
+            first_result ? "" : ",",
+            name,
+            iterations,
+            (double) elapsed / iterations);
+    first_result = 0;
+}
+
+
+static void bench_parse_message(const bench_options_t *options) {
+    static const char message[] = "1234 config 12";
+    char buffer[sizeof(message)];
+    char *serial, *type, *content;
+    uint64_t start = monitor_now_ns();
+
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        // parse_message writes into the buffer so it must be refreshed every time
+        memcpy(buffer, message, sizeof(message));
+        sink += parse_message(buffer, &serial, &type, &content);
+        sink += (unsigned long) *content;
+    }
+    report("parse_message", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_log_response(const bench_options_t *options, window_config_t *config) {
+    uint64_t start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        log_response(config, "1234", RESPONSE_OK, "%d %lu", 1, ARGB_RGBA(0xC40078D4ul));
+    report("log_response", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_log_broadcast(const bench_options_t *options, window_config_t *config) {
+    uint64_t start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        log_broadcast(config, BROADCAST_ACCENTCHANGE, "%d %lu", 1, ARGB_RGBA(0xC40078D4ul));
+    report("log_broadcast", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_log_record(const bench_options_t *options, window_config_t *config) {
+    unsigned char payload[5] = { 1, 0xC4, 0xD4, 0x78, 0x00 };
+    uint64_t start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        log_record(config, -1, BINARY_ACCENTCHANGE, payload, sizeof(payload));
+    report("log_record", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_argb_rgba(const bench_options_t *options) {
+    uint64_t start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        sink += ARGB_RGBA(i + sink);
+    report("ARGB_RGBA", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_best_accent(const bench_options_t *options) {
+    monitor_color_cache_t cache;
+    uint64_t start = monitor_now_ns();
+
+    // a different accent every time, like dragging the accent slider
+    for (unsigned long i = 0; i < options->iterations; i++)
+        sink += monitor_color_best_accent(NULL, (uint32_t) (i * 0x01020300ul) | 0xFF, 0x2E2E32FF, 450);
+    report("best_accent", options->iterations, monitor_now_ns() - start);
+
+    memset(&cache, 0, sizeof(cache));
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        sink += monitor_color_best_accent(&cache, 0x0078D4FF, 0x2E2E32FF, 450);
+    report("best_accent_cached", options->iterations, monitor_now_ns() - start);
+}
+
+
+static void bench_is_dark_mode(const bench_options_t *options, window_config_t *config) {
+    int value;
+    monitor_error_t err;
+    uint64_t start = monitor_now_ns();
+
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        config->platform->get_dark_mode(config->platform_ud, &value, &err);
+        sink += value;
+    }
+    report("is_dark_mode", options->iterations, monitor_now_ns() - start);
+
+    // the path taken by WM_SETTINGCHANGE when the theme stays the same
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        monitor_on_theme_change(config);
+    report("on_theme_change", options->iterations, monitor_now_ns() - start);
+
+    // a client that doesn't follow the accent, which skips the mutex
+    monitor_counter_set(&config->topics, EVENT_THEME);
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++)
+        monitor_on_accent_change(config, 0x0078D4, 1);
+    report("on_accent_change_unsubscribed", options->iterations, monitor_now_ns() - start);
+    monitor_counter_set(&config->topics, EVENT_ALL);
+}
+
+
+typedef struct state_writer_s {
+    monitor_state_page_t *page;
+    volatile int running;
+    unsigned long writes;
+} state_writer_t;
+
+
+static void bench_apply_windows(const bench_options_t *options, window_config_t *config, platform_mock_t *mock) {
+    uint64_t start;
+
+    for (int i = 0; i < MAX_WINDOWS; i++)
+        platform_mock_add_window(mock, config, (uint64_t) i + 1);
+    monitor_lock(config);
+    monitor_apply_pending(config);
+
+    // every window follows the config, so a change is applied to all of them in one pass
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        config->desired.extend_border = !config->desired.extend_border;
+        monitor_apply_pending(config);
+    }
+    report("apply_all_windows", options->iterations, monitor_now_ns() - start);
+
+    // a change to a single window skips the others
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        config->windows[0].overrides = CONFIG_EXTEND_BORDER;
+        config->windows[0].override.extend_border = !config->windows[0].override.extend_border;
+        monitor_apply_pending(config);
+    }
+    report("apply_one_window", options->iterations, monitor_now_ns() - start);
+    monitor_unlock(config);
+
+    for (int i = 0; i < MAX_WINDOWS; i++)
+        platform_mock_remove_window(mock, config, (uint64_t) i + 1);
+}
+
+
+static void *state_writer_proc(void *ud) {
+    state_writer_t *w = (state_writer_t *) ud;
+    monitor_state_t state = { 0 };
+
+    // every value of a state is the same, so a torn read is easy to spot
+    while (w->running) {
+        uint32_t value = (uint32_t) ++w->writes;
+        state.accent = value;
+        state.variant_count = MAX_CONTRAST_COLORS;
+        for (int i = 0; i < MAX_CONTRAST_COLORS; i++)
+            state.variants[i] = value;
+        monitor_state_write(w->page, &state);
+    }
+    return NULL;
+}
+
+
+/**
+ * Reading the state from the shared page, the way a client would instead of a round trip.
+ */
+static void bench_state_read(const bench_options_t *options, window_config_t *config) {
+    monitor_state_map_t map;
+    monitor_state_t state;
+    monitor_error_t err;
+    state_writer_t w;
+    pthread_t writer;
+    unsigned long failed = 0, torn = 0;
+    uint64_t start;
+
+    monitor_lock(config);
+    if (!monitor_share_state(config, (unsigned long) getpid(), 0, &err)) {
+        monitor_unlock(config);
+        fprintf(stderr, "%s\n", err.message);
+        return;
+    }
+    monitor_unlock(config);
+    if (!monitor_state_open(&map, (unsigned long) getpid(), 0)) {
+        perror("monitor_state_open");
+        return;
+    }
+
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        failed += !monitor_state_read(map.page, &state);
+        sink += state.accent;
+    }
+    report("state_read", options->iterations, monitor_now_ns() - start);
+
+    w.page = config->state_map.page;
+    w.running = 1;
+    w.writes = 0;
+    pthread_create(&writer, NULL, &state_writer_proc, &w);
+    start = monitor_now_ns();
+    for (unsigned long i = 0; i < options->iterations; i++) {
+        if (!monitor_state_read(map.page, &state)) {
+            failed++;
+            continue;
+        }
+        // the state of the monitor itself has no variants
+        for (uint32_t j = 0; j < state.variant_count; j++)
+            torn += state.variants[j] != state.accent;
+    }
+    report("state_read_contended", options->iterations, monitor_now_ns() - start);
+    w.running = 0;
+    pthread_join(writer, NULL);
+
+    // a writer that never stops can starve readers, which the monitor doesn't do
+    if (torn)
+        fprintf(stderr, "state_read: %lu torn reads, %lu failed\n", torn, failed);
+    monitor_state_close(&map);
+}
+
+
+static void *read_thread_proc(void *ud) {
+    bench_pipe_t *p = (bench_pipe_t *) ud;
+    monitor_read_loop(&p->config, p->to_monitor[0]);
+    return NULL;
+}
+
+
+static void *reactor_thread_proc(void *ud) {
+    bench_pipe_t *p = (bench_pipe_t *) ud;
+    monitor_reactor_run(&p->reactor);
+    return NULL;
+}
+
+
+static void *apply_thread_proc(void *ud) {
+    bench_pipe_t *p = (bench_pipe_t *) ud;
+    monitor_apply_loop(&p->config);
+    return NULL;
+}
+
+
+static void *apply_loop_proc(void *ud) {
+    monitor_apply_loop((window_config_t *) ud);
+    return NULL;
+}
+
+
+static int pipe_open(bench_pipe_t *p, int binary, int batch, int use_reactor) {
+    monitor_error_t err;
+
+    if (pipe(p->to_monitor) != 0 || pipe(p->from_monitor) != 0) {
+        perror("pipe");
+        return 0;
+    }
+    p->client_in = fdopen(p->from_monitor[0], "r");
+
+    platform_mock_init(&p->mock);
+    monitor_init(&p->config, &platform_mock, &p->mock, p->from_monitor[1]);
+    platform_mock_add_window(&p->mock, &p->config, 1);
+    p->binary = p->config.binary = binary;
+    p->batch = batch;
+    p->use_reactor = use_reactor;
+    p->wakeups = 0;
+    if (use_reactor) {
+        if (!monitor_reactor_init(&p->reactor, &p->config, p->to_monitor[0], &err)) {
+            fprintf(stderr, "%s\n", err.message);
+            exit(1);
+        }
+        pthread_create(&p->read_thread, NULL, &reactor_thread_proc, p);
+        return 1;
+    }
+    pthread_create(&p->read_thread, NULL, &read_thread_proc, p);
+    pthread_create(&p->apply_thread, NULL, &apply_thread_proc, p);
+    return 1;
+}
+
+
+static int write_record(bench_pipe_t *p, int32_t serial, binary_type_e type) {
+    unsigned char record[BINARY_HEADER_SIZE + sizeof(round_trip_batch_record)] = { 0 };
+    size_t len = type == BINARY_CONFIG ? 2 : 0;
+
+    if (type == BINARY_BATCH) {
+        len = sizeof(round_trip_batch_record);
+        memcpy(record + BINARY_HEADER_SIZE, round_trip_batch_record, len);
+    } else {
+        record[8] = 1;
+        record[9] = 2;
+    }
+
+    record[0] = serial & 0xFF;
+    record[1] = (serial >> 8) & 0xFF;
+    record[2] = (serial >> 16) & 0xFF;
+    record[3] = ((uint32_t) serial >> 24) & 0xFF;
+    record[4] = type;
+    record[6] = (unsigned char) len;
+    return write(p->to_monitor[1], record, BINARY_HEADER_SIZE + len) == (ssize_t) (BINARY_HEADER_SIZE + len);
+}
+
+
+// reads a response and returns its serial, or -2 on failure
+static long read_response(bench_pipe_t *p) {
+    char buffer[BUFFER_SIZE];
+
+    if (p->binary) {
+        unsigned char *header = (unsigned char *) buffer;
+        int32_t serial;
+        size_t len;
+        if (fread(buffer, 1, BINARY_HEADER_SIZE, p->client_in) != BINARY_HEADER_SIZE)
+            return -2;
+        serial = (int32_t) (header[0] | (header[1] << 8) | (header[2] << 16) | ((uint32_t) header[3] << 24));
+        len = (unsigned char) buffer[6] | ((unsigned char) buffer[7] << 8);
+        if (len && fread(buffer, 1, len, p->client_in) != len)
+            return -2;
+        return serial;
+    }
+    if (!fgets(buffer, sizeof(buffer), p->client_in))
+        return -2;
+    return strtol(buffer, NULL, 10);
+}
+
+
+static void pipe_close(bench_pipe_t *p) {
+    long serial;
+    static const char exit_command[] = "-3 exit \n";
+
+    if (p->binary) {
+        if (!write_record(p, -3, BINARY_EXIT))
+            perror("write");
+    } else if (write(p->to_monitor[1], exit_command, sizeof(exit_command) - 1) < 0) {
+        perror("write");
+    }
+    // skip every response until the one for exit
+    do {
+        serial = read_response(p);
+    } while (serial != -3 && serial != -2);
+
+    pthread_join(p->read_thread, NULL);
+    if (p->use_reactor) {
+        p->wakeups = p->reactor.wakeups;
+        monitor_reactor_destroy(&p->reactor);
+    } else {
+        monitor_stop(&p->config);
+        pthread_join(p->apply_thread, NULL);
+    }
+    p->messages = p->config.out.messages;
+    p->syscalls = p->config.out.syscalls;
+    monitor_destroy(&p->config);
+    platform_mock_destroy(&p->mock);
+
+    close(p->to_monitor[1]);
+    close(p->to_monitor[0]);
+    close(p->from_monitor[1]);
+    fclose(p->client_in);
+}
+
+
+static int send_command(bench_pipe_t *p, unsigned long serial) {
+    char buffer[BUFFER_SIZE];
+    int len;
+
+    if (p->binary)
+        return write_record(p, (int32_t) serial, p->batch ? BINARY_BATCH : round_trip_records[serial % ROUND_TRIP_COMMAND_COUNT]);
+
+    len = snprintf(buffer, sizeof(buffer), "%lu %s\n",
+                    serial,
+                    p->batch ? round_trip_batch : round_trip_commands[serial % ROUND_TRIP_COMMAND_COUNT]);
+    return write(p->to_monitor[1], buffer, len) == len;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Gets the context switches of every thread of the process so far,
+ * which counts how often the monitor threads went to sleep and were woken up.
+ */
+static unsigned long context_switches(void) {
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+    return (unsigned long) (usage.ru_nvcsw + usage.ru_nivcsw);
+}
+
+
+static void bench_round_trip(const bench_options_t *options, const char *name, int binary, int batch, int use_reactor) {
+    bench_pipe_t p;
+    uint64_t *samples, start;
+    unsigned long count = 0, switches;
+
+    samples = malloc(sizeof(*samples) * options->round_trips);
+    if (!samples || !pipe_open(&p, binary, batch, use_reactor)) {
+        free(samples);
+        return;
+    }
+    switches = context_switches();
+
+    for (; count < options->round_trips; count++) {
+        start = monitor_now_ns();
+        if (!send_command(&p, count) || read_response(&p) == -2)
+            break;
+        samples[count] = monitor_now_ns() - start;
+    }
+    switches = context_switches() - switches;
+    pipe_close(&p);
+
+    if (count) {
+        qsort(samples, count, sizeof(*samples), &compare_u64);
+        printf(",\n  \"%s\": { \"samples\": %lu, \"p50_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu, "
+                "\"messages_written\": %lu, \"write_syscalls\": %lu, \"monitor_threads\": %d, "
+                "\"context_switches_per_op\": %.2f, \"reactor_wakeups_per_op\": %.2f }",
+                name,
+                count,
+                (unsigned long long) samples[count / 2],
+                (unsigned long long) samples[count * 99 / 100],
+                (unsigned long long) samples[count - 1],
+                p.messages,
+                p.syscalls,
+                use_reactor ? 1 : 2,
+                (double) switches / count,
+                (double) p.wakeups / count);
+    }
+    free(samples);
+}
+
+
+typedef struct throughput_writer_s {
+    bench_pipe_t *p;
+    unsigned long count;
+} throughput_writer_t;
+
+
+static void *throughput_writer_proc(void *ud) {
+    throughput_writer_t *w = (throughput_writer_t *) ud;
+    for (unsigned long i = 0; i < w->count; i++) {
+        if (!send_command(w->p, i))
+            break;
+    }
+    return NULL;
+}
+
+
+static void bench_throughput(const bench_options_t *options, const char *name, int binary, int batch, int use_reactor) {
+    bench_pipe_t p;
+    pthread_t writer;
+    throughput_writer_t w;
+    unsigned long received = 0, switches;
+    uint64_t start, elapsed;
+
+    if (!pipe_open(&p, binary, batch, use_reactor))
+        return;
+    switches = context_switches();
+
+    w.p = &p;
+    w.count = options->round_trips;
+    start = monitor_now_ns();
+    pthread_create(&writer, NULL, &throughput_writer_proc, &w);
+    while (received < options->round_trips && read_response(&p) != -2)
+        received++;
+    elapsed = monitor_now_ns() - start;
+    pthread_join(writer, NULL);
+    switches = context_switches() - switches;
+    pipe_close(&p);
+
+    printf(",\n  \"%s\": { \"messages\": %lu, \"elapsed_ns\": %llu, \"messages_per_sec\": %.0f, "
+            "\"messages_written\": %lu, \"write_syscalls\": %lu, \"monitor_threads\": %d, "
+            "\"context_switches_per_message\": %.2f, \"reactor_wakeups_per_message\": %.2f }",
+            name,
+            received,
+            (unsigned long long) elapsed,
+            received * 1e9 / (elapsed ? elapsed : 1),
+            p.messages,
+            p.syscalls,
+            use_reactor ? 1 : 2,
+            (double) switches / (received ? received : 1),
+            (double) p.wakeups / (received ? received : 1));
+}
+
+
+typedef struct broadcaster_s {
+    window_config_t *config;
+    unsigned long count;
+} broadcaster_t;
+
+
+static void *broadcaster_proc(void *ud) {
+    broadcaster_t *b = (broadcaster_t *) ud;
+    for (unsigned long i = 0; i < b->count; i++) {
+        monitor_lock(b->config);
+        log_broadcast(b->config, BROADCAST_ACCENTCHANGE, "%d %lu", 1, i);
+        monitor_unlock(b->config);
+    }
+    return NULL;
+}
+
+
+static void *drain_proc(void *ud) {
+    char buffer[WRITER_BUFFER_SIZE];
+    int fd = *(int *) ud;
+    while (read(fd, buffer, sizeof(buffer)) > 0);
+    return NULL;
+}
+
+
+/**
+ * Several threads broadcasting at once under config->mutex, like the theme thread and the input thread would.
+ */
+static void bench_broadcast_contention(const bench_options_t *options) {
+    int fds[2];
+    platform_mock_t mock;
+    window_config_t config;
+    pthread_t drainer, threads[BROADCAST_THREADS];
+    broadcaster_t broadcaster;
+    uint64_t start, elapsed;
+
+    if (pipe(fds) != 0) {
+        perror("pipe");
+        return;
+    }
+    platform_mock_init(&mock);
+    monitor_init(&config, &platform_mock, &mock, fds[1]);
+    pthread_create(&drainer, NULL, &drain_proc, &fds[0]);
+
+    broadcaster.config = &config;
+    broadcaster.count = options->round_trips;
+    start = monitor_now_ns();
+    for (int i = 0; i < BROADCAST_THREADS; i++)
+        pthread_create(&threads[i], NULL, &broadcaster_proc, &broadcaster);
+    for (int i = 0; i < BROADCAST_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    elapsed = monitor_now_ns() - start;
+
+    close(fds[1]);
+    pthread_join(drainer, NULL);
+    close(fds[0]);
+
+    printf(",\n  \"broadcast_contention\": { \"threads\": %d, \"messages_written\": %lu, \"write_syscalls\": %lu, "
+            "\"elapsed_ns\": %llu }",
+            BROADCAST_THREADS,
+            config.out.messages,
+            config.out.syscalls,
+            (unsigned long long) elapsed);
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+}
+
+
+static void *daemon_attach(void *ud, unsigned long pid, const char *class_name, monitor_error_t *err) {
+    platform_mock_t *mock = malloc(sizeof(*mock));
+    (void) ud;
+    (void) class_name;
+    if (!mock) {
+        snprintf(err->message, sizeof(err->message), "daemon_attach: out of memory");
+        return NULL;
+    }
+    platform_mock_init(mock);
+    // the daemon tells the monitor about the window itself
+    platform_mock_add_window(mock, NULL, pid);
+    return mock;
+}
+
+
+static void daemon_detach(void *ud, void *platform_ud) {
+    (void) ud;
+    platform_mock_destroy((platform_mock_t *) platform_ud);
+    free(platform_ud);
+}
+
+
+static void *daemon_proc(void *ud) {
+    monitor_daemon_run((monitor_daemon_t *) ud);
+    return NULL;
+}
+
+
+typedef struct client_drain_s {
+    int *fds;
+    int count;
+    unsigned long lines;
+} client_drain_t;
+
+
+/**
+ * Reads from every client until each has received count lines.
+ */
+static void drain_clients(int *fds, int count, unsigned long lines) {
+    struct pollfd pfds[DAEMON_CLIENTS];
+    unsigned long received[DAEMON_CLIENTS] = { 0 };
+    char buffer[WRITER_BUFFER_SIZE];
+    int remaining = count;
+
+    for (int i = 0; i < count; i++) {
+        pfds[i].fd = fds[i];
+        pfds[i].events = POLLIN;
+    }
+    while (remaining && poll(pfds, count, 1000) > 0) {
+        for (int i = 0; i < count; i++) {
+            ssize_t n;
+            if (!pfds[i].revents)
+                continue;
+            n = read(fds[i], buffer, sizeof(buffer));
+            for (ssize_t j = 0; j < n; j++)
+                received[i] += buffer[j] == '\n';
+            if (n <= 0 || received[i] >= lines) {
+                pfds[i].fd = -1;
+                remaining--;
+            }
+        }
+    }
+}
+
+
+static void *client_drain_proc(void *ud) {
+    client_drain_t *drain = (client_drain_t *) ud;
+    drain_clients(drain->fds, drain->count, drain->lines);
+    return NULL;
+}
+
+
+/**
+ * A single daemon broadcasting accent changes to several clients over a Unix domain socket.
+ */
+static void bench_daemon_fanout(const bench_options_t *options) {
+    static const char hello[] = CMD_HELLO " 1 bench 0\n";
+    monitor_daemon_backend_t backend = { &platform_mock, &daemon_attach, &daemon_detach, NULL };
+    monitor_daemon_t daemon;
+    monitor_error_t err;
+    pthread_t thread, drainer;
+    client_drain_t drain;
+    char path[MAX_DAEMON_PATH];
+    int fds[DAEMON_CLIENTS];
+    uint64_t start, attach_elapsed, elapsed;
+
+    snprintf(path, sizeof(path), "/tmp/monitor_bench.%ld.sock", (long) getpid());
+    if (!monitor_daemon_init(&daemon, path, &backend, &err)) {
+        fprintf(stderr, "%s\n", err.message);
+        monitor_daemon_destroy(&daemon);
+        return;
+    }
+    pthread_create(&thread, NULL, &daemon_proc, &daemon);
+
+    // wait for the ready broadcast of every client
+    start = monitor_now_ns();
+    for (int i = 0; i < DAEMON_CLIENTS; i++) {
+        struct sockaddr_un addr = { 0 };
+        addr.sun_family = AF_UNIX;
+        strcpy(addr.sun_path, path);
+        fds[i] = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (fds[i] < 0 || connect(fds[i], (struct sockaddr *) &addr, sizeof(addr)) != 0
+            || write(fds[i], hello, sizeof(hello) - 1) != sizeof(hello) - 1) {
+            perror("connect");
+            exit(1);
+        }
+    }
+    drain_clients(fds, DAEMON_CLIENTS, 1);
+    attach_elapsed = monitor_now_ns() - start;
+
+    // the daemon blocks on clients that don't read, so they have to be drained while broadcasting
+    drain.fds = fds;
+    drain.count = DAEMON_CLIENTS;
+    drain.lines = options->storm_events;
+    start = monitor_now_ns();
+    pthread_create(&drainer, NULL, &client_drain_proc, &drain);
+    for (unsigned long i = 0; i < options->storm_events; i++)
+        monitor_daemon_on_accent_change(&daemon, 0xFF000000ul | ((i * 0x010203ul) & 0xFFFFFFul), 1);
+    pthread_join(drainer, NULL);
+    elapsed = monitor_now_ns() - start;
+
+    for (int i = 0; i < DAEMON_CLIENTS; i++)
+        close(fds[i]);
+    monitor_daemon_stop(&daemon);
+    pthread_join(thread, NULL);
+    monitor_daemon_destroy(&daemon);
+
+    printf(",\n  \"daemon_fanout\": { \"clients\": %d, \"events\": %lu, \"attach_ns\": %llu, "
+            "\"elapsed_ns\": %llu, \"ns_per_delivery\": %.2f }",
+            DAEMON_CLIENTS,
+            options->storm_events,
+            (unsigned long long) (attach_elapsed / DAEMON_CLIENTS),
+            (unsigned long long) elapsed,
+            (double) elapsed / (options->storm_events * DAEMON_CLIENTS));
+}
+
+
+static void sleep_ms(unsigned long ms) {
+    struct timespec ts;
+    ts.tv_sec = ms / 1000;
+    ts.tv_nsec = (ms % 1000) * 1000000l;
+    nanosleep(&ts, NULL);
+}
+
+
+static void bench_event_storm(const bench_options_t *options, const char *name, window_config_t *config, platform_mock_t *mock, uint32_t debounce_ms) {
+    pthread_t apply_thread;
+    uint64_t start, elapsed;
+    unsigned long dropped;
+
+    monitor_lock(config);
+    config->debounce_ms = debounce_ms;
+    config->dropped_events = 0;
+    monitor_unlock(config);
+    pthread_create(&apply_thread, NULL, &apply_loop_proc, config);
+
+    start = monitor_now_ns();
+    platform_mock_storm(mock, config, options->storm_events, STORM_INTERVAL_NS);
+    elapsed = monitor_now_ns() - start;
+
+    // let the last debounce window close
+    sleep_ms(debounce_ms + 10);
+    monitor_lock(config);
+    dropped = config->dropped_events;
+    config->debounce_ms = 0;
+    monitor_unlock(config);
+
+    monitor_stop(config);
+    pthread_join(apply_thread, NULL);
+    // the apply loop can be started again
+    config->running = 1;
+
+    printf(",\n  \"%s\": { \"events\": %lu, \"broadcasts\": %lu, \"dropped\": %lu, \"elapsed_ns\": %llu }",
+            name,
+            options->storm_events,
+            options->storm_events - dropped,
+            dropped,
+            (unsigned long long) elapsed);
+}
+
+
+static int parse_options(int argc, char **argv, bench_options_t *options) {
+    options->iterations = DEFAULT_ITERATIONS;
+    options->round_trips = DEFAULT_ROUND_TRIPS;
+    options->storm_events = DEFAULT_STORM_EVENTS;
+    options->replay_path = NULL;
+    options->realtime = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) {
+            options->iterations = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--round-trips") == 0 && i + 1 < argc) {
+            options->round_trips = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--storm-events") == 0 && i + 1 < argc) {
+            options->storm_events = strtoul(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            options->replay_path = argv[++i];
+        } else if (strcmp(argv[i], "--realtime") == 0) {
+            options->realtime = 1;
+        } else {
+            fprintf(stderr, "usage: %s [--iterations N] [--round-trips N] [--storm-events N]\n"
+                            "       %s --replay <file> [--realtime]\n", argv[0], argv[0]);
+            return 0;
+        }
+    }
+    if (!options->iterations || !options->round_trips || !options->storm_events) {
+        fprintf(stderr, "iterations, round trips and storm events must be positive\n");
+        return 0;
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    bench_options_t options;
+    platform_mock_t mock;
+    window_config_t config;
+    int null_out;
+
+    if (!parse_options(argc, argv, &options))
+        return 1;
+    if (options.replay_path)
+        return monitor_trace_replay(options.replay_path, options.realtime, stdout);
+
+    null_out = open("/dev/null", O_WRONLY);
+    if (null_out < 0) {
+        perror("open");
+        return 1;
+    }
+    platform_mock_init(&mock);
+    monitor_init(&config, &platform_mock, &mock, null_out);
+
+    printf("{\n  \"benchmarks\": [");
+    bench_parse_message(&options);
+    bench_log_response(&options, &config);
+    bench_log_broadcast(&options, &config);
+    bench_log_record(&options, &config);
+    bench_argb_rgba(&options);
+    bench_best_accent(&options);
+    bench_is_dark_mode(&options, &config);
+    bench_apply_windows(&options, &config, &mock);
+    bench_state_read(&options, &config);
+    printf("\n  ]");
+    bench_event_storm(&options, "event_storm", &config, &mock, 0);
+    bench_event_storm(&options, "event_storm_debounced", &config, &mock, 16);
+    bench_round_trip(&options, "round_trip", 0, 0, 0);
+    bench_throughput(&options, "throughput", 0, 0, 0);
+    bench_round_trip(&options, "round_trip_binary", 1, 0, 0);
+    bench_throughput(&options, "throughput_binary", 1, 0, 0);
+    bench_round_trip(&options, "round_trip_batch", 0, 1, 0);
+    bench_throughput(&options, "throughput_batch", 0, 1, 0);
+    bench_round_trip(&options, "round_trip_binary_batch", 1, 1, 0);
+    bench_throughput(&options, "throughput_binary_batch", 1, 1, 0);
+    // the same, with the monitor in a single thread
+    bench_round_trip(&options, "round_trip_reactor", 0, 0, 1);
+    bench_throughput(&options, "throughput_reactor", 0, 0, 1);
+    bench_round_trip(&options, "round_trip_binary_reactor", 1, 0, 1);
+    bench_throughput(&options, "throughput_binary_reactor", 1, 0, 1);
+    bench_broadcast_contention(&options);
+    bench_daemon_fanout(&options);
+    printf("\n}\n");
+
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+    close(null_out);
+    return 0;
+}
@@ -0,0 +1,118 @@
+#include <math.h>
+
+#include "monitor_color.h"
+
+
+// sRGB channel values converted to linear light, so luminance needs no pow() at runtime
+static double srgb_linear[256];
+
+
+void monitor_color_init(void) {
+    for (int i = 0; i < 256; i++) {
+        double c = i / 255.0;
+        srgb_linear[i] = c <= 0.03928 ? c / 12.92 : pow((c + 0.055) / 1.055, 2.4);
+    }
+}
+
+
+double monitor_color_luminance(uint32_t rgba) {
+    return 0.2126 * srgb_linear[(rgba >> 24) & 0xFF]
+            + 0.7152 * srgb_linear[(rgba >> 16) & 0xFF]
+            + 0.0722 * srgb_linear[(rgba >> 8) & 0xFF];
+}
+
+
+static double contrast_luminance(double l1, double l2) {
+    return l1 > l2 ? (l1 + 0.05) / (l2 + 0.05) : (l2 + 0.05) / (l1 + 0.05);
+}
+
+
+double monitor_color_contrast(uint32_t a, uint32_t b) {
+    return contrast_luminance(monitor_color_luminance(a), monitor_color_luminance(b));
+}
+
+
+/**
+ * Gets a color that is percentage (-100 to 100) brighter or darker than the input.
+ */
+static uint32_t color_shade(uint32_t rgba, int percentage) {
+    double factor = 1 + percentage / 100.0;
+    uint32_t result = rgba & 0xFF;
+
+    for (int shift = 8; shift <= 24; shift += 8) {
+        double c = ((rgba >> shift) & 0xFF) * factor;
+        result |= (c >= 255 ? 255u : (uint32_t) c) << shift;
+    }
+    return result;
+}
+
+
+/**
+ * Finds the percentage closest to 0 in [low, high] (which must not include 0)
+ * where the shade of accent has enough contrast. Contrast only grows further away from 0.
+ */
+static int search_shade(uint32_t accent, double background_luminance, double min_ratio, int low, int high, uint32_t *result) {
+    int found = 0;
+
+    while (low <= high) {
+        int mid = low + (high - low) / 2;
+        uint32_t c = color_shade(accent, mid);
+        if (contrast_luminance(monitor_color_luminance(c), background_luminance) >= min_ratio) {
+            *result = c;
+            found = 1;
+            // look closer to the original color
+            if (mid > 0)
+                high = mid - 1;
+            else
+                low = mid + 1;
+        } else if (mid > 0) {
+            low = mid + 1;
+        } else {
+            high = mid - 1;
+        }
+    }
+    return found;
+}
+
+
+static uint32_t find_best_accent(uint32_t accent, uint32_t background, uint32_t ratio) {
+    double background_luminance = monitor_color_luminance(background);
+    double accent_luminance = monitor_color_luminance(accent);
+    double min_ratio = ratio / 100.0;
+    uint32_t result = accent;
+
+    if (contrast_luminance(accent_luminance, background_luminance) >= min_ratio)
+        return accent;
+
+    // move away from the background first, and try the other way if that isn't enough
+    if (accent_luminance >= background_luminance) {
+        if (!search_shade(accent, background_luminance, min_ratio, 1, 100, &result))
+            search_shade(accent, background_luminance, min_ratio, -100, -1, &result);
+    } else {
+        if (!search_shade(accent, background_luminance, min_ratio, -100, -1, &result))
+            search_shade(accent, background_luminance, min_ratio, 1, 100, &result);
+    }
+    return result;
+}
+
+
+uint32_t monitor_color_best_accent(monitor_color_cache_t *cache, uint32_t accent, uint32_t background, uint32_t ratio) {
+    monitor_color_entry_t *entry;
+
+    if (!cache)
+        return find_best_accent(accent, background, ratio);
+
+    entry = &cache->entries[((accent * 2654435761u) ^ (background * 40503u) ^ ratio) % COLOR_CACHE_SIZE];
+    if (entry->valid && entry->accent == accent && entry->background == background && entry->ratio == ratio) {
+        cache->hits++;
+        return entry->result;
+    }
+
+    cache->misses++;
+    entry->valid = 1;
+    entry->accent = accent;
+    entry->background = background;
+    entry->ratio = ratio;
+    entry->result = find_best_accent(accent, background, ratio);
+    return entry->result;
+}
@@ -0,0 +1,54 @@
+#ifndef MONITOR_COLOR_H
+#define MONITOR_COLOR_H
+
+#include <stdint.h>
+
+
+#define MAX_CONTRAST_COLORS 8
+#define MAX_CONTRAST_RATIO 2100
+#define COLOR_CACHE_SIZE 16
+
+
+/**
+ * A memoized accent variant.
+ */
+typedef struct monitor_color_entry_s {
+    int valid;
+    uint32_t accent, background, ratio;
+    uint32_t result;
+} monitor_color_entry_t;
+
+/**
+ * A direct-mapped cache of accent variants,
+ * keyed by accent, background and contrast ratio.
+ */
+typedef struct monitor_color_cache_s {
+    monitor_color_entry_t entries[COLOR_CACHE_SIZE];
+    unsigned long hits, misses;
+} monitor_color_cache_t;
+
+
+/**
+ * Fills the sRGB to linear table. Must be called before any other function.
+ */
+void monitor_color_init(void);
+
+/**
+ * The relative luminance of an RGBA color, as defined by WCAG.
+ */
+double monitor_color_luminance(uint32_t rgba);
+
+/**
+ * The contrast ratio between two RGBA colors, from 1 to 21.
+ */
+double monitor_color_contrast(uint32_t a, uint32_t b);
+
+/**
+ * Finds the tint or shade of accent closest to the original that has a contrast ratio
+ * of at least ratio / 100 against background. Colors are RGBA and alpha is kept.
+ * If no variant is good enough, the accent is returned unchanged.
+ * The cache is optional.
+ */
+uint32_t monitor_color_best_accent(monitor_color_cache_t *cache, uint32_t accent, uint32_t background, uint32_t ratio);
+
+#endif
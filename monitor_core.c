@@ -0,0 +1,1698 @@
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <limits.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <errno.h>
+#include <unistd.h>
+#endif
+
+#include "monitor_core.h"
+#include "monitor_trace.h"
+
+
+static uint64_t (*clock_fn)(void *ud);
+static void *clock_ud;
+
+
+void monitor_init(window_config_t *config, const monitor_platform_t *platform, void *ud, int out_fd) {
+    memset(config, 0, sizeof(*config));
+    config->running = 1;
+    config->max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    monitor_writer_init(&config->out, out_fd);
+    monitor_color_init();
+    monitor_stats_init(&config->stats);
+    monitor_counter_set(&config->topics, EVENT_ALL);
+    config->platform = platform;
+    config->platform_ud = ud;
+    monitor_mutex_init(&config->mutex);
+    monitor_cond_init(&config->config_changed);
+}
+
+
+void monitor_destroy(window_config_t *config) {
+    monitor_state_close(&config->state_map);
+    monitor_writer_destroy(&config->out);
+    monitor_cond_destroy(&config->config_changed);
+    monitor_mutex_destroy(&config->mutex);
+}
+
+
+void monitor_lock(window_config_t *config) {
+    uint64_t start = monitor_now_ns(), wait;
+
+    monitor_mutex_lock(&config->mutex);
+    config->locked_at = monitor_now_ns();
+    wait = config->locked_at - start;
+    monitor_stats_count(&config->stats, STAT_LOCK_ACQUIRES);
+    monitor_stats_add(&config->stats, STAT_LOCK_WAIT_NS, wait);
+    monitor_stats_record(&config->stats, HIST_LOCK_WAIT, wait);
+    monitor_writer_hold(&config->out);
+}
+
+
+void monitor_unlock(window_config_t *config) {
+    monitor_stats_add(&config->stats, STAT_LOCK_HOLD_NS, monitor_now_ns() - config->locked_at);
+    monitor_mutex_unlock(&config->mutex);
+    // written outside of the mutex, and by a single thread if others are writing too
+    monitor_writer_release(&config->out);
+}
+
+
+/**
+ * Waits for config->config_changed, for at most timeout_ns if it isn't 0.
+ * The time spent waiting doesn't count as holding the mutex,
+ * and the messages held back until then are written first.
+ */
+static void config_wait(window_config_t *config, uint64_t timeout_ns) {
+    monitor_stats_add(&config->stats, STAT_LOCK_HOLD_NS, monitor_now_ns() - config->locked_at);
+    monitor_writer_release(&config->out);
+    if (timeout_ns)
+        monitor_cond_timedwait(&config->config_changed, &config->mutex, timeout_ns);
+    else
+        monitor_cond_wait(&config->config_changed, &config->mutex);
+    config->locked_at = monitor_now_ns();
+    monitor_writer_hold(&config->out);
+}
+
+
+/**
+ * This program communicates via newline (\n) terminated messages.
+ * The message should not exceed config->max_message_size bytes in size, including the newline.
+ * That is DEFAULT_MAX_MESSAGE_SIZE (4096) unless the monitor is started with --max-message,
+ * a longer message is answered with an error.
+ * The message follows a specific format:
+ * serial " " type " " response?
+ *
+ * serial refers to an arbitary value that is sent via the client
+ * that is used to identify the response.
+ * This value is preferrably a number, but it can be anything that
+ * does not contains a space (" ") character.
+ * Note that -1 is reserved for broadcasts.
+ *
+ * type is the type of message or response.
+ *
+ * Anything after type is intepreted as the content.
+ * This content is delimited by a single space (" ") and can be optional.
+ * "-1 error " is a valid message.
+ *
+ * A response have the format of:
+ * serial " " status " " message
+ *
+ * serial is the serial of the incoming message,
+ * while status can be "ok" or "error" to denote a successful or failed operation
+ * respectively.
+ * message is optional, and in case of errors, will be the error message.
+ *
+ * "debounce ms" sets a window in which theme and accent changes are coalesced,
+ * only the last value is broadcasted when the window ends. 0 disables it.
+ * It responds with the number of events that were dropped so far.
+ *
+ * "contrast ratio background*" takes the minimum contrast ratio times 100
+ * and up to 8 RGBA backgrounds as decimal numbers, separated by spaces.
+ * From then on, accents are followed by a variant of the accent for every background
+ * that has at least that contrast ratio against it:
+ * opaque " " accent (" " variant)*
+ * It responds with the current accent. "contrast 0" removes every background.
+ * The backgrounds are kept as they were if the accent can't be read.
+ *
+ * "stats interval?" responds with counters and latency histograms as fields (see below).
+ * If interval is given, the stats are also broadcasted every interval milliseconds,
+ * 0 stops the broadcasts.
+ *
+ * The configuration and the theme are applied to every top-level window of the target,
+ * including the ones opened later. "windows" responds with their handles as decimal numbers,
+ * separated by spaces.
+ * "override window attributes" gives a single window its own attributes, three characters
+ * for extend_border, backdrop_type and dark_mode, each a digit or "-" to follow the config and the theme.
+ * "override window ---" removes every override of the window.
+ *
+ * Several commands can be sent at once with:
+ * serial " batch " type " " content ("\t" type " " content)*
+ * They are executed in order and answered with a single response:
+ * serial " ok " status " " message ("\t" status " " message)*
+ * A failed command doesn't stop the batch, but exit does, and the commands after it get no response.
+ * A batch of more than MAX_BATCH_SIZE commands is answered with an error, and none of them is executed.
+ * If the responses don't fit in a single message, the whole batch is answered with an error instead.
+ *
+ * The ready broadcast is followed by space separated name "=" value fields,
+ * like the window handle and the durations of the startup phases in microseconds.
+ * Stats are sent as fields as well.
+ *
+ * If the client asks for binary mode, messages are sent as binary records instead.
+ * The layout of the records is documented in monitor_core.h.
+ */
+static void log_responsev(window_config_t *config, const char *serial, const char *type, const char *fmt, va_list ap) {
+    char buffer[OUTPUT_MESSAGE_SIZE];
+    // leave room for the newline
+    size_t len, size = sizeof(buffer) - 1;
+    int written;
+
+    // the message is formatted first so it can be written at once
+    written = snprintf(buffer, size, "%s %s ", serial, type);
+    if (written < 0)
+        return;
+    len = (size_t) written < size ? (size_t) written : size - 1;
+
+    written = vsnprintf(buffer + len, size - len, fmt, ap);
+    if (written > 0)
+        len += (size_t) written < size - len ? (size_t) written : size - len - 1;
+    buffer[len++] = '\n';
+    if (config->trace)
+        monitor_trace_output(config->trace, 0, buffer, len);
+    monitor_writer_write(&config->out, buffer, len);
+}
+
+
+void log_response(window_config_t *config, const char *serial, const char *type, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    log_responsev(config, serial, type, fmt, ap);
+    va_end(ap);
+}
+
+
+int parse_message(char *msg, char **serial, char **type, char **content) {
+    char *p, *_serial, *_type, *_content;
+    p = _serial = _type = _content = NULL;
+
+#define NEXT_TOKEN() do { \
+        p = strchr(msg, ' '); \
+        if (!p) return 0; \
+        *p = '\0'; \
+    } while (0)
+#define NEXT_TOKEN_END() msg = p + 1
+
+    // find the serial
+    NEXT_TOKEN();
+    _serial = msg;
+    NEXT_TOKEN_END();
+    // find the type
+    NEXT_TOKEN();
+    _type = msg;
+    NEXT_TOKEN_END();
+    // content is the rest of the string
+    _content = msg;
+
+    *serial = _serial;
+    *type = _type;
+    *content = _content;
+
+    return 1;
+#undef NEXT_TOKEN
+#undef NEXT_TOKEN_END
+}
+
+
+typedef enum {
+    REQUEST_CONFIG,
+    REQUEST_THEME,
+    REQUEST_ACCENT,
+    REQUEST_DEBOUNCE,
+    REQUEST_CONTRAST,
+    REQUEST_STATS,
+    REQUEST_SUBSCRIBE,
+    REQUEST_UNSUBSCRIBE,
+    REQUEST_OVERRIDE,
+    REQUEST_WINDOWS,
+    REQUEST_EXIT,
+} request_type_e;
+
+/**
+ * The combined response of a batch.
+ */
+typedef struct monitor_batch_s {
+    unsigned char data[BATCH_BUFFER_SIZE];
+    size_t len;
+    // set if a response didn't fit, the batch is then answered with an error
+    int overflow;
+} monitor_batch_t;
+
+/**
+ * A decoded request, independent from the protocol it arrived with.
+ */
+typedef struct monitor_request_s {
+    request_type_e type;
+    // serial in text mode
+    const char *serial;
+    // serial in binary mode
+    int32_t id;
+    // if set, the response is appended to the batch instead of being sent
+    monitor_batch_t *batch;
+    int extend_border, backdrop_type;
+    unsigned long debounce_ms;
+    uint32_t contrast_ratio;
+    int contrast_count;
+    uint32_t contrast_colors[MAX_CONTRAST_COLORS];
+    // set if the stats command changes the interval
+    int has_stats_interval;
+    unsigned long stats_interval_ms;
+    // the topics to subscribe to or unsubscribe from
+    unsigned long topics;
+    // the window and the attributes selected by overrides for the override command
+    uint64_t window;
+    window_attrs_t override;
+    config_changed_e overrides;
+} monitor_request_t;
+
+
+static const monitor_request_t broadcast_request = { REQUEST_EXIT, "-1", -1, NULL, 0, 0, 0, 0, 0, { 0 }, 0, 0, 0, 0, { 0 }, 0 };
+
+
+static void write_u32(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+
+static uint32_t read_u32(const unsigned char *p) {
+    return (uint32_t) p[0] | ((uint32_t) p[1] << 8) | ((uint32_t) p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+
+static void write_u64(unsigned char *p, uint64_t value) {
+    write_u32(p, (uint32_t) value);
+    write_u32(p + 4, (uint32_t) (value >> 32));
+}
+
+
+static uint64_t read_u64(const unsigned char *p) {
+    return (uint64_t) read_u32(p) | ((uint64_t) read_u32(p + 4) << 32);
+}
+
+
+static monitor_window_t *find_window(window_config_t *config, uint64_t handle) {
+    for (int i = 0; i < config->window_count; i++) {
+        if (config->windows[i].handle == handle)
+            return &config->windows[i];
+    }
+    return NULL;
+}
+
+
+void log_record(window_config_t *config, int32_t serial, binary_type_e type, const void *payload, size_t len) {
+    unsigned char buffer[BINARY_HEADER_SIZE + BATCH_BUFFER_SIZE];
+
+    if (len > BATCH_BUFFER_SIZE)
+        len = BATCH_BUFFER_SIZE;
+    write_u32(buffer, (uint32_t) serial);
+    buffer[4] = (unsigned char) type;
+    buffer[5] = 0;
+    buffer[6] = len & 0xFF;
+    buffer[7] = (len >> 8) & 0xFF;
+    if (len)
+        memcpy(buffer + BINARY_HEADER_SIZE, payload, len);
+    if (config->trace)
+        monitor_trace_output(config->trace, 1, buffer, BINARY_HEADER_SIZE + len);
+    monitor_writer_write(&config->out, buffer, BINARY_HEADER_SIZE + len);
+}
+
+
+/**
+ * Appends a response to a batch.
+ * In text mode, responses are "status content" separated by tabs.
+ * In binary mode, responses are uint8 status, uint8 length and the payload.
+ * A response that doesn't fit sets batch->overflow rather than being cut,
+ * so the client never pairs a result with the wrong command.
+ */
+static void batch_appendv(window_config_t *config, monitor_batch_t *batch, const char *type, binary_type_e binary_type,
+                            const void *payload, size_t len, const char *fmt, va_list ap) {
+    size_t available = sizeof(batch->data) - batch->len;
+
+    if (batch->overflow)
+        return;
+    if (config->binary) {
+        if (len > 0xFF || available < len + 2) {
+            batch->overflow = 1;
+            return;
+        }
+        batch->data[batch->len++] = (unsigned char) binary_type;
+        batch->data[batch->len++] = (unsigned char) len;
+        if (len)
+            memcpy(batch->data + batch->len, payload, len);
+        batch->len += len;
+    } else {
+        int content_len, written = snprintf((char *) batch->data + batch->len, available, "%s%s ", batch->len ? "\t" : "", type);
+        if (written < 0 || (size_t) written >= available) {
+            batch->overflow = 1;
+            return;
+        }
+        content_len = vsnprintf((char *) batch->data + batch->len + written, available - written, fmt, ap);
+        if (content_len < 0 || (size_t) written + (size_t) content_len >= available) {
+            batch->overflow = 1;
+            return;
+        }
+        batch->len += (size_t) written + (size_t) content_len;
+    }
+}
+
+
+/**
+ * Sends a response or a broadcast in the protocol selected by config->binary.
+ * Text mode uses fmt, binary mode uses payload.
+ */
+static void emit(window_config_t *config, const monitor_request_t *req, const char *type, binary_type_e binary_type,
+                    const void *payload, size_t len, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    if (req->batch)
+        batch_appendv(config, req->batch, type, binary_type, payload, len, fmt, ap);
+    else if (config->binary)
+        log_record(config, req->id, binary_type, payload, len);
+    else
+        log_responsev(config, req->serial, type, fmt, ap);
+    va_end(ap);
+}
+
+
+static void emit_errorv(window_config_t *config, const monitor_request_t *req, const char *type, const char *fmt, va_list ap) {
+    char buffer[BINARY_MAX_PAYLOAD];
+    int len = vsnprintf(buffer, sizeof(buffer), fmt, ap);
+
+    if (len < 0)
+        len = 0;
+    if ((size_t) len >= sizeof(buffer))
+        len = sizeof(buffer) - 1;
+    emit(config, req, type, BINARY_ERROR, buffer, len, "%s", buffer);
+}
+
+
+static void reply_error(window_config_t *config, const monitor_request_t *req, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    emit_errorv(config, req, RESPONSE_ERROR, fmt, ap);
+    va_end(ap);
+}
+
+
+void log_error(window_config_t *config, const char *fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    emit_errorv(config, &broadcast_request, BROADCAST_ERROR, fmt, ap);
+    va_end(ap);
+}
+
+
+static void reply_ok(window_config_t *config, const monitor_request_t *req) {
+    emit(config, req, RESPONSE_OK, BINARY_OK, NULL, 0, "");
+}
+
+
+static void emit_theme(window_config_t *config, const monitor_request_t *req, const char *type, binary_type_e binary_type, int dark_mode) {
+    unsigned char payload = !!dark_mode;
+    emit(config, req, type, binary_type, &payload, 1, "%d", dark_mode);
+}
+
+
+/**
+ * Calculates the variant of an accent for every background set by the contrast command.
+ */
+static int accent_variants(window_config_t *config, uint32_t rgba, int opaque, uint32_t *variants) {
+    for (int i = 0; i < config->contrast_count; i++) {
+        // opaque colors are blended without their alpha
+        variants[i] = monitor_color_best_accent(&config->colors, opaque ? rgba | 0xFF : rgba,
+                                                config->contrast_colors[i], config->contrast_ratio);
+    }
+    return config->contrast_count;
+}
+
+
+/**
+ * Sends an accent along with its variants for every background set by the contrast command.
+ */
+static void emit_accent(window_config_t *config, const monitor_request_t *req, const char *type, binary_type_e binary_type, unsigned long color, int opaque) {
+    unsigned char payload[5 + 4 * MAX_CONTRAST_COLORS];
+    char text[MAX_CONTRAST_COLORS * 11 + 1];
+    uint32_t rgba = (uint32_t) ARGB_RGBA(color), variants[MAX_CONTRAST_COLORS];
+    size_t len = 5, text_len = 0;
+    int count = accent_variants(config, rgba, opaque, variants);
+
+    payload[0] = !!opaque;
+    write_u32(payload + 1, rgba);
+    text[0] = '\0';
+    for (int i = 0; i < count; i++) {
+        write_u32(payload + len, variants[i]);
+        len += 4;
+        text_len += snprintf(text + text_len, sizeof(text) - text_len, " %lu", (unsigned long) variants[i]);
+    }
+    emit(config, req, type, binary_type, payload, len, "%d %lu%s", opaque, ARGB_RGBA(color), text);
+}
+
+
+/**
+ * Writes config->state to the shared page, if there is one.
+ */
+static void publish_state(window_config_t *config) {
+    if (config->state_map.page)
+        monitor_state_write(config->state_map.page, &config->state);
+}
+
+
+static void publish_theme(window_config_t *config, int dark_mode) {
+    config->state.flags |= STATE_DARK_MODE;
+    config->state.dark_mode = !!dark_mode;
+    publish_state(config);
+}
+
+
+static void publish_accent(window_config_t *config, unsigned long color, int opaque) {
+    config->state.flags |= STATE_ACCENT;
+    config->state.accent = (uint32_t) ARGB_RGBA(color);
+    config->state.opaque = !!opaque;
+    config->state.variant_count = (uint32_t) accent_variants(config, config->state.accent, opaque, config->state.variants);
+    publish_state(config);
+}
+
+
+/**
+ * Sends fields as "name=value" pairs, or as uint8 name length, name, uint64 value records in binary mode.
+ * Fields that don't fit are left out.
+ */
+static void emit_fields(window_config_t *config, const monitor_request_t *req, const char *type, binary_type_e binary_type,
+                        const monitor_field_t *fields, size_t count) {
+    unsigned char payload[BATCH_BUFFER_SIZE];
+    char text[BATCH_BUFFER_SIZE];
+    size_t len = 0, text_len = 0;
+
+    text[0] = '\0';
+    for (size_t i = 0; i < count; i++) {
+        size_t name_len = strlen(fields[i].name);
+        int written;
+
+        if (name_len > 0xFF || len + 1 + name_len + 8 > sizeof(payload))
+            break;
+        written = snprintf(text + text_len, sizeof(text) - text_len, "%s%s=%llu",
+                            text_len ? " " : "", fields[i].name, (unsigned long long) fields[i].value);
+        if (written < 0 || (size_t) written >= sizeof(text) - text_len)
+            break;
+        text_len += written;
+
+        payload[len++] = (unsigned char) name_len;
+        memcpy(payload + len, fields[i].name, name_len);
+        len += name_len;
+        write_u32(payload + len, (uint32_t) fields[i].value);
+        write_u32(payload + len + 4, (uint32_t) (fields[i].value >> 32));
+        len += 8;
+    }
+    emit(config, req, type, binary_type, payload, len, "%s", text);
+}
+
+
+void monitor_broadcast_ready(window_config_t *config, const monitor_field_t *fields, size_t count) {
+    emit_fields(config, &broadcast_request, BROADCAST_READY, BINARY_READY, fields, count);
+}
+
+
+/**
+ * Sends every stat along with the output statistics and dropped events.
+ */
+static void emit_stats(window_config_t *config, const monitor_request_t *req, const char *type, binary_type_e binary_type) {
+    monitor_field_t fields[MAX_STATS_FIELDS];
+    char names[STATS_NAMES_SIZE];
+    size_t count = 0;
+
+    fields[count].name = "dropped_events";
+    fields[count++].value = config->dropped_events;
+    monitor_mutex_lock(&config->out.mutex);
+    fields[count].name = "writer_messages";
+    fields[count++].value = config->out.messages;
+    fields[count].name = "write_syscalls";
+    fields[count++].value = config->out.syscalls;
+    monitor_mutex_unlock(&config->out.mutex);
+    monitor_stats_fields(&config->stats, fields, &count, MAX_STATS_FIELDS, names, sizeof(names));
+    emit_fields(config, req, type, binary_type, fields, count);
+}
+
+
+/**
+ * Broadcasts the pending events if they differ from the last broadcasted values.
+ * config->mutex must be held.
+ */
+static void flush_events(window_config_t *config) {
+    if (config->pending)
+        monitor_stats_record(&config->stats, HIST_EVENT_LATENCY, monitor_now_ns() - config->event_time);
+
+    if (config->pending & EVENT_THEME) {
+        int changed = config->pending_dark_mode != config->desired.dark_mode;
+
+        if (changed) {
+            config->desired.dark_mode = config->pending_dark_mode;
+            publish_theme(config, config->desired.dark_mode);
+            monitor_cond_signal(&config->config_changed);
+        }
+        if (!(monitor_counter_get(&config->topics) & EVENT_THEME)) {
+            // the client is told once it subscribes again
+            config->theme_unsent |= changed;
+        } else if (changed || config->theme_unsent) {
+            config->theme_unsent = 0;
+            emit_theme(config, &broadcast_request, BROADCAST_THEMECHANGE, BINARY_THEMECHANGE, config->desired.dark_mode);
+            monitor_stats_count(&config->stats, STAT_BROADCASTS);
+        } else {
+            config->dropped_events++;
+        }
+    }
+
+    if (config->pending & EVENT_ACCENT) {
+        if (!config->accent_sent
+            || config->pending_accent != config->last_accent
+            || config->pending_opaque != config->last_opaque) {
+            config->accent_sent = 1;
+            config->last_accent = config->pending_accent;
+            config->last_opaque = config->pending_opaque;
+            emit_accent(config, &broadcast_request, BROADCAST_ACCENTCHANGE, BINARY_ACCENTCHANGE,
+                        config->last_accent, config->last_opaque);
+            monitor_stats_count(&config->stats, STAT_BROADCASTS);
+            publish_accent(config, config->last_accent, config->last_opaque);
+        } else {
+            config->dropped_events++;
+        }
+    }
+
+    config->pending = 0;
+    config->event_deadline = 0;
+}
+
+
+/**
+ * Queues an event to be broadcasted once the debounce window ends,
+ * or immediately if there is no debounce window.
+ * config->mutex must be held.
+ */
+static void queue_event(window_config_t *config, event_pending_e event) {
+    // the client may have unsubscribed since the platform checked, the theme is applied anyway
+    if (event != EVENT_THEME && !(monitor_counter_get(&config->topics) & event))
+        return;
+    // the previous event of the same kind is replaced and will never be broadcasted
+    if (config->pending & event)
+        config->dropped_events++;
+    if (!config->pending)
+        config->event_time = monitor_now_ns();
+    config->pending |= event;
+
+    if (!config->debounce_ms) {
+        flush_events(config);
+    } else if (!config->event_deadline) {
+        config->event_deadline = monitor_now_ns() + (uint64_t) config->debounce_ms * 1000000ull;
+        // wake up the apply loop so it waits for the deadline
+        monitor_cond_signal(&config->config_changed);
+    }
+}
+
+
+static int execute_request(window_config_t *config, const monitor_request_t *req) {
+    monitor_error_t err;
+
+    switch (req->type) {
+    case REQUEST_CONFIG:
+        if (!config->platform->supports_backdrop(config->platform_ud, req->backdrop_type, &err)) {
+            reply_error(config, req, "%s", err.message);
+            return 1;
+        }
+        config->desired.backdrop_type = req->backdrop_type;
+        config->desired.extend_border = !!req->extend_border;
+
+        monitor_cond_signal(&config->config_changed);
+        reply_ok(config, req);
+        return 1;
+
+    case REQUEST_THEME: {
+        int value;
+
+        if (!config->platform->get_dark_mode(config->platform_ud, &value, &err)) {
+            reply_error(config, req, "%s", err.message);
+            return 0;
+        }
+        emit_theme(config, req, RESPONSE_OK, BINARY_OK, value);
+        publish_theme(config, value);
+        return 1;
+    }
+
+    case REQUEST_ACCENT: {
+        unsigned long color;
+        int opaque;
+
+        if (!config->platform->get_accent(config->platform_ud, &color, &opaque, &err)) {
+            reply_error(config, req, "%s", err.message);
+            return 0;
+        }
+        emit_accent(config, req, RESPONSE_OK, BINARY_OK, color, opaque);
+        publish_accent(config, color, opaque);
+        return 1;
+    }
+
+    case REQUEST_DEBOUNCE: {
+        unsigned char payload[4];
+
+        config->debounce_ms = req->debounce_ms;
+        // events waiting for the old window are sent right away
+        if (!config->debounce_ms && config->pending)
+            flush_events(config);
+        write_u32(payload, (uint32_t) config->dropped_events);
+        emit(config, req, RESPONSE_OK, BINARY_OK, payload, sizeof(payload), "%lu", config->dropped_events);
+        return 1;
+    }
+
+    case REQUEST_CONTRAST: {
+        unsigned long color;
+        int opaque;
+
+        // the backgrounds are only replaced once there is an accent to answer with
+        if (!config->platform->get_accent(config->platform_ud, &color, &opaque, &err)) {
+            reply_error(config, req, "%s", err.message);
+            return 1;
+        }
+        config->contrast_ratio = req->contrast_ratio;
+        config->contrast_count = req->contrast_count;
+        memcpy(config->contrast_colors, req->contrast_colors, sizeof(config->contrast_colors));
+        emit_accent(config, req, RESPONSE_OK, BINARY_OK, color, opaque);
+        publish_accent(config, color, opaque);
+        return 1;
+    }
+
+    case REQUEST_STATS:
+        if (req->has_stats_interval) {
+            config->stats_interval_ms = (uint32_t) req->stats_interval_ms;
+            config->stats_deadline = config->stats_interval_ms
+                                        ? monitor_now_ns() + (uint64_t) config->stats_interval_ms * 1000000ull
+                                        : 0;
+            // wake up the apply loop so it waits for the deadline
+            monitor_cond_signal(&config->config_changed);
+        }
+        emit_stats(config, req, RESPONSE_OK, BINARY_OK);
+        return 1;
+
+    case REQUEST_SUBSCRIBE:
+    case REQUEST_UNSUBSCRIBE: {
+        unsigned long old_topics = (unsigned long) monitor_counter_get(&config->topics), topics;
+        unsigned char payload[1];
+
+        topics = req->type == REQUEST_SUBSCRIBE ? old_topics | req->topics : old_topics & ~req->topics;
+        monitor_counter_set(&config->topics, topics);
+        // events nobody wants anymore are forgotten, so the next one is always broadcasted,
+        // except for the theme which still has to be applied
+        config->pending &= (event_pending_e) (topics | EVENT_THEME);
+        if (!config->pending)
+            config->event_deadline = 0;
+        if (!(topics & EVENT_ACCENT))
+            config->accent_sent = 0;
+
+        // the theme may have changed while the client wasn't subscribed, it is told with the next flush
+        if (((topics & ~old_topics) & EVENT_THEME) && config->theme_unsent && !(config->pending & EVENT_THEME)) {
+            config->pending_dark_mode = config->desired.dark_mode;
+            queue_event(config, EVENT_THEME);
+        }
+        payload[0] = (unsigned char) topics;
+        emit(config, req, RESPONSE_OK, BINARY_OK, payload, sizeof(payload), "%lu", topics);
+        config->state.topics = (uint32_t) topics;
+        publish_state(config);
+        return 1;
+    }
+
+    case REQUEST_OVERRIDE: {
+        monitor_window_t *window = find_window(config, req->window);
+
+        if (!window) {
+            reply_error(config, req, "unknown window: %llu", (unsigned long long) req->window);
+            return 1;
+        }
+        if ((req->overrides & CONFIG_BACKDROP_TYPE)
+                && !config->platform->supports_backdrop(config->platform_ud, req->override.backdrop_type, &err)) {
+            reply_error(config, req, "%s", err.message);
+            return 1;
+        }
+        window->override = req->override;
+        window->overrides = req->overrides;
+
+        monitor_cond_signal(&config->config_changed);
+        reply_ok(config, req);
+        return 1;
+    }
+
+    case REQUEST_WINDOWS: {
+        unsigned char payload[MAX_WINDOWS * 8];
+        // a space and up to 20 digits for every window
+        char text[MAX_WINDOWS * 21 + 1];
+        size_t len = 0;
+
+        text[0] = '\0';
+        for (int i = 0; i < config->window_count; i++) {
+            write_u64(payload + i * 8, config->windows[i].handle);
+            len += (size_t) snprintf(text + len, sizeof(text) - len, "%s%llu",
+                                        i ? " " : "", (unsigned long long) config->windows[i].handle);
+        }
+        emit(config, req, RESPONSE_OK, BINARY_OK, payload, (size_t) config->window_count * 8, "%s", text);
+        return 1;
+    }
+
+    case REQUEST_EXIT:
+        reply_ok(config, req);
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Sets the override of req from values that are -1 to follow the config and the theme.
+ * Returns 0 and replies with an error if one is invalid.
+ */
+static int check_override(window_config_t *config, monitor_request_t *req, int extend_border, int backdrop_type, int dark_mode) {
+    req->type = REQUEST_OVERRIDE;
+    if (extend_border < -1 || extend_border > 1 || backdrop_type < -1 || backdrop_type >= BACKDROP_MAX
+            || dark_mode < -1 || dark_mode > 1) {
+        reply_error(config, req, "invalid override: %d %d %d", extend_border, backdrop_type, dark_mode);
+        return 0;
+    }
+    if (extend_border >= 0) {
+        req->override.extend_border = extend_border;
+        req->overrides |= CONFIG_EXTEND_BORDER;
+    }
+    if (backdrop_type >= 0) {
+        req->override.backdrop_type = (window_backdrop_e) backdrop_type;
+        req->overrides |= CONFIG_BACKDROP_TYPE;
+    }
+    if (dark_mode >= 0) {
+        req->override.dark_mode = dark_mode;
+        req->overrides |= CONFIG_DARK_MODE;
+    }
+    return 1;
+}
+
+
+/**
+ * Checks the ratio and backgrounds of a contrast command.
+ * Returns 0 and replies with an error if they are invalid.
+ */
+static int check_contrast(window_config_t *config, monitor_request_t *req) {
+    req->type = REQUEST_CONTRAST;
+    if (req->contrast_count && (req->contrast_ratio < 100 || req->contrast_ratio > MAX_CONTRAST_RATIO)) {
+        reply_error(config, req, "invalid contrast ratio: %lu", (unsigned long) req->contrast_ratio);
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Decodes a text command into req.
+ * Returns 0 and replies with an error if the command is invalid.
+ */
+static int decode_message(window_config_t *config, monitor_request_t *req, const char *type, const char *content) {
+    if (strcmp(type, CMD_CONFIG) == 0) {
+        if (strlen(content) != 2) {
+            reply_error(config, req, "invalid length: %d", (int) strlen(content));
+            return 0;
+        }
+        req->type = REQUEST_CONFIG;
+        req->extend_border = content[0] - '0';
+        req->backdrop_type = content[1] - '0';
+        if (req->backdrop_type < 0 || req->backdrop_type >= BACKDROP_MAX) {
+            reply_error(config, req, "invalid backdrop type: %c", content[1]);
+            return 0;
+        }
+    } else if (strcmp(type, CMD_THEME) == 0) {
+        req->type = REQUEST_THEME;
+    } else if (strcmp(type, CMD_ACCENT) == 0) {
+        req->type = REQUEST_ACCENT;
+    } else if (strcmp(type, CMD_DEBOUNCE) == 0) {
+        char *end;
+        req->type = REQUEST_DEBOUNCE;
+        req->debounce_ms = strtoul(content, &end, 10);
+        if (end == content || *end || req->debounce_ms > MAX_DEBOUNCE_MS) {
+            reply_error(config, req, "invalid debounce: \"%s\"", content);
+            return 0;
+        }
+    } else if (strcmp(type, CMD_CONTRAST) == 0) {
+        const char *p = content;
+        char *end;
+        // strtoull takes leading blanks and signs, so every number has to start with a digit
+        unsigned long long value = isdigit((unsigned char) *p) ? strtoull(p, &end, 10) : ULLONG_MAX;
+
+        if (value > MAX_CONTRAST_RATIO) {
+            reply_error(config, req, "invalid contrast: \"%s\"", content);
+            return 0;
+        }
+        req->contrast_ratio = (uint32_t) value;
+        for (p = end; *p; p = end) {
+            // unsigned long is only 32 bits on Windows, where it can't tell a color from an overflow
+            value = *p == ' ' && isdigit((unsigned char) p[1]) ? strtoull(p, &end, 10) : ULLONG_MAX;
+            if (value > 0xFFFFFFFFull || req->contrast_count == MAX_CONTRAST_COLORS) {
+                reply_error(config, req, "invalid contrast: \"%s\"", content);
+                return 0;
+            }
+            req->contrast_colors[req->contrast_count++] = (uint32_t) value;
+        }
+        return check_contrast(config, req);
+    } else if (strcmp(type, CMD_STATS) == 0) {
+        char *end;
+        req->type = REQUEST_STATS;
+        if (*content) {
+            req->has_stats_interval = 1;
+            req->stats_interval_ms = strtoul(content, &end, 10);
+            if (end == content || *end || req->stats_interval_ms > MAX_STATS_INTERVAL_MS) {
+                reply_error(config, req, "invalid stats interval: \"%s\"", content);
+                return 0;
+            }
+        }
+    } else if (strcmp(type, CMD_SUBSCRIBE) == 0 || strcmp(type, CMD_UNSUBSCRIBE) == 0) {
+        char *end;
+        req->type = strcmp(type, CMD_SUBSCRIBE) == 0 ? REQUEST_SUBSCRIBE : REQUEST_UNSUBSCRIBE;
+        req->topics = strtoul(content, &end, 10);
+        if (end == content || *end || (req->topics & ~(unsigned long) EVENT_ALL)) {
+            reply_error(config, req, "invalid topics: \"%s\"", content);
+            return 0;
+        }
+    } else if (strcmp(type, CMD_OVERRIDE) == 0) {
+        char *end;
+        int values[3];
+
+        req->window = strtoull(content, &end, 10);
+        if (end == content || *end != ' ' || strlen(end + 1) != 3) {
+            reply_error(config, req, "invalid override: \"%s\"", content);
+            return 0;
+        }
+        for (int i = 0; i < 3; i++) {
+            if (end[i + 1] != '-' && !isdigit((unsigned char) end[i + 1])) {
+                reply_error(config, req, "invalid override: \"%s\"", content);
+                return 0;
+            }
+            values[i] = end[i + 1] == '-' ? -1 : end[i + 1] - '0';
+        }
+        return check_override(config, req, values[0], values[1], values[2]);
+    } else if (strcmp(type, CMD_WINDOWS) == 0) {
+        req->type = REQUEST_WINDOWS;
+    } else if (strcmp(type, CMD_EXIT) == 0) {
+        req->type = REQUEST_EXIT;
+    } else {
+        reply_error(config, req, "invalid command: \"%s\"", type);
+        return 0;
+    }
+    return 1;
+}
+
+
+/**
+ * Executes every tab-separated "type content" command in content
+ * and replies with every response in a single message.
+ * A batch with too many commands is answered with an error before any of them is executed.
+ */
+static int handle_message_batch(window_config_t *config, const char *serial, char *content) {
+    monitor_batch_t batch;
+    int count = 0, keep_going = 1;
+    char *p, *next;
+
+    for (p = content; p && *p; p = next) {
+        next = strchr(p, '\t');
+        if (next)
+            next++;
+        if (++count > MAX_BATCH_SIZE) {
+            log_response(config, serial, RESPONSE_ERROR, "batch too large");
+            return 1;
+        }
+    }
+
+    batch.len = 0;
+    batch.overflow = 0;
+    for (p = content; p && *p && keep_going; p = next) {
+        char *type = p, *args;
+        monitor_request_t req = { 0 };
+        req.batch = &batch;
+
+        next = strchr(p, '\t');
+        if (next)
+            *next++ = '\0';
+        // content is optional here
+        args = strchr(type, ' ');
+        if (args)
+            *args++ = '\0';
+        else
+            args = "";
+
+        if (decode_message(config, &req, type, args))
+            keep_going = execute_request(config, &req);
+    }
+    if (batch.overflow)
+        log_response(config, serial, RESPONSE_ERROR, "batch response too large");
+    else
+        log_response(config, serial, RESPONSE_OK, "%.*s", (int) batch.len, batch.data);
+    return keep_going;
+}
+
+
+int monitor_handle_message(window_config_t *config, char *msg) {
+    char *serial, *type, *content;
+    monitor_request_t req = { 0 };
+
+    monitor_stats_count(&config->stats, STAT_MESSAGES);
+    if (!parse_message(msg, &serial, &type, &content)) {
+        monitor_stats_count(&config->stats, STAT_PARSE_ERRORS);
+        log_error(config, "invalid command: \"%s\"", msg);
+        return 1;
+    }
+    req.serial = serial;
+
+    if (strcmp(type, CMD_BATCH) == 0)
+        return handle_message_batch(config, serial, content);
+    if (!decode_message(config, &req, type, content)) {
+        monitor_stats_count(&config->stats, STAT_PARSE_ERRORS);
+        return 1;
+    }
+    return execute_request(config, &req);
+}
+
+
+/**
+ * Decodes a binary command into req.
+ * Returns 0 and replies with an error if the command is invalid.
+ */
+static int decode_record(window_config_t *config, monitor_request_t *req, binary_type_e type, const unsigned char *payload, size_t len) {
+    switch (type) {
+    case BINARY_CONFIG:
+        if (len != 2) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->type = REQUEST_CONFIG;
+        req->extend_border = payload[0];
+        req->backdrop_type = payload[1];
+        if (req->backdrop_type >= BACKDROP_MAX) {
+            reply_error(config, req, "invalid backdrop type: %d", req->backdrop_type);
+            return 0;
+        }
+        return 1;
+    case BINARY_THEME:
+        req->type = REQUEST_THEME;
+        return 1;
+    case BINARY_ACCENT:
+        req->type = REQUEST_ACCENT;
+        return 1;
+    case BINARY_DEBOUNCE:
+        if (len != 4) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->type = REQUEST_DEBOUNCE;
+        req->debounce_ms = read_u32(payload);
+        if (req->debounce_ms > MAX_DEBOUNCE_MS) {
+            reply_error(config, req, "invalid debounce: %lu", req->debounce_ms);
+            return 0;
+        }
+        return 1;
+    case BINARY_CONTRAST:
+        if (len < 2 || (len - 2) % 4 || (len - 2) / 4 > MAX_CONTRAST_COLORS) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->contrast_ratio = payload[0] | (payload[1] << 8);
+        for (size_t pos = 2; pos < len; pos += 4)
+            req->contrast_colors[req->contrast_count++] = read_u32(payload + pos);
+        return check_contrast(config, req);
+    case BINARY_STATS:
+        if (len != 0 && len != 4) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->type = REQUEST_STATS;
+        if (len) {
+            req->has_stats_interval = 1;
+            req->stats_interval_ms = read_u32(payload);
+            if (req->stats_interval_ms > MAX_STATS_INTERVAL_MS) {
+                reply_error(config, req, "invalid stats interval: %lu", req->stats_interval_ms);
+                return 0;
+            }
+        }
+        return 1;
+    case BINARY_SUBSCRIBE:
+    case BINARY_UNSUBSCRIBE:
+        if (len != 1) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->type = type == BINARY_SUBSCRIBE ? REQUEST_SUBSCRIBE : REQUEST_UNSUBSCRIBE;
+        req->topics = payload[0];
+        if (req->topics & ~(unsigned long) EVENT_ALL) {
+            reply_error(config, req, "invalid topics: %lu", req->topics);
+            return 0;
+        }
+        return 1;
+    case BINARY_OVERRIDE:
+        if (len != 11) {
+            reply_error(config, req, "invalid length: %d", (int) len);
+            return 0;
+        }
+        req->window = read_u64(payload);
+        return check_override(config, req,
+                                payload[8] == BINARY_NO_OVERRIDE ? -1 : payload[8],
+                                payload[9] == BINARY_NO_OVERRIDE ? -1 : payload[9],
+                                payload[10] == BINARY_NO_OVERRIDE ? -1 : payload[10]);
+    case BINARY_WINDOWS:
+        req->type = REQUEST_WINDOWS;
+        return 1;
+    case BINARY_EXIT:
+        req->type = REQUEST_EXIT;
+        return 1;
+    default:
+        reply_error(config, req, "invalid command: %d", (int) type);
+        return 0;
+    }
+}
+
+
+/**
+ * Executes every uint8 type, uint8 length, payload command in payload
+ * and replies with every response in a single record.
+ * A batch with too many commands or a command that doesn't end with the payload
+ * is answered with an error before any of them is executed.
+ */
+static int handle_record_batch(window_config_t *config, int32_t serial, const unsigned char *payload, size_t len) {
+    monitor_batch_t batch;
+    size_t pos = 0;
+    int count = 0, keep_going = 1;
+
+    while (pos < len) {
+        static const char too_large[] = "batch too large", invalid[] = "invalid batch";
+
+        if (++count > MAX_BATCH_SIZE) {
+            log_record(config, serial, BINARY_ERROR, too_large, sizeof(too_large) - 1);
+            return 1;
+        }
+        if (pos + 2 > len || pos + 2 + payload[pos + 1] > len) {
+            log_record(config, serial, BINARY_ERROR, invalid, sizeof(invalid) - 1);
+            return 1;
+        }
+        pos += 2 + (size_t) payload[pos + 1];
+    }
+
+    batch.len = 0;
+    batch.overflow = 0;
+    pos = 0;
+    while (pos < len && keep_going) {
+        monitor_request_t req = { 0 };
+        size_t sub_len = payload[pos + 1];
+
+        req.batch = &batch;
+        if (decode_record(config, &req, payload[pos], payload + pos + 2, sub_len))
+            keep_going = execute_request(config, &req);
+        pos += 2 + sub_len;
+    }
+    if (batch.overflow) {
+        static const char message[] = "batch response too large";
+        log_record(config, serial, BINARY_ERROR, message, sizeof(message) - 1);
+    } else {
+        log_record(config, serial, BINARY_OK, batch.data, batch.len);
+    }
+    return keep_going;
+}
+
+
+int monitor_handle_record(window_config_t *config, int32_t serial, binary_type_e type, const unsigned char *payload, size_t len) {
+    monitor_request_t req = { 0 };
+    req.id = serial;
+
+    monitor_stats_count(&config->stats, STAT_MESSAGES);
+    if (type == BINARY_BATCH)
+        return handle_record_batch(config, serial, payload, len);
+    if (!decode_record(config, &req, type, payload, len)) {
+        monitor_stats_count(&config->stats, STAT_PARSE_ERRORS);
+        return 1;
+    }
+    return execute_request(config, &req);
+}
+
+
+/**
+ * Rejects a line that doesn't fit in config->max_message_size along with its newline.
+ * The error goes to its serial if it made it into the buffer, so the client doesn't wait for a response.
+ */
+static void reject_line(window_config_t *config, const char *line, size_t len) {
+    monitor_request_t req = { 0 };
+    char serial[16];
+    size_t n = 0;
+
+    while (n < len && n < sizeof(serial) - 1 && (isdigit((unsigned char) line[n]) || (n == 0 && line[n] == '-')))
+        n++;
+    memcpy(serial, line, n);
+    serial[n] = '\0';
+    req.serial = n && (n < len && line[n] == ' ') && strcmp(serial, "-") != 0 ? serial : broadcast_request.serial;
+
+    monitor_stats_count(&config->stats, STAT_PARSE_ERRORS);
+    reply_error(config, &req, "message too long: more than %lu bytes", (unsigned long) config->max_message_size);
+}
+
+
+size_t monitor_handle_input(window_config_t *config, char *buffer, size_t len, int *keep_going) {
+    size_t pos = 0;
+    int locked = 0;
+
+    *keep_going = 1;
+    while (*keep_going && pos < len) {
+        unsigned char *header = (unsigned char *) buffer + pos;
+        size_t available = len - pos, record_len;
+
+        if (!config->binary) {
+            char *end = memchr(buffer + pos, '\n', available);
+            size_t line_len = end ? (size_t) (end - (buffer + pos)) : available;
+
+            // the newline counts too
+            if (config->skip_line || line_len >= config->max_message_size) {
+                if (!config->skip_line) {
+                    if (!locked)
+                        monitor_lock(config);
+                    locked = 1;
+                    reject_line(config, buffer + pos, line_len);
+                }
+                config->skip_line = !end;
+                pos = end ? (size_t) (end - buffer) + 1 : len;
+                continue;
+            }
+            if (!end)
+                break;
+            *end = '\0';
+
+            if (!locked)
+                monitor_lock(config);
+            locked = 1;
+            // check if window is valid before we continue processing
+            *keep_going = config->running && config->platform->is_window(config->platform_ud)
+                            && monitor_handle_message(config, buffer + pos);
+            pos = (size_t) (end - buffer) + 1;
+            continue;
+        }
+
+        if (config->skip_record) {
+            size_t skipped = available < config->skip_record ? available : config->skip_record;
+            config->skip_record -= skipped;
+            pos += skipped;
+            continue;
+        }
+        if (available < BINARY_HEADER_SIZE)
+            break;
+        record_len = header[6] | (header[7] << 8);
+        if (available < BINARY_HEADER_SIZE + record_len && BINARY_HEADER_SIZE + record_len <= config->max_message_size)
+            break;
+
+        if (!locked)
+            monitor_lock(config);
+        locked = 1;
+        if (BINARY_HEADER_SIZE + record_len > config->max_message_size) {
+            monitor_request_t req = { 0 };
+
+            // the header tells where the record ends, so it is skipped even if it ends in a later call
+            req.id = (int32_t) read_u32(header);
+            monitor_stats_count(&config->stats, STAT_PARSE_ERRORS);
+            reply_error(config, &req, "message too long: more than %lu bytes", (unsigned long) config->max_message_size);
+            config->skip_record = BINARY_HEADER_SIZE + record_len;
+            continue;
+        }
+        *keep_going = config->running && config->platform->is_window(config->platform_ud)
+                        && monitor_handle_record(config, (int32_t) read_u32(header), header[4],
+                                                    header + BINARY_HEADER_SIZE, record_len);
+        pos += BINARY_HEADER_SIZE + record_len;
+    }
+    if (locked)
+        monitor_unlock(config);
+    return pos;
+}
+
+
+/**
+ * Reads up to len bytes, returns 0 on EOF and -1 on failure.
+ */
+static long read_chunk(int fd, char *buffer, size_t len) {
+#ifdef _WIN32
+    return _read(fd, buffer, (unsigned int) len);
+#else
+    ssize_t n;
+    do {
+        n = read(fd, buffer, len);
+    } while (n < 0 && errno == EINTR);
+    return (long) n;
+#endif
+}
+
+
+void monitor_read_loop(window_config_t *config, int in_fd) {
+    size_t size = config->max_message_size + READ_CHUNK_SIZE, len = 0;
+    char *buffer = (char *) malloc(size);
+    int keep_going = 1;
+
+    if (!buffer) {
+        monitor_lock(config);
+        log_error(config, "monitor_read_loop: out of memory");
+        monitor_unlock(config);
+        return;
+    }
+
+    while (keep_going) {
+        // every complete message was handled, so there is always room for a chunk
+        long n = read_chunk(in_fd, buffer + len, size - len);
+        size_t pos;
+
+        if (n <= 0)
+            break;
+        if (config->trace)
+            monitor_trace_record(config->trace, TRACE_INPUT, buffer + len, (size_t) n);
+        len += (size_t) n;
+        pos = monitor_handle_input(config, buffer, len, &keep_going);
+        memmove(buffer, buffer + pos, len - pos);
+        len -= pos;
+    }
+    free(buffer);
+}
+
+
+/**
+ * Broadcasts the events whose debounce window ended and the stats if they are due.
+ */
+static void run_timers(window_config_t *config, uint64_t now) {
+    if (config->event_deadline && now >= config->event_deadline)
+        flush_events(config);
+    if (config->stats_deadline && now >= config->stats_deadline) {
+        emit_stats(config, &broadcast_request, BROADCAST_STATS, BINARY_STATS_BROADCAST);
+        config->stats_deadline = now + (uint64_t) config->stats_interval_ms * 1000000ull;
+    }
+}
+
+
+/**
+ * What the window should look like: config->desired with its overrides on top.
+ */
+static window_attrs_t window_target(const window_config_t *config, const monitor_window_t *window) {
+    window_attrs_t attrs = config->desired;
+
+    if (window->overrides & CONFIG_DARK_MODE)
+        attrs.dark_mode = window->override.dark_mode;
+    if (window->overrides & CONFIG_EXTEND_BORDER)
+        attrs.extend_border = window->override.extend_border;
+    if (window->overrides & CONFIG_BACKDROP_TYPE)
+        attrs.backdrop_type = window->override.backdrop_type;
+    return attrs;
+}
+
+
+// the attributes in the order they are set
+static const config_changed_e apply_order[] = { CONFIG_EXTEND_BORDER, CONFIG_DARK_MODE, CONFIG_BACKDROP_TYPE };
+
+
+static uint64_t earliest(uint64_t a, uint64_t b) {
+    return !a || (b && b < a) ? b : a;
+}
+
+
+static int attr_value(const window_attrs_t *attrs, config_changed_e attr) {
+    return attr == CONFIG_DARK_MODE ? attrs->dark_mode
+            : attr == CONFIG_EXTEND_BORDER ? attrs->extend_border
+            : (int) attrs->backdrop_type;
+}
+
+
+static apply_retry_t *window_retry(monitor_window_t *window, config_changed_e attr) {
+    return &window->retries[attr == CONFIG_DARK_MODE ? 0 : attr == CONFIG_EXTEND_BORDER ? 1 : 2];
+}
+
+
+/**
+ * The time at which the attribute can be set to the value it has in target:
+ * DEADLINE_NOW unless it is backing off after failing to reach that value,
+ * or 0 if it was given up on.
+ */
+static uint64_t attr_deadline(monitor_window_t *window, const window_attrs_t *target, config_changed_e attr) {
+    const apply_retry_t *retry = window_retry(window, attr);
+
+    // a failure only holds back the value that failed, another one is tried right away
+    if (!retry->count || retry->target != attr_value(target, attr))
+        return DEADLINE_NOW;
+    return retry->count >= APPLY_RETRY_MAX_ATTEMPTS ? 0 : retry->deadline;
+}
+
+
+/**
+ * The attributes that must be set for the window to look like target,
+ * except for the ones given up on.
+ */
+static config_changed_e window_unapplied(monitor_window_t *window, const window_attrs_t *target) {
+    config_changed_e mask = window->mask;
+
+    for (size_t i = 0; i < sizeof(apply_order) / sizeof(*apply_order); i++) {
+        config_changed_e attr = apply_order[i];
+
+        if (attr_value(target, attr) != attr_value(&window->applied, attr))
+            mask |= attr;
+        if ((mask & attr) && !attr_deadline(window, target, attr))
+            mask &= ~attr;
+    }
+    return mask;
+}
+
+
+/**
+ * The attributes of the window that can be set at now.
+ */
+static config_changed_e window_due(monitor_window_t *window, const window_attrs_t *target, uint64_t now) {
+    config_changed_e mask = window_unapplied(window, target);
+
+    for (size_t i = 0; i < sizeof(apply_order) / sizeof(*apply_order); i++) {
+        if ((mask & apply_order[i]) && attr_deadline(window, target, apply_order[i]) > now)
+            mask &= ~apply_order[i];
+    }
+    return mask;
+}
+
+
+/**
+ * The time at which the next unapplied attribute should be set, 0 if there are none
+ * or another thread is setting them.
+ */
+static uint64_t apply_deadline(window_config_t *config) {
+    uint64_t deadline = 0;
+
+    if (config->applying)
+        return 0;
+    for (int i = 0; i < config->window_count; i++) {
+        monitor_window_t *window = &config->windows[i];
+        window_attrs_t target = window_target(config, window);
+        config_changed_e mask = window_unapplied(window, &target);
+
+        for (size_t j = 0; j < sizeof(apply_order) / sizeof(*apply_order); j++) {
+            if (mask & apply_order[j])
+                deadline = earliest(deadline, attr_deadline(window, &target, apply_order[j]));
+        }
+    }
+    return deadline;
+}
+
+
+/**
+ * Schedules the next attempt at setting an attribute that failed to reach its value in target.
+ * Returns 1 if it failed too many times, it is then given up on until its target changes.
+ */
+static int retry_later(monitor_window_t *window, const window_attrs_t *target, config_changed_e attr) {
+    apply_retry_t *retry = window_retry(window, attr);
+    int value = attr_value(target, attr);
+
+    // another value starts over
+    if (retry->target != value) {
+        retry->count = 0;
+        retry->delay_ms = 0;
+    }
+    retry->target = value;
+    if (++retry->count >= APPLY_RETRY_MAX_ATTEMPTS) {
+        window->mask &= ~attr;
+        return 1;
+    }
+    retry->delay_ms = !retry->delay_ms ? APPLY_RETRY_MIN_MS
+                        : retry->delay_ms * 2 > APPLY_RETRY_MAX_MS ? APPLY_RETRY_MAX_MS
+                        : retry->delay_ms * 2;
+    retry->deadline = monitor_now_ns() + (uint64_t) retry->delay_ms * 1000000ull;
+    // the window may be half way through the failed change, so it is retried even if it was undone
+    window->mask |= attr;
+    return 0;
+}
+
+
+uint64_t monitor_next_deadline(window_config_t *config) {
+    return earliest(earliest(config->event_deadline, config->stats_deadline), apply_deadline(config));
+}
+
+
+void monitor_apply_loop(window_config_t *config) {
+    monitor_lock(config);
+    while (config->running) {
+        uint64_t deadline = monitor_next_deadline(config), now = monitor_now_ns();
+
+        if (!deadline) {
+            config_wait(config, 0);
+        } else if (now < deadline) {
+            config_wait(config, deadline - now);
+        } else if (!monitor_apply_pending(config)) {
+            break;
+        }
+    }
+    monitor_unlock(config);
+}
+
+
+/**
+ * The attributes of a window to set in a pass of monitor_apply_pending.
+ */
+typedef struct apply_job_s {
+    uint64_t handle;
+    window_attrs_t attrs;
+    config_changed_e mask, failed;
+    // the last failure and its attribute, the others are only counted
+    config_changed_e last_failed;
+    monitor_error_t err;
+} apply_job_t;
+
+
+int monitor_apply_pending(window_config_t *config) {
+    apply_job_t jobs[MAX_WINDOWS];
+    int job_count = 0, failures = 0, done = 0;
+    uint64_t now = monitor_now_ns();
+
+    run_timers(config, now);
+    if (config->applying)
+        return 1;
+
+    // the client and the events keep changing config->desired while the copies are applied
+    for (int i = 0; i < config->window_count; i++) {
+        monitor_window_t *window = &config->windows[i];
+        apply_job_t *job = &jobs[job_count];
+
+        job->attrs = window_target(config, window);
+        // an attribute that looks right again is no longer failing, even if its target was given up on
+        for (size_t j = 0; j < sizeof(apply_order) / sizeof(*apply_order); j++) {
+            if (!(window->mask & apply_order[j])
+                    && attr_value(&job->attrs, apply_order[j]) == attr_value(&window->applied, apply_order[j]))
+                memset(window_retry(window, apply_order[j]), 0, sizeof(apply_retry_t));
+        }
+        // attributes backing off stay in window->mask until they are due
+        job->mask = window_due(window, &job->attrs, now);
+        if (!job->mask)
+            continue;
+        job->handle = window->handle;
+        job->failed = 0;
+        window->mask &= ~job->mask;
+        job_count++;
+    }
+    if (!job_count)
+        return 1;
+    config->applying = 1;
+    monitor_unlock(config);
+
+    for (int i = 0; i < job_count; i++) {
+        for (size_t j = 0; j < sizeof(apply_order) / sizeof(*apply_order); j++) {
+            if ((jobs[i].mask & apply_order[j])
+                    && !config->platform->apply(config->platform_ud, jobs[i].handle, &jobs[i].attrs, apply_order[j], &jobs[i].err)) {
+                jobs[i].failed |= apply_order[j];
+                jobs[i].last_failed = apply_order[j];
+            }
+        }
+    }
+
+    monitor_lock(config);
+    config->applying = 0;
+    for (int i = 0; i < job_count; i++) {
+        apply_job_t *job = &jobs[i];
+        // the window may have been destroyed in the meantime
+        monitor_window_t *window = find_window(config, job->handle);
+        config_changed_e applied = job->mask & ~job->failed, given_up = 0;
+
+        if (!window)
+            continue;
+        if (applied & CONFIG_DARK_MODE)
+            window->applied.dark_mode = job->attrs.dark_mode;
+        if (applied & CONFIG_EXTEND_BORDER)
+            window->applied.extend_border = job->attrs.extend_border;
+        if (applied & CONFIG_BACKDROP_TYPE)
+            window->applied.backdrop_type = job->attrs.backdrop_type;
+        done |= !!applied;
+
+        for (size_t j = 0; j < sizeof(apply_order) / sizeof(*apply_order); j++) {
+            if (applied & apply_order[j]) {
+                memset(window_retry(window, apply_order[j]), 0, sizeof(apply_retry_t));
+            } else if (job->failed & apply_order[j]) {
+                monitor_stats_count(&config->stats, STAT_APPLY_FAILURES);
+                failures++;
+                if (retry_later(window, &job->attrs, apply_order[j]))
+                    given_up |= apply_order[j];
+            }
+        }
+        if (job->failed & given_up & job->last_failed)
+            log_error(config, "%s, not retried until the configuration changes", job->err.message);
+        else if (job->failed)
+            log_error(config, "%s", job->err.message);
+    }
+    // the shared page holds the configuration of the first window
+    if (done && config->window_count) {
+        config->state.flags |= STATE_APPLIED;
+        config->state.extend_border = config->windows[0].applied.extend_border;
+        config->state.backdrop_type = config->windows[0].applied.backdrop_type;
+        publish_state(config);
+    }
+
+    return !failures || config->platform->is_window(config->platform_ud);
+}
+
+
+int monitor_share_state(window_config_t *config, unsigned long pid, unsigned long id, monitor_error_t *err) {
+    unsigned long color;
+    int opaque;
+
+    if (!monitor_state_create(&config->state_map, pid, id)) {
+#ifdef _WIN32
+        snprintf(err->message, sizeof(err->message), "monitor_state_create: error %lu", (unsigned long) GetLastError());
+#else
+        snprintf(err->message, sizeof(err->message), "monitor_state_create: %s", strerror(errno));
+#endif
+        return 0;
+    }
+    // the client reads the page as soon as it is ready, so it starts with everything known
+    config->state.topics = (uint32_t) monitor_counter_get(&config->topics);
+    config->state.flags |= STATE_DARK_MODE;
+    config->state.dark_mode = !!config->desired.dark_mode;
+    if (config->platform->get_accent(config->platform_ud, &color, &opaque, err))
+        publish_accent(config, color, opaque);
+    else
+        publish_state(config);
+    return 1;
+}
+
+
+void monitor_on_theme_change(window_config_t *config) {
+    int value = 0;
+    monitor_error_t err;
+
+    // followed even if the client isn't subscribed, the windows have to match the system
+    monitor_lock(config);
+    monitor_stats_count(&config->stats, STAT_THEME_EVENTS);
+    if (!config->platform->get_dark_mode(config->platform_ud, &value, &err)) {
+        log_error(config, "%s", err.message);
+        monitor_unlock(config);
+        return;
+    }
+    if (config->trace) {
+        unsigned char payload = (unsigned char) !!value;
+        monitor_trace_record(config->trace, TRACE_THEME, &payload, 1);
+    }
+    config->pending_dark_mode = value;
+    queue_event(config, EVENT_THEME);
+    monitor_unlock(config);
+}
+
+
+void monitor_on_accent_change(window_config_t *config, unsigned long color, int opaque) {
+    if (config->trace) {
+        unsigned char payload[5];
+        payload[0] = (unsigned char) !!opaque;
+        write_u32(payload + 1, (uint32_t) color);
+        monitor_trace_record(config->trace, TRACE_ACCENT, payload, sizeof(payload));
+    }
+    if (!(monitor_counter_get(&config->topics) & EVENT_ACCENT)) {
+        monitor_stats_count(&config->stats, STAT_UNSUBSCRIBED_EVENTS);
+        return;
+    }
+    // lock the mutex so we don't interrupt a response
+    monitor_lock(config);
+    monitor_stats_count(&config->stats, STAT_ACCENT_EVENTS);
+    config->pending_accent = color;
+    config->pending_opaque = opaque;
+    queue_event(config, EVENT_ACCENT);
+    monitor_unlock(config);
+}
+
+
+void monitor_on_window_created(window_config_t *config, uint64_t window) {
+    monitor_lock(config);
+    if (config->trace) {
+        unsigned char payload[8];
+        write_u64(payload, window);
+        monitor_trace_record(config->trace, TRACE_WINDOW_CREATED, payload, sizeof(payload));
+    }
+    if (find_window(config, window)) {
+        monitor_unlock(config);
+        return;
+    }
+    if (config->window_count == MAX_WINDOWS) {
+        log_error(config, "too many windows, ignoring %llu", (unsigned long long) window);
+        monitor_unlock(config);
+        return;
+    }
+    memset(&config->windows[config->window_count], 0, sizeof(*config->windows));
+    config->windows[config->window_count].handle = window;
+    // whatever the window looks like, it has to follow the theme
+    config->windows[config->window_count].mask = CONFIG_DARK_MODE;
+    config->window_count++;
+    monitor_cond_signal(&config->config_changed);
+    monitor_unlock(config);
+}
+
+
+void monitor_on_window_destroyed(window_config_t *config, uint64_t window) {
+    monitor_window_t *found;
+
+    monitor_lock(config);
+    if (config->trace) {
+        unsigned char payload[8];
+        write_u64(payload, window);
+        monitor_trace_record(config->trace, TRACE_WINDOW_DESTROYED, payload, sizeof(payload));
+    }
+    found = find_window(config, window);
+    if (found) {
+        // the order is kept, the first window is the one in the shared page
+        memmove(found, found + 1, (size_t) (config->windows + config->window_count - found - 1) * sizeof(*found));
+        config->window_count--;
+    }
+    monitor_unlock(config);
+}
+
+
+void monitor_stop(window_config_t *config) {
+    monitor_lock(config);
+    config->running = 0;
+    monitor_cond_signal(&config->config_changed);
+    monitor_unlock(config);
+}
+
+
+uint64_t monitor_now_ns(void) {
+    return clock_fn ? clock_fn(clock_ud) : monitor_clock_ns();
+}
+
+
+void monitor_set_clock(uint64_t (*clock)(void *ud), void *ud) {
+    clock_fn = clock;
+    clock_ud = ud;
+}
+
+
+uint64_t monitor_clock_ns(void) {
+#ifdef _WIN32
+    static LARGE_INTEGER frequency;
+    LARGE_INTEGER counter;
+    if (!frequency.QuadPart)
+        QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t) (counter.QuadPart / frequency.QuadPart) * 1000000000ull
+            + (uint64_t) (counter.QuadPart % frequency.QuadPart) * 1000000000ull / frequency.QuadPart;
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + (uint64_t) ts.tv_nsec;
+#endif
+}
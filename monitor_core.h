@@ -0,0 +1,441 @@
+#ifndef MONITOR_CORE_H
+#define MONITOR_CORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "monitor_color.h"
+#include "monitor_state.h"
+#include "monitor_stats.h"
+#include "monitor_sync.h"
+#include "monitor_writer.h"
+
+
+#define BUFFER_SIZE 512
+#define ERROR_MESSAGE_SIZE 256
+#define BATCH_BUFFER_SIZE 4096
+#define OUTPUT_MESSAGE_SIZE (BATCH_BUFFER_SIZE + BUFFER_SIZE)
+#define MAX_BATCH_SIZE 32
+#define MAX_DEBOUNCE_MS 10000
+#define MAX_STATS_INTERVAL_MS 3600000
+// an attribute that failed to apply is retried after APPLY_RETRY_MIN_MS, doubling up to APPLY_RETRY_MAX_MS,
+// and given up on after APPLY_RETRY_MAX_ATTEMPTS failed attempts in a row until its target changes
+#define APPLY_RETRY_MIN_MS 50
+#define APPLY_RETRY_MAX_MS 5000
+#define APPLY_RETRY_MAX_ATTEMPTS 8
+// a deadline that is already due, 0 meaning there is none
+#define DEADLINE_NOW 1
+// the longest message accepted from the client unless configured otherwise, and the bounds of the setting
+#define DEFAULT_MAX_MESSAGE_SIZE 4096
+#define MIN_MESSAGE_SIZE BUFFER_SIZE
+#define MAX_MESSAGE_SIZE 1048576
+// the most the readers ask for in a single read
+#define READ_CHUNK_SIZE 65536
+// the windows followed in the target, few enough for the windows response to fit in a batch
+#define MAX_WINDOWS 16
+
+#define CMD_CONFIG "config"
+#define CMD_THEME "theme"
+#define CMD_EXIT "exit"
+#define CMD_ACCENT "accent"
+#define CMD_BATCH "batch"
+#define CMD_DEBOUNCE "debounce"
+#define CMD_CONTRAST "contrast"
+#define CMD_STATS "stats"
+#define CMD_SUBSCRIBE "subscribe"
+#define CMD_UNSUBSCRIBE "unsubscribe"
+#define CMD_OVERRIDE "override"
+#define CMD_WINDOWS "windows"
+
+#define RESPONSE_OK "ok"
+#define RESPONSE_ERROR "error"
+
+#define BROADCAST_ACCENTCHANGE "accentchange"
+#define BROADCAST_THEMECHANGE "themechange"
+#define BROADCAST_ERROR "error"
+#define BROADCAST_READY "ready"
+#define BROADCAST_STATS "stats"
+
+
+/**
+ * In binary mode, every message is a record with a fixed little-endian header:
+ * int32 serial, uint8 type, uint8 reserved, uint16 payload length
+ * followed by the payload.
+ *
+ * Payloads:
+ * BINARY_CONFIG: uint8 extend_border, uint8 backdrop_type
+ * BINARY_BATCH: commands as uint8 type, uint8 length, payload
+ * BINARY_DEBOUNCE: uint32 milliseconds
+ * BINARY_CONTRAST: uint16 ratio * 100, uint32 RGBA backgrounds
+ * BINARY_STATS: nothing, or uint32 milliseconds between stats broadcasts
+ * BINARY_SUBSCRIBE, BINARY_UNSUBSCRIBE: uint8 topics
+ * BINARY_OVERRIDE: uint64 window, uint8 extend_border, uint8 backdrop_type, uint8 dark_mode,
+ *                  each BINARY_NO_OVERRIDE to follow the config and the theme
+ * BINARY_WINDOWS: nothing
+ * BINARY_OK: nothing, uint8 dark_mode for theme or an accent for accent and contrast,
+ *            responses as uint8 type, uint8 length, payload for batch
+ *            (a batch whose responses don't all fit gets a BINARY_ERROR instead,
+ *            like one with more than MAX_BATCH_SIZE commands or a command cut short,
+ *            which are rejected before any of its commands is executed),
+ *            uint32 dropped events for debounce, fields for stats,
+ *            uint8 topics subscribed to for subscribe and unsubscribe,
+ *            uint64 window handles for windows
+ * BINARY_ERROR: the error message, not NUL-terminated
+ * BINARY_THEMECHANGE: uint8 dark_mode
+ * BINARY_ACCENTCHANGE: an accent
+ * BINARY_READY: fields
+ * BINARY_STATS_BROADCAST: fields
+ *
+ * A record longer than config->max_message_size, header included, is answered with an error and skipped.
+ *
+ * Fields are uint8 name length, name, uint64 value.
+ *
+ * An accent is uint8 opaque, uint32 RGBA followed by
+ * an uint32 RGBA variant for every background set by BINARY_CONTRAST.
+ */
+#define BINARY_HEADER_SIZE 8
+#define BINARY_MAX_PAYLOAD (BUFFER_SIZE - BINARY_HEADER_SIZE)
+#define BINARY_NO_OVERRIDE 0xFF
+
+typedef enum {
+    BINARY_CONFIG = 0x01,
+    BINARY_THEME = 0x02,
+    BINARY_ACCENT = 0x03,
+    BINARY_EXIT = 0x04,
+    BINARY_BATCH = 0x05,
+    BINARY_DEBOUNCE = 0x06,
+    BINARY_CONTRAST = 0x07,
+    BINARY_STATS = 0x08,
+    BINARY_SUBSCRIBE = 0x09,
+    BINARY_UNSUBSCRIBE = 0x0A,
+    BINARY_OVERRIDE = 0x0B,
+    BINARY_WINDOWS = 0x0C,
+    BINARY_OK = 0x80,
+    BINARY_ERROR = 0x81,
+    BINARY_READY = 0xC0,
+    BINARY_THEMECHANGE = 0xC1,
+    BINARY_ACCENTCHANGE = 0xC2,
+    BINARY_STATS_BROADCAST = 0xC3,
+} binary_type_e;
+
+
+#define ARGB_RGBA(V) ((((V) & 0xFF000000) >> 24) | (((V) & 0x00FFFFFF) << 8))
+
+
+typedef enum {
+    BACKDROP_DEFAULT,
+    BACKDROP_NONE,
+    BACKDROP_MICA,
+    BACKDROP_ACRYLIC,
+    BACKDROP_TABBED,
+    BACKDROP_MAX,
+} window_backdrop_e;
+
+typedef enum {
+    CONFIG_DARK_MODE = 1,
+    CONFIG_EXTEND_BORDER = 2,
+    CONFIG_BACKDROP_TYPE = 4
+} config_changed_e;
+
+// the number of attributes in config_changed_e
+#define WINDOW_ATTR_COUNT 3
+
+/**
+ * Events are also the topics a client subscribes to, as a bitmask.
+ * Clients are subscribed to every topic until they unsubscribe.
+ * The theme is followed and applied to the windows either way, the topics only decide what is broadcasted.
+ */
+typedef enum {
+    EVENT_THEME = 1,
+    EVENT_ACCENT = 2,
+    EVENT_ALL = EVENT_THEME | EVENT_ACCENT
+} event_pending_e;
+
+
+/**
+ * The attributes the monitor sets on the window.
+ */
+typedef struct window_attrs_s {
+    int dark_mode, extend_border;
+    window_backdrop_e backdrop_type;
+} window_attrs_t;
+
+/**
+ * How an attribute of a window that failed to apply is retried, see monitor_apply_pending.
+ */
+typedef struct apply_retry_s {
+    // the failed attempts in a row at setting the attribute to target, 0 if the last one succeeded
+    int count, target;
+    // the next attempt isn't made before deadline, delay_ms doubles with every failure
+    uint32_t delay_ms;
+    uint64_t deadline;
+} apply_retry_t;
+
+/**
+ * A top-level window of the target, see monitor_on_window_created.
+ */
+typedef struct monitor_window_s {
+    // the platform handle, like the HWND
+    uint64_t handle;
+    // attributes set for this window only, selected by overrides
+    window_attrs_t override;
+    config_changed_e overrides;
+    // what it looks like after the last calls that succeeded
+    window_attrs_t applied;
+    // attributes to apply even if they look applied, like the dark mode of a new window
+    config_changed_e mask;
+    // the retries of every attribute, in the order of their bits in config_changed_e
+    apply_retry_t retries[WINDOW_ATTR_COUNT];
+} monitor_window_t;
+
+
+/**
+ * An error reported by the platform backend.
+ * The message should be prefixed with the name of the failing function.
+ */
+typedef struct monitor_error_s {
+    char message[ERROR_MESSAGE_SIZE];
+} monitor_error_t;
+
+
+typedef struct window_config_s window_config_t;
+typedef struct monitor_trace_s monitor_trace_t;
+
+/**
+ * The platform backend, which is responsible for everything that isn't the protocol.
+ * Every function returns 1 on success and 0 on failure, in which case err is filled.
+ * Functions are always called with config->mutex held, except for apply,
+ * which is called without it by a single thread at a time.
+ */
+typedef struct monitor_platform_s {
+    // checks if the target is still alive
+    int (*is_window)(void *ud);
+    // checks if the backdrop type is supported by the platform, err says why not
+    int (*supports_backdrop)(void *ud, window_backdrop_e type, monitor_error_t *err);
+    // queries the current system theme
+    int (*get_dark_mode)(void *ud, int *is_dark, monitor_error_t *err);
+    // queries the current accent color in ARGB
+    int (*get_accent)(void *ud, unsigned long *color, int *opaque, monitor_error_t *err);
+    // sets the single attribute selected by mask on the window with the handle window
+    int (*apply)(void *ud, uint64_t window, const window_attrs_t *attrs, config_changed_e mask, monitor_error_t *err);
+} monitor_platform_t;
+
+
+struct window_config_s {
+    int running, binary;
+    // longer text messages are rejected, see monitor_handle_input
+    size_t max_message_size;
+    // set while the rest of a rejected line is skipped
+    int skip_line;
+    // the bytes of a rejected binary record left to skip
+    size_t skip_record;
+    // what the windows should look like, see monitor_apply_pending
+    window_attrs_t desired;
+    // the windows of the target, in the order they were found
+    monitor_window_t windows[MAX_WINDOWS];
+    int window_count;
+    // set while a thread applies attributes without the mutex
+    int applying;
+    // the events broadcasted to the client, read by the platform without the mutex
+    monitor_counter_t topics;
+    // events waiting for the debounce window to end
+    uint32_t debounce_ms;
+    event_pending_e pending;
+    uint64_t event_deadline;
+    int pending_dark_mode, pending_opaque;
+    unsigned long pending_accent;
+    // when the oldest pending event happened
+    uint64_t event_time;
+    // set if the theme changed while the client wasn't subscribed to it
+    int theme_unsent;
+    // the last accent broadcasted
+    int accent_sent, last_opaque;
+    unsigned long last_accent;
+    unsigned long dropped_events;
+    // backgrounds that accent variants are calculated against
+    uint32_t contrast_ratio;
+    int contrast_count;
+    uint32_t contrast_colors[MAX_CONTRAST_COLORS];
+    monitor_color_cache_t colors;
+    // stats are broadcasted every stats_interval_ms if it isn't 0
+    uint32_t stats_interval_ms;
+    uint64_t stats_deadline;
+    // published to the client if the page is mapped, see monitor_share_state
+    monitor_state_map_t state_map;
+    monitor_state_t state;
+    // records the input, the output and the platform events if set, see monitor_trace_attach
+    monitor_trace_t *trace;
+    // when the mutex was acquired, only touched by the thread holding it
+    uint64_t locked_at;
+    monitor_stats_t stats;
+    monitor_cond_t config_changed;
+    monitor_mutex_t mutex;
+    monitor_writer_t out;
+    const monitor_platform_t *platform;
+    void *platform_ud;
+};
+
+
+/**
+ * Initializes the monitor, which writes every message to out_fd.
+ */
+void monitor_init(window_config_t *config, const monitor_platform_t *platform, void *ud, int out_fd);
+void monitor_destroy(window_config_t *config);
+
+/**
+ * Locks config->mutex, recording the time spent waiting for it and holding it in config->stats.
+ * The messages written while it is held are written at once by monitor_unlock, after unlocking it.
+ */
+void monitor_lock(window_config_t *config);
+void monitor_unlock(window_config_t *config);
+
+void log_response(window_config_t *config, const char *serial, const char *type, const char *fmt, ...);
+
+#define log_broadcast(config, type, fmt, ...) (log_response((config), "-1", type, fmt, __VA_ARGS__))
+
+/**
+ * Broadcasts an error in the protocol selected by config->binary.
+ */
+void log_error(window_config_t *config, const char *fmt, ...);
+
+/**
+ * Broadcasts that the monitor is ready to receive commands, along with count fields.
+ */
+void monitor_broadcast_ready(window_config_t *config, const monitor_field_t *fields, size_t count);
+
+int parse_message(char *msg, char **serial, char **type, char **content);
+
+/**
+ * Writes a binary record as a single write.
+ */
+void log_record(window_config_t *config, int32_t serial, binary_type_e type, const void *payload, size_t len);
+
+/**
+ * Handles a single message (without the trailing newline).
+ * config->mutex must be held.
+ * Returns 0 if the monitor should stop processing input.
+ */
+int monitor_handle_message(window_config_t *config, char *msg);
+
+/**
+ * Handles a single binary record.
+ * config->mutex must be held.
+ * Returns 0 if the monitor should stop processing input.
+ */
+int monitor_handle_record(window_config_t *config, int32_t serial, binary_type_e type, const unsigned char *payload, size_t len);
+
+/**
+ * Handles every complete message at the start of buffer, which holds len bytes read from the client,
+ * as lines or as binary records if config->binary is set.
+ * config->mutex is taken once for all of them, so a burst of messages costs a single lock
+ * and its responses a single write.
+ *
+ * A line that doesn't fit in config->max_message_size with its newline gets an error,
+ * with its serial if it has one, and is skipped up to the next newline, even if it ends in a later call.
+ * So does a binary record longer than config->max_message_size with its header, up to its end.
+ * The rest is never longer than config->max_message_size, so a buffer of
+ * config->max_message_size + READ_CHUNK_SIZE bytes always has room for another read.
+ *
+ * Returns the number of bytes handled or skipped, the rest is an incomplete message.
+ * *keep_going is set to 0 if the monitor should stop processing input.
+ */
+size_t monitor_handle_input(window_config_t *config, char *buffer, size_t len, int *keep_going);
+
+/**
+ * Reads and handles messages from in_fd, a chunk at a time,
+ * until EOF, an exit command or the window is gone.
+ * Messages are read as binary records if config->binary is set.
+ */
+void monitor_read_loop(window_config_t *config, int in_fd);
+
+/**
+ * Applies configuration changes to the window until the monitor is stopped.
+ */
+void monitor_apply_loop(window_config_t *config);
+
+/**
+ * Applies configuration changes and broadcasts events whose debounce window ended, without waiting.
+ * This is what the apply loop does every time it wakes up, for callers that have their own loop.
+ *
+ * Every window gets config->desired with its overrides on top, compared with what it was applied,
+ * and only the attributes that differ are set. Windows that already look right are skipped,
+ * and the others are set in a single pass, with config->mutex released so the platform calls
+ * don't hold up the client or the events.
+ * A failed attribute is reported and retried after a delay that grows with every failure,
+ * up to APPLY_RETRY_MAX_ATTEMPTS times, then left alone until its target changes.
+ * Every attribute of every window backs off on its own, the others are applied right away.
+ * Changes made in the meantime are applied by the next call.
+ *
+ * config->mutex must be held, and is held again when this returns.
+ * Returns 0 if an attribute failed and the target is gone.
+ */
+int monitor_apply_pending(window_config_t *config);
+
+/**
+ * The time at which monitor_apply_pending has something to do even if nothing changes,
+ * like a debounce window ending. 0 if there is none, DEADLINE_NOW if it is already due.
+ * config->mutex must be held.
+ */
+uint64_t monitor_next_deadline(window_config_t *config);
+
+/**
+ * Publishes the theme, the accent and the applied configuration in a shared page
+ * named after pid and id (see monitor_state.h), which is kept up to date from then on.
+ * The ready broadcast should tell the client about it with the state_pid and state_id fields.
+ * config->mutex must be held.
+ * Returns 0 and fills err if the page can't be created, the monitor works without it.
+ */
+int monitor_share_state(window_config_t *config, unsigned long pid, unsigned long id, monitor_error_t *err);
+
+/**
+ * Called by the platform when the system theme might have changed.
+ * The theme is queried again and applied to the windows if it is different,
+ * after the debounce window if there is one.
+ * It is broadcasted too if the client is subscribed to it, or once it subscribes again.
+ */
+void monitor_on_theme_change(window_config_t *config);
+
+/**
+ * Called by the platform when the accent color changed.
+ * The accent is broadcasted if it is different from the last one,
+ * after the debounce window if there is one, and if the client is subscribed to it.
+ */
+void monitor_on_accent_change(window_config_t *config, unsigned long color, int opaque);
+
+/**
+ * Called by the platform when it finds a top-level window of the target, at startup or when it is created.
+ * The window gets the configuration and the theme with the next apply.
+ * Windows beyond MAX_WINDOWS are reported and left alone, known windows are ignored.
+ */
+void monitor_on_window_created(window_config_t *config, uint64_t window);
+
+/**
+ * Called by the platform when a window of the target is destroyed, along with its overrides.
+ * Unknown windows are ignored.
+ */
+void monitor_on_window_destroyed(window_config_t *config, uint64_t window);
+
+/**
+ * Stops the apply loop and marks the window as gone.
+ */
+void monitor_stop(window_config_t *config);
+
+/**
+ * A monotonic timestamp in nanoseconds, from the clock set with monitor_set_clock if there is one.
+ */
+uint64_t monitor_now_ns(void);
+
+/**
+ * A monotonic timestamp in nanoseconds from the system, whatever monitor_now_ns returns.
+ */
+uint64_t monitor_clock_ns(void);
+
+/**
+ * Makes monitor_now_ns return clock(ud) instead of the system time, NULL restores it.
+ * This is meant for replaying a trace faster than it was recorded, and isn't thread-safe.
+ */
+void monitor_set_clock(uint64_t (*clock)(void *ud), void *ud);
+
+
+#endif
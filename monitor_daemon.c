@@ -0,0 +1,584 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "monitor_daemon.h"
+
+
+#define MAX_EVENTS 16
+#define MAX_CLASS_SIZE 512
+// room for the hello line, the buffer of the client grows once it tells its message size
+#define HELLO_BUFFER_SIZE (MAX_CLASS_SIZE + 64)
+// the relay copies whatever it reads, a message may take several reads
+#define RELAY_BUFFER_SIZE 4096
+
+
+struct monitor_client_s {
+    int fd;
+    // names the state page of the client along with the pid of the daemon
+    unsigned long id;
+    // set once the hello is handled, before that the client gets no broadcasts
+    int attached;
+    // room for the longest message of the client and a bit more, see monitor_handle_input
+    char *buffer;
+    size_t len, size;
+    window_config_t config;
+};
+
+
+static int daemon_error(monitor_error_t *err, const char *function_name) {
+    int saved = errno;
+    snprintf(err->message, sizeof(err->message), "%s: %s", function_name, strerror(saved));
+    errno = saved;
+    return 0;
+}
+
+
+static int set_flags(int fd, int flags) {
+    int current = fcntl(fd, F_GETFL);
+    return current >= 0 && fcntl(fd, F_SETFL, current | flags) == 0
+            && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+
+static int write_all(int fd, const char *data, size_t len) {
+    while (len) {
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return 0;
+        data += written;
+        len -= (size_t) written;
+    }
+    return 1;
+}
+
+
+/**
+ * Connects to the socket at path, returns the file descriptor or -1 with errno set.
+ */
+static int connect_socket(const char *path) {
+    struct sockaddr_un addr = { 0 };
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0) {
+        int saved = errno;
+        close(fd);
+        errno = saved;
+        return -1;
+    }
+    return fd;
+}
+
+
+static void daemon_wake(monitor_daemon_t *daemon) {
+    ssize_t rc;
+    do {
+        rc = write(daemon->wake_fd[1], "", 1);
+        // a full pipe is fine, the loop will wake up anyway
+    } while (rc < 0 && errno == EINTR);
+}
+
+
+int monitor_daemon_init(monitor_daemon_t *daemon, const char *path, const monitor_daemon_backend_t *backend, monitor_error_t *err) {
+    struct sockaddr_un addr = { 0 };
+    struct epoll_event ev = { 0 };
+    struct flock lock = { 0 };
+    char lock_path[MAX_DAEMON_PATH + sizeof(DAEMON_LOCK_SUFFIX)];
+    int fd;
+
+    memset(daemon, 0, sizeof(*daemon));
+    daemon->listen_fd = daemon->epoll_fd = daemon->wake_fd[0] = daemon->wake_fd[1] = daemon->lock_fd = -1;
+    daemon->backend = *backend;
+    monitor_mutex_init(&daemon->mutex);
+
+    // a client that goes away while we write to it must not take the daemon down
+    signal(SIGPIPE, SIG_IGN);
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return daemon_error(err, "monitor_daemon_init");
+    }
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    // daemons started by several clients at once would replace each other's socket,
+    // so the one holding the lock owns the path until it exits
+    snprintf(lock_path, sizeof(lock_path), "%s" DAEMON_LOCK_SUFFIX, path);
+    daemon->lock_fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (daemon->lock_fd < 0)
+        return daemon_error(err, "open");
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    if (fcntl(daemon->lock_fd, F_SETLK, &lock) != 0) {
+        if (errno == EACCES || errno == EAGAIN)
+            errno = EADDRINUSE;
+        return daemon_error(err, "monitor_daemon_init");
+    }
+
+    // only replace the socket if nobody is listening on it
+    fd = connect_socket(path);
+    if (fd >= 0) {
+        close(fd);
+        errno = EADDRINUSE;
+        return daemon_error(err, "monitor_daemon_init");
+    }
+    if (unlink(path) != 0 && errno != ENOENT)
+        return daemon_error(err, "unlink");
+
+    daemon->listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (daemon->listen_fd < 0)
+        return daemon_error(err, "socket");
+    if (!set_flags(daemon->listen_fd, O_NONBLOCK))
+        return daemon_error(err, "fcntl");
+    if (bind(daemon->listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0)
+        return daemon_error(err, "bind");
+    if (listen(daemon->listen_fd, SOMAXCONN) != 0)
+        return daemon_error(err, "listen");
+
+    if (pipe(daemon->wake_fd) != 0)
+        return daemon_error(err, "pipe");
+    if (!set_flags(daemon->wake_fd[0], O_NONBLOCK) || !set_flags(daemon->wake_fd[1], O_NONBLOCK))
+        return daemon_error(err, "fcntl");
+
+    daemon->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (daemon->epoll_fd < 0)
+        return daemon_error(err, "epoll_create1");
+    ev.events = EPOLLIN;
+    ev.data.ptr = &daemon->listen_fd;
+    if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->listen_fd, &ev) != 0)
+        return daemon_error(err, "epoll_ctl");
+    ev.data.ptr = &daemon->wake_fd[0];
+    if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, daemon->wake_fd[0], &ev) != 0)
+        return daemon_error(err, "epoll_ctl");
+
+    snprintf(daemon->path, sizeof(daemon->path), "%s", path);
+    daemon->running = 1;
+    return 1;
+}
+
+
+static void remove_client(monitor_daemon_t *daemon, monitor_client_t *client) {
+    monitor_mutex_lock(&daemon->mutex);
+    for (int i = 0; i < daemon->client_count; i++) {
+        if (daemon->clients[i] == client) {
+            daemon->clients[i] = daemon->clients[--daemon->client_count];
+            break;
+        }
+    }
+    monitor_mutex_unlock(&daemon->mutex);
+
+    epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, client->fd, NULL);
+    close(client->fd);
+    if (client->config.platform_ud)
+        daemon->backend.detach(daemon->backend.ud, client->config.platform_ud);
+    monitor_destroy(&client->config);
+    free(client->buffer);
+    free(client);
+}
+
+
+void monitor_daemon_destroy(monitor_daemon_t *daemon) {
+    while (daemon->client_count)
+        remove_client(daemon, daemon->clients[0]);
+    if (daemon->listen_fd >= 0) {
+        close(daemon->listen_fd);
+        unlink(daemon->path);
+    }
+    if (daemon->epoll_fd >= 0)
+        close(daemon->epoll_fd);
+    for (int i = 0; i < 2; i++) {
+        if (daemon->wake_fd[i] >= 0)
+            close(daemon->wake_fd[i]);
+    }
+    // the lock file is left for the next daemon, removing it could let two of them in
+    if (daemon->lock_fd >= 0)
+        close(daemon->lock_fd);
+    monitor_mutex_destroy(&daemon->mutex);
+}
+
+
+static void accept_clients(monitor_daemon_t *daemon) {
+    for (;;) {
+        struct epoll_event ev = { 0 };
+        monitor_client_t *client;
+        int fd = accept(daemon->listen_fd, NULL, NULL);
+
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            // EAGAIN when there is nobody left, anything else is the problem of the client
+            return;
+        }
+        // writes happen with daemon->mutex held, they must never wait for a slow client
+        if (!set_flags(fd, O_NONBLOCK)) {
+            close(fd);
+            continue;
+        }
+
+        monitor_mutex_lock(&daemon->mutex);
+        if (daemon->client_count == MAX_DAEMON_CLIENTS || !(client = calloc(1, sizeof(*client)))) {
+            monitor_mutex_unlock(&daemon->mutex);
+            close(fd);
+            continue;
+        }
+        client->size = HELLO_BUFFER_SIZE;
+        client->buffer = malloc(client->size);
+        if (!client->buffer) {
+            monitor_mutex_unlock(&daemon->mutex);
+            free(client);
+            close(fd);
+            continue;
+        }
+        client->fd = fd;
+        monitor_init(&client->config, daemon->backend.platform, NULL, fd);
+        daemon->clients[daemon->client_count++] = client;
+        client->id = ++daemon->accepted;
+        monitor_mutex_unlock(&daemon->mutex);
+
+        ev.events = EPOLLIN;
+        ev.data.ptr = client;
+        if (epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, fd, &ev) != 0)
+            remove_client(daemon, client);
+    }
+}
+
+
+/**
+ * Finds the window of the client and sends the ready broadcast.
+ * Returns 0 if the client should be dropped.
+ */
+static int client_hello(monitor_daemon_t *daemon, monitor_client_t *client, const char *msg) {
+    char class_name[MAX_CLASS_SIZE];
+    unsigned long pid, max_message_size = DEFAULT_MAX_MESSAGE_SIZE;
+    int binary, dark_mode;
+    monitor_error_t err;
+    monitor_field_t fields[3];
+    size_t field_count = 0;
+    window_config_t *config = &client->config;
+    uint64_t start = monitor_now_ns();
+
+    // %511s keeps the class name within MAX_CLASS_SIZE, the message size is optional
+    if (sscanf(msg, CMD_HELLO " %lu %511s %d %lu", &pid, class_name, &binary, &max_message_size) < 3
+            || max_message_size < MIN_MESSAGE_SIZE || max_message_size > MAX_MESSAGE_SIZE) {
+        log_error(config, "invalid hello: \"%s\"", msg);
+        return 0;
+    }
+    config->binary = !!binary;
+    config->max_message_size = max_message_size;
+
+    config->platform_ud = daemon->backend.attach(daemon->backend.ud, pid, class_name, &err);
+    if (!config->platform_ud) {
+        log_error(config, "%s", err.message);
+        return 0;
+    }
+
+    // the backends follow processes, not windows
+    monitor_on_window_created(config, (uint64_t) pid);
+
+    // the client gets every broadcast sent after the ready broadcast
+    monitor_mutex_lock(&daemon->mutex);
+    monitor_lock(config);
+    if (!config->platform->get_dark_mode(config->platform_ud, &dark_mode, &err)) {
+        log_error(config, "%s", err.message);
+        monitor_unlock(config);
+        monitor_mutex_unlock(&daemon->mutex);
+        return 0;
+    }
+    config->desired.dark_mode = dark_mode;
+    client->attached = 1;
+    if (!monitor_share_state(config, (unsigned long) getpid(), client->id, &err)) {
+        // the client asks over the socket instead
+        log_error(config, "%s", err.message);
+    } else {
+        fields[field_count].name = "state_pid";
+        fields[field_count++].value = (uint64_t) getpid();
+        fields[field_count].name = "state_id";
+        fields[field_count++].value = client->id;
+    }
+    fields[field_count].name = "attach";
+    fields[field_count++].value = (monitor_now_ns() - start) / 1000;
+    monitor_broadcast_ready(config, fields, field_count);
+    monitor_unlock(config);
+    monitor_mutex_unlock(&daemon->mutex);
+    return 1;
+}
+
+
+/**
+ * Handles every complete message in the buffer of the client.
+ * Returns 0 if the client should be dropped.
+ */
+static int client_parse(monitor_daemon_t *daemon, monitor_client_t *client) {
+    window_config_t *config = &client->config;
+    size_t pos;
+    int keep_going;
+
+    if (!client->attached) {
+        char *end = memchr(client->buffer, '\n', client->len), *buffer;
+        if (!end)
+            return client->len < client->size;
+        *end = '\0';
+        if (!client_hello(daemon, client, client->buffer))
+            return 0;
+        pos = (size_t) (end - client->buffer) + 1;
+
+        // the messages of the client may be as long as it said
+        buffer = malloc(config->max_message_size + BUFFER_SIZE);
+        if (!buffer)
+            return 0;
+        memcpy(buffer, client->buffer + pos, client->len - pos);
+        free(client->buffer);
+        client->buffer = buffer;
+        client->size = config->max_message_size + BUFFER_SIZE;
+        client->len -= pos;
+    }
+    // the rest is never longer than config->max_message_size, so there is always room for more
+    pos = monitor_handle_input(config, client->buffer, client->len, &keep_going);
+    memmove(client->buffer, client->buffer + pos, client->len - pos);
+    client->len -= pos;
+    return keep_going;
+}
+
+
+/**
+ * Reads whatever the client sent.
+ * Returns 0 if the client should be dropped.
+ */
+static int client_read(monitor_daemon_t *daemon, monitor_client_t *client) {
+    ssize_t n = recv(client->fd, client->buffer + client->len, client->size - client->len, MSG_DONTWAIT);
+
+    if (n == 0)
+        return 0;
+    if (n < 0)
+        return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+    client->len += (size_t) n;
+    return client_parse(daemon, client);
+}
+
+
+/**
+ * Applies pending changes of every client and drops the ones that are gone.
+ * Returns the time until the next debounce deadline in milliseconds, -1 if there is none,
+ * or -2 if the daemon should stop.
+ */
+static int service_clients(monitor_daemon_t *daemon) {
+    monitor_client_t *gone[MAX_DAEMON_CLIENTS];
+    int gone_count = 0, running;
+    uint64_t deadline = 0, now;
+
+    monitor_mutex_lock(&daemon->mutex);
+    for (int i = 0; i < daemon->client_count; i++) {
+        monitor_client_t *client = daemon->clients[i];
+        window_config_t *config = &client->config;
+
+        if (!client->attached)
+            continue;
+        monitor_lock(config);
+        // the writer fails once the socket is full, the client is too slow or gone
+        if (monitor_writer_failed(&config->out)
+            || !config->platform->is_window(config->platform_ud)
+            || !monitor_apply_pending(config)) {
+            gone[gone_count++] = client;
+        } else {
+            uint64_t next = monitor_next_deadline(config);
+            if (next && (!deadline || next < deadline))
+                deadline = next;
+        }
+        monitor_unlock(config);
+    }
+    monitor_mutex_unlock(&daemon->mutex);
+
+    for (int i = 0; i < gone_count; i++)
+        remove_client(daemon, gone[i]);
+
+    monitor_mutex_lock(&daemon->mutex);
+    running = daemon->running && !(daemon->exit_when_idle && daemon->accepted && !daemon->client_count);
+    monitor_mutex_unlock(&daemon->mutex);
+
+    if (!running)
+        return -2;
+    if (!deadline)
+        return -1;
+    now = monitor_now_ns();
+    return deadline <= now ? 0 : (int) ((deadline - now + 999999) / 1000000);
+}
+
+
+void monitor_daemon_run(monitor_daemon_t *daemon) {
+    struct epoll_event events[MAX_EVENTS];
+
+    for (;;) {
+        int timeout = service_clients(daemon), count;
+
+        if (timeout == -2)
+            break;
+        count = epoll_wait(daemon->epoll_fd, events, MAX_EVENTS, timeout);
+        if (count < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &daemon->listen_fd) {
+                accept_clients(daemon);
+            } else if (events[i].data.ptr == &daemon->wake_fd[0]) {
+                char buffer[64];
+                while (read(daemon->wake_fd[0], buffer, sizeof(buffer)) > 0);
+            } else {
+                monitor_client_t *client = events[i].data.ptr;
+                if (!client_read(daemon, client))
+                    remove_client(daemon, client);
+            }
+        }
+    }
+}
+
+
+void monitor_daemon_stop(monitor_daemon_t *daemon) {
+    monitor_mutex_lock(&daemon->mutex);
+    daemon->running = 0;
+    monitor_mutex_unlock(&daemon->mutex);
+    daemon_wake(daemon);
+}
+
+
+void monitor_daemon_on_theme_change(monitor_daemon_t *daemon) {
+    monitor_mutex_lock(&daemon->mutex);
+    for (int i = 0; i < daemon->client_count; i++) {
+        if (daemon->clients[i]->attached)
+            monitor_on_theme_change(&daemon->clients[i]->config);
+    }
+    monitor_mutex_unlock(&daemon->mutex);
+    // the theme has to be applied and debounced events flushed by the loop
+    daemon_wake(daemon);
+}
+
+
+void monitor_daemon_on_accent_change(monitor_daemon_t *daemon, unsigned long color, int opaque) {
+    monitor_mutex_lock(&daemon->mutex);
+    for (int i = 0; i < daemon->client_count; i++) {
+        if (daemon->clients[i]->attached)
+            monitor_on_accent_change(&daemon->clients[i]->config, color, opaque);
+    }
+    monitor_mutex_unlock(&daemon->mutex);
+    daemon_wake(daemon);
+}
+
+
+/**
+ * Starts a detached daemon listening on path.
+ */
+static int spawn_daemon(const char *exe, const char *path, monitor_error_t *err) {
+    pid_t pid = fork();
+
+    if (pid < 0)
+        return daemon_error(err, "fork");
+    if (pid == 0) {
+        // fork again so the daemon isn't a child of the client
+        int null_fd;
+        setsid();
+        if (fork() != 0)
+            _exit(0);
+        null_fd = open("/dev/null", O_RDWR);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDIN_FILENO);
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execl(exe, exe, "--daemon", path, (char *) NULL);
+        _exit(127);
+    }
+    while (waitpid(pid, NULL, 0) < 0 && errno == EINTR);
+    return 1;
+}
+
+
+int monitor_attach(const char *path, const char *exe, unsigned long pid, const char *class_name, int binary,
+                    size_t max_message_size, int in_fd, int out_fd, monitor_error_t *err) {
+    struct pollfd fds[2];
+    char buffer[RELAY_BUFFER_SIZE];
+    int fd, len;
+
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = connect_socket(path);
+    if (fd < 0 && (errno == ENOENT || errno == ECONNREFUSED)) {
+        struct timespec delay = { 0, 10 * 1000000L };
+        if (!spawn_daemon(exe, path, err))
+            return 0;
+        // wait for the daemon to listen
+        for (int waited = 0; fd < 0 && waited < ATTACH_TIMEOUT_MS; waited += 10) {
+            nanosleep(&delay, NULL);
+            fd = connect_socket(path);
+        }
+    }
+    if (fd < 0)
+        return daemon_error(err, "connect");
+
+    len = snprintf(buffer, sizeof(buffer), CMD_HELLO " %lu %s %d %lu\n", pid, class_name, !!binary,
+                    (unsigned long) max_message_size);
+    if (len < 0 || (size_t) len >= sizeof(buffer) || !write_all(fd, buffer, (size_t) len)) {
+        close(fd);
+        errno = EMSGSIZE;
+        return daemon_error(err, "monitor_attach");
+    }
+
+    fds[0].fd = in_fd;
+    fds[0].events = POLLIN;
+    fds[1].fd = fd;
+    fds[1].events = POLLIN;
+    for (;;) {
+        ssize_t n;
+
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        if (fds[0].revents) {
+            n = read(in_fd, buffer, sizeof(buffer));
+            if (n <= 0) {
+                // let the daemon know that the client is gone, but keep relaying its responses
+                shutdown(fd, SHUT_WR);
+                fds[0].fd = -1;
+            } else if (!write_all(fd, buffer, (size_t) n)) {
+                break;
+            }
+        }
+
+        if (fds[1].revents) {
+            n = read(fd, buffer, sizeof(buffer));
+            if (n <= 0 || !write_all(out_fd, buffer, (size_t) n))
+                break;
+        }
+    }
+    close(fd);
+    return 1;
+}
@@ -0,0 +1,100 @@
+#ifndef MONITOR_DAEMON_H
+#define MONITOR_DAEMON_H
+
+#include "monitor_core.h"
+
+
+#define MAX_DAEMON_CLIENTS 64
+#define ATTACH_TIMEOUT_MS 2000
+// the size of sun_path on Linux
+#define MAX_DAEMON_PATH 108
+// appended to the path of the socket for the lock held by the daemon
+#define DAEMON_LOCK_SUFFIX ".lock"
+
+#define CMD_HELLO "hello"
+
+
+/**
+ * A daemon serves every editor instance from a single process over a Unix domain socket.
+ * It is only built on Linux, as it waits on its clients with epoll; there is no named-pipe
+ * transport, so the Windows monitor serves a single editor instance.
+ *
+ * A client connects and sends a single line before anything else:
+ * "hello " pid " " class " " binary (" " max_message_size)?
+ * where binary is 1 if the client speaks the binary protocol, and max_message_size
+ * is the longest message it may send (DEFAULT_MAX_MESSAGE_SIZE if it isn't given).
+ * The daemon finds the window and replies with a ready broadcast (or an error)
+ * in the protocol of the client, which is then served as if it had its own monitor.
+ * Theme and accent changes are broadcasted to every client.
+ *
+ * Every client is served from a single thread, and the sockets are non-blocking
+ * so a client that doesn't read its socket can't hold up everyone else:
+ * once its socket buffer is full, it is dropped.
+ */
+typedef struct monitor_daemon_backend_s {
+    const monitor_platform_t *platform;
+    // finds the window of a client, returns the userdata for the platform or NULL and fills err
+    void *(*attach)(void *ud, unsigned long pid, const char *class_name, monitor_error_t *err);
+    // releases the userdata returned by attach
+    void (*detach)(void *ud, void *platform_ud);
+    void *ud;
+} monitor_daemon_backend_t;
+
+
+typedef struct monitor_client_s monitor_client_t;
+
+typedef struct monitor_daemon_s {
+    int listen_fd, epoll_fd;
+    // locked while the daemon owns the socket
+    int lock_fd;
+    // written to when the loop needs to look at the clients again
+    int wake_fd[2];
+    int running;
+    // stop once the last client leaves
+    int exit_when_idle;
+    monitor_client_t *clients[MAX_DAEMON_CLIENTS];
+    int client_count;
+    unsigned long accepted;
+    monitor_daemon_backend_t backend;
+    char path[MAX_DAEMON_PATH];
+    // protects the client list, always locked before the mutex of a client
+    monitor_mutex_t mutex;
+} monitor_daemon_t;
+
+
+/**
+ * Listens on path. If another daemon is already listening there, or is about to,
+ * this fails with EADDRINUSE in errno. A stale socket left by a daemon that is gone is replaced.
+ * Returns 0 and fills err on failure.
+ */
+int monitor_daemon_init(monitor_daemon_t *daemon, const char *path, const monitor_daemon_backend_t *backend, monitor_error_t *err);
+void monitor_daemon_destroy(monitor_daemon_t *daemon);
+
+/**
+ * Serves clients until monitor_daemon_stop is called,
+ * or the last client left if daemon->exit_when_idle is set.
+ */
+void monitor_daemon_run(monitor_daemon_t *daemon);
+void monitor_daemon_stop(monitor_daemon_t *daemon);
+
+/**
+ * Called by the platform when the system theme might have changed.
+ * Every client queries the theme again and broadcasts it if it is different.
+ */
+void monitor_daemon_on_theme_change(monitor_daemon_t *daemon);
+
+/**
+ * Called by the platform when the accent color changed, which is broadcasted to every client.
+ */
+void monitor_daemon_on_accent_change(monitor_daemon_t *daemon, unsigned long color, int opaque);
+
+/**
+ * Connects to the daemon listening on path and relays in_fd to it and its responses to out_fd,
+ * until either side is closed. The daemon rejects messages longer than max_message_size.
+ * If no daemon is listening, exe is started with "--daemon path" and the connection is retried.
+ * Returns 0 and fills err if the daemon can't be reached.
+ */
+int monitor_attach(const char *path, const char *exe, unsigned long pid, const char *class_name, int binary,
+                    size_t max_message_size, int in_fd, int out_fd, monitor_error_t *err);
+
+#endif
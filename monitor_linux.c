@@ -0,0 +1,348 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "monitor_core.h"
+#include "monitor_daemon.h"
+#include "monitor_reactor.h"
+#include "monitor_trace.h"
+#include "platform_dbus.h"
+
+
+#define MAX_READY_FIELDS 8
+#define MAX_EXE_PATH 4096
+
+
+static void on_theme_change(void *ud) {
+    monitor_on_theme_change((window_config_t *) ud);
+}
+
+
+static void on_accent_change(void *ud, unsigned long color, int opaque) {
+    monitor_on_accent_change((window_config_t *) ud, color, opaque);
+}
+
+
+static void on_daemon_theme_change(void *ud) {
+    monitor_daemon_on_theme_change((monitor_daemon_t *) ud);
+}
+
+
+static void on_daemon_accent_change(void *ud, unsigned long color, int opaque) {
+    monitor_daemon_on_accent_change((monitor_daemon_t *) ud, color, opaque);
+}
+
+
+static void *theme_monitor_proc(void *ud) {
+    window_config_t *config = (window_config_t *) ud;
+    platform_dbus_t *dbus = ((platform_dbus_target_t *) config->platform_ud)->dbus;
+    monitor_error_t err;
+
+    if (!platform_dbus_run(dbus, &err)) {
+        monitor_lock(config);
+        log_error(config, "%s", err.message);
+        monitor_unlock(config);
+    }
+    monitor_stop(config);
+    return NULL;
+}
+
+
+static void *apply_proc(void *ud) {
+    monitor_apply_loop((window_config_t *) ud);
+    return NULL;
+}
+
+
+/**
+ * Records the time spent since the last phase, in microseconds.
+ */
+static void end_phase(monitor_field_t *fields, size_t *count, const char *name, uint64_t *phase_start) {
+    uint64_t now = monitor_now_ns();
+    if (*count < MAX_READY_FIELDS) {
+        fields[*count].name = name;
+        fields[*count].value = (now - *phase_start) / 1000;
+        (*count)++;
+    }
+    *phase_start = now;
+}
+
+
+/**
+ * Publishes the state for the client, and adds the fields that tell it where to find it.
+ */
+static void share_state(window_config_t *config, monitor_field_t *fields, size_t *count) {
+    monitor_error_t err;
+
+    monitor_lock(config);
+    if (!monitor_share_state(config, (unsigned long) getpid(), 0, &err)) {
+        // the client asks over the pipe instead
+        log_error(config, "%s", err.message);
+    } else if (*count + 2 <= MAX_READY_FIELDS) {
+        fields[*count].name = "state_pid";
+        fields[(*count)++].value = (uint64_t) getpid();
+        fields[*count].name = "state_id";
+        fields[(*count)++].value = 0;
+    }
+    monitor_unlock(config);
+}
+
+
+static void *daemon_attach(void *ud, unsigned long pid, const char *class_name, monitor_error_t *err) {
+    platform_dbus_target_t *target;
+    (void) class_name;
+
+    if (kill((pid_t) pid, 0) < 0 && errno != EPERM) {
+        snprintf(err->message, sizeof(err->message), "cannot find process %lu", pid);
+        return NULL;
+    }
+    target = malloc(sizeof(*target));
+    if (!target) {
+        snprintf(err->message, sizeof(err->message), "daemon_attach: out of memory");
+        return NULL;
+    }
+    target->dbus = (platform_dbus_t *) ud;
+    target->pid = (pid_t) pid;
+    return target;
+}
+
+
+static void daemon_detach(void *ud, void *platform_ud) {
+    (void) ud;
+    free(platform_ud);
+}
+
+
+static void *daemon_theme_monitor_proc(void *ud) {
+    monitor_daemon_t *daemon = (monitor_daemon_t *) ud;
+    monitor_error_t err;
+
+    // the clients can't be told, and keep the last theme they got
+    if (!platform_dbus_run((platform_dbus_t *) daemon->backend.ud, &err))
+        fprintf(stderr, "%s\n", err.message);
+    return NULL;
+}
+
+
+/**
+ * Serves every editor instance that attaches to path, until the last one leaves.
+ */
+static int run_daemon(const char *path) {
+    monitor_daemon_t daemon;
+    monitor_daemon_backend_t backend = { &platform_dbus, &daemon_attach, &daemon_detach, NULL };
+    platform_dbus_t dbus = { 0 };
+    monitor_error_t err;
+    pthread_t thread;
+    int rc = 1;
+
+    dbus.on_theme_change = &on_daemon_theme_change;
+    dbus.on_accent_change = &on_daemon_accent_change;
+    dbus.ud = &daemon;
+    backend.ud = &dbus;
+
+    if (!platform_dbus_init(&dbus, &err)) {
+        fprintf(stderr, "%s\n", err.message);
+        return 1;
+    }
+    if (!monitor_daemon_init(&daemon, path, &backend, &err)) {
+        // another instance won the race to start the daemon, which is fine
+        rc = errno != EADDRINUSE;
+        if (rc)
+            fprintf(stderr, "%s\n", err.message);
+        monitor_daemon_destroy(&daemon);
+        platform_dbus_destroy(&dbus);
+        return rc;
+    }
+    daemon.exit_when_idle = 1;
+
+    if (pthread_create(&thread, NULL, &daemon_theme_monitor_proc, &daemon) != 0) {
+        fprintf(stderr, "cannot create threads: %s\n", strerror(errno));
+    } else {
+        monitor_daemon_run(&daemon);
+        platform_dbus_stop(&dbus);
+        pthread_join(thread, NULL);
+        rc = 0;
+    }
+
+    monitor_daemon_destroy(&daemon);
+    platform_dbus_destroy(&dbus);
+    return rc;
+}
+
+
+int main(int argc, char **argv) {
+    window_config_t config;
+    platform_dbus_t dbus = { 0 };
+    platform_dbus_target_t target = { &dbus, 0 };
+    monitor_trace_t trace = { 0 };
+    const char *attach_path = NULL, *record_path = NULL;
+    char exe[MAX_EXE_PATH];
+    monitor_reactor_t reactor;
+    pthread_t threads[2];
+    int thread_count = 0, dbus_ready = 0, use_reactor = 0;
+    monitor_error_t err;
+    monitor_field_t fields[MAX_READY_FIELDS];
+    size_t field_count = 0;
+    uint64_t start = monitor_now_ns(), phase_start = start;
+    ssize_t len;
+
+    // a closed stdout is noticed by the writer instead
+    signal(SIGPIPE, SIG_IGN);
+
+    if (argc == 3 && strcmp(argv[1], "--daemon") == 0)
+        return run_daemon(argv[2]);
+    // a trace is replayed through the mock platform, without the portal
+    if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+        if (argc > 4 || (argc == 4 && strcmp(argv[3], "--realtime") != 0)) {
+            fprintf(stderr, "usage: %s --replay <file> [--realtime]\n", argv[0]);
+            return 2;
+        }
+        return monitor_trace_replay(argv[2], argc == 4, stdout);
+    }
+
+    dbus.on_theme_change = &on_theme_change;
+    dbus.on_accent_change = &on_accent_change;
+    dbus.ud = &config;
+    monitor_init(&config, &platform_dbus, &target, STDOUT_FILENO);
+
+    // options come after the pid and the class name
+    for (int i = 3; i < argc; i++) {
+        if (strcmp(argv[i], "--binary") == 0) {
+            config.binary = 1;
+        } else if (strcmp(argv[i], "--window") == 0 && i + 1 < argc) {
+            // there is no window handle to reuse, the process is the window
+            i++;
+        } else if (strcmp(argv[i], "--attach") == 0 && i + 1 < argc) {
+            attach_path = argv[++i];
+        } else if (strcmp(argv[i], "--reactor") == 0) {
+            use_reactor = 1;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_path = argv[++i];
+        } else if (strcmp(argv[i], "--max-message") == 0 && i + 1 < argc) {
+            unsigned long size = strtoul(argv[++i], NULL, 10);
+            if (size < MIN_MESSAGE_SIZE || size > MAX_MESSAGE_SIZE) {
+                log_error(&config, "invalid message size: %s", argv[i]);
+                goto exit;
+            }
+            config.max_message_size = size;
+        } else {
+            log_error(&config, "invalid argument: %s", argv[i]);
+            goto exit;
+        }
+    }
+
+    if (argc < 3) {
+        log_error(&config, "invalid number of arguments: %d", argc);
+        goto exit;
+    }
+    target.pid = (pid_t) strtol(argv[1], NULL, 10);
+
+    if (attach_path && record_path) {
+        log_error(&config, "cannot record a monitor attached to a daemon");
+        goto exit;
+    }
+    if (record_path && !monitor_trace_open(&trace, record_path, &err)) {
+        log_error(&config, "%s", err.message);
+        goto exit;
+    }
+
+    if (attach_path) {
+        // the daemon is started from this binary, wherever it was started from
+        len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+        if (len < 0) {
+            log_error(&config, "readlink: %s", strerror(errno));
+            goto exit;
+        }
+        exe[len] = '\0';
+        if (!monitor_attach(attach_path, exe, (unsigned long) target.pid, argv[2], config.binary,
+                            config.max_message_size, STDIN_FILENO, STDOUT_FILENO, &err))
+            log_error(&config, "%s", err.message);
+        goto exit;
+    }
+
+    if (!platform_dbus.is_window(&target)) {
+        log_error(&config, "cannot find process %ld", (long) target.pid);
+        goto exit;
+    }
+    end_phase(fields, &field_count, "find_window", &phase_start);
+
+    if (!platform_dbus_init(&dbus, &err)) {
+        log_error(&config, "%s", err.message);
+        goto exit;
+    }
+    dbus_ready = 1;
+    config.desired.dark_mode = dbus.dark_mode;
+    // the windows of the editor can't be told apart from here, the process stands for all of them
+    monitor_on_window_created(&config, (uint64_t) target.pid);
+    end_phase(fields, &field_count, "portal", &phase_start);
+    share_state(&config, fields, &field_count);
+    // from here on, the platform may send events
+    if (record_path && !monitor_trace_attach(&trace, &config, &err)) {
+        log_error(&config, "%s", err.message);
+        goto exit;
+    }
+
+    if (use_reactor) {
+        // stdin, the session bus and the timers are all waited for from this thread
+        if (!monitor_reactor_init(&reactor, &config, STDIN_FILENO, &err)) {
+            log_error(&config, "%s", err.message);
+            goto exit;
+        }
+        monitor_reactor_add(&reactor, platform_dbus_fd(&dbus), &platform_dbus_dispatch, &dbus);
+        end_phase(fields, &field_count, "reactor", &phase_start);
+
+        // signals may have been read along with the replies in platform_dbus_init
+        if (!platform_dbus_dispatch(&dbus, &err)) {
+            log_error(&config, "%s", err.message);
+            monitor_reactor_destroy(&reactor);
+            goto exit;
+        }
+
+        fields[field_count].name = "total";
+        fields[field_count].value = (monitor_now_ns() - start) / 1000;
+        field_count++;
+        monitor_broadcast_ready(&config, fields, field_count);
+
+        monitor_reactor_run(&reactor);
+        monitor_reactor_destroy(&reactor);
+        goto exit;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        if (pthread_create(&threads[i], NULL, i == 0 ? &theme_monitor_proc : &apply_proc, &config) != 0) {
+            log_error(&config, "cannot create threads: %s", strerror(errno));
+            monitor_stop(&config);
+            platform_dbus_stop(&dbus);
+            goto join;
+        }
+        thread_count++;
+    }
+    end_phase(fields, &field_count, "threads", &phase_start);
+
+    fields[field_count].name = "total";
+    fields[field_count].value = (monitor_now_ns() - start) / 1000;
+    field_count++;
+    monitor_broadcast_ready(&config, fields, field_count);
+
+    // stdin can't be interrupted, so it is read here until the editor closes it or exits
+    monitor_read_loop(&config, STDIN_FILENO);
+    monitor_stop(&config);
+    platform_dbus_stop(&dbus);
+
+join:
+    for (int i = 0; i < thread_count; i++)
+        pthread_join(threads[i], NULL);
+
+exit:
+    if (dbus_ready)
+        platform_dbus_destroy(&dbus);
+    monitor_trace_close(&trace);
+    monitor_destroy(&config);
+    return 0;
+}
@@ -0,0 +1,588 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "monitor_core.h"
+#include "platform_mock.h"
+#ifdef MONITOR_NATIVE_DBUS
+#include <unistd.h>
+#include "platform_dbus.h"
+#endif
+
+
+#define NATIVE_MONITOR_MT "monitor_native.Monitor"
+// broadcasts beyond this are dropped until poll_events is called
+#define NATIVE_MAX_QUEUE 65536
+#define MAX_NATIVE_READY_FIELDS 4
+
+
+/**
+ * The monitor core running in the editor process, as a Lua module.
+ *
+ * Commands are handled as binary records from the calling thread, which gets the response back
+ * straight away. Everything the monitor writes goes to an in-memory queue instead of a pipe;
+ * broadcasts stay there until poll_events decodes them into tables.
+ * Timers (the debounce window and the stats interval) run and the platform is read whenever
+ * poll_events is called, so it should be called every frame.
+ *
+ * Nothing runs on another thread, so the monitor can only be used from the thread that opened it.
+ * Only the Settings portal backend runs in process, so the module isn't built on Windows.
+ */
+typedef struct native_monitor_s {
+    int open, mock_backend;
+    int32_t serial;
+    // records written by the monitor and not handed to Lua yet
+    unsigned char *queue;
+    size_t len, cap;
+    unsigned long dropped;
+    platform_mock_t mock;
+#ifdef MONITOR_NATIVE_DBUS
+    platform_dbus_t dbus;
+    platform_dbus_target_t target;
+    int dbus_ready;
+#endif
+    window_config_t config;
+} native_monitor_t;
+
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+static uint64_t get_u64(const unsigned char *p) {
+    return (uint64_t) get_u32(p) | (uint64_t) get_u32(p + 4) << 32;
+}
+
+
+/**
+ * Takes the records written by the monitor. Responses are always kept,
+ * broadcasts are dropped if nobody polled for them for a while.
+ */
+static int native_sink(void *ud, const void *data, size_t len) {
+    native_monitor_t *m = (native_monitor_t *) ud;
+    const unsigned char *record = (const unsigned char *) data;
+
+    while (len >= BINARY_HEADER_SIZE) {
+        size_t size = BINARY_HEADER_SIZE + ((size_t) record[6] | (size_t) record[7] << 8);
+        int broadcast = (int32_t) get_u32(record) == -1;
+
+        if (size > len)
+            break;
+        if (m->len + size > m->cap && !(broadcast && m->len + size > NATIVE_MAX_QUEUE)) {
+            size_t cap = m->cap ? m->cap : BUFFER_SIZE;
+            unsigned char *queue;
+            while (cap < m->len + size)
+                cap *= 2;
+            queue = (unsigned char *) realloc(m->queue, cap);
+            if (queue) {
+                m->queue = queue;
+                m->cap = cap;
+            }
+        }
+        if (m->len + size <= m->cap && !(broadcast && m->len + size > NATIVE_MAX_QUEUE)) {
+            memcpy(m->queue + m->len, record, size);
+            m->len += size;
+        } else {
+            m->dropped++;
+        }
+        record += size;
+        len -= size;
+    }
+    return 1;
+}
+
+
+#ifdef MONITOR_NATIVE_DBUS
+
+static void on_theme_change(void *ud) {
+    monitor_on_theme_change((window_config_t *) ud);
+}
+
+
+static void on_accent_change(void *ud, unsigned long color, int opaque) {
+    monitor_on_accent_change((window_config_t *) ud, color, opaque);
+}
+
+#endif
+
+
+static void native_close(native_monitor_t *m) {
+    if (!m->open)
+        return;
+    monitor_stop(&m->config);
+#ifdef MONITOR_NATIVE_DBUS
+    if (m->dbus_ready)
+        platform_dbus_destroy(&m->dbus);
+    m->dbus_ready = 0;
+#endif
+    monitor_destroy(&m->config);
+    if (m->mock_backend)
+        platform_mock_destroy(&m->mock);
+    free(m->queue);
+    m->queue = NULL;
+    m->len = m->cap = 0;
+    m->open = 0;
+}
+
+
+static native_monitor_t *check_monitor(lua_State *L) {
+    native_monitor_t *m = (native_monitor_t *) luaL_checkudata(L, 1, NATIVE_MONITOR_MT);
+    if (!m->open)
+        luaL_error(L, "the monitor is closed");
+    return m;
+}
+
+
+/**
+ * Handles a command and takes its response out of the queue.
+ * Returns 0 and pushes nil and an error if there is no response.
+ */
+static int native_request(lua_State *L, native_monitor_t *m, binary_type_e type, const unsigned char *payload, size_t len,
+                          binary_type_e *response, const unsigned char **content, size_t *content_len) {
+    window_config_t *config = &m->config;
+    int32_t serial = m->serial;
+    size_t pos = 0;
+    int keep_going;
+
+    m->serial = serial == INT32_MAX ? 0 : serial + 1;
+    monitor_lock(config);
+    keep_going = config->running && monitor_handle_record(config, serial, type, payload, len)
+                    && monitor_apply_pending(config);
+    monitor_unlock(config);
+    if (!keep_going)
+        monitor_stop(config);
+
+    while (pos + BINARY_HEADER_SIZE <= m->len) {
+        size_t size = BINARY_HEADER_SIZE + ((size_t) m->queue[pos + 6] | (size_t) m->queue[pos + 7] << 8);
+        if ((int32_t) get_u32(m->queue + pos) == serial) {
+            *response = (binary_type_e) m->queue[pos + 4];
+            // the content is only valid until the next request, and is copied right away
+            lua_pushlstring(L, (const char *) m->queue + pos + BINARY_HEADER_SIZE, size - BINARY_HEADER_SIZE);
+            *content = (const unsigned char *) lua_tolstring(L, -1, content_len);
+            memmove(m->queue + pos, m->queue + pos + size, m->len - pos - size);
+            m->len -= size;
+            if (*response == BINARY_OK)
+                return 1;
+            lua_pushnil(L);
+            lua_insert(L, -2);
+            return 0;
+        }
+        pos += size;
+    }
+    lua_pushnil(L);
+    lua_pushstring(L, config->running ? "no response from the monitor" : "the monitor stopped");
+    return 0;
+}
+
+
+static void push_accent(lua_State *L, const unsigned char *content, size_t len) {
+    lua_pushinteger(L, len >= 5 ? get_u32(content + 1) : 0);
+    lua_pushboolean(L, len >= 1 && content[0]);
+    lua_createtable(L, len > 5 ? (int) ((len - 5) / 4) : 0, 0);
+    for (size_t pos = 5, i = 1; pos + 4 <= len; pos += 4, i++) {
+        lua_pushinteger(L, get_u32(content + pos));
+        lua_rawseti(L, -2, (lua_Integer) i);
+    }
+}
+
+
+static void push_fields(lua_State *L, const unsigned char *content, size_t len) {
+    size_t pos = 0;
+
+    lua_newtable(L);
+    while (pos < len && pos + 1 + content[pos] + 8 <= len) {
+        size_t name_len = content[pos];
+        lua_pushlstring(L, (const char *) content + pos + 1, name_len);
+        lua_pushinteger(L, (lua_Integer) get_u64(content + pos + 1 + name_len));
+        lua_settable(L, -3);
+        pos += 1 + name_len + 8;
+    }
+}
+
+
+/**
+ * monitor_native.open([options]) -> Monitor | nil, error
+ * options.mock selects the mock backend, whose theme and accent are set with mock_theme and mock_accent.
+ * It starts with a single window, 1, and more are opened and closed with mock_window.
+ * The ready broadcast is the first event.
+ */
+static int l_open(lua_State *L) {
+    native_monitor_t *m;
+    monitor_error_t err;
+    monitor_field_t fields[MAX_NATIVE_READY_FIELDS];
+    size_t field_count = 0;
+    uint64_t start = monitor_now_ns();
+    int mock_backend = 0, is_dark = 0;
+
+    if (!lua_isnoneornil(L, 1)) {
+        luaL_checktype(L, 1, LUA_TTABLE);
+        lua_getfield(L, 1, "mock");
+        mock_backend = lua_toboolean(L, -1);
+        lua_pop(L, 1);
+    }
+
+    m = (native_monitor_t *) lua_newuserdatauv(L, sizeof(*m), 0);
+    memset(m, 0, sizeof(*m));
+    luaL_setmetatable(L, NATIVE_MONITOR_MT);
+    m->mock_backend = mock_backend;
+
+    if (mock_backend) {
+        platform_mock_init(&m->mock);
+        monitor_init(&m->config, &platform_mock, &m->mock, -1);
+    } else {
+#ifdef MONITOR_NATIVE_DBUS
+        m->target.dbus = &m->dbus;
+        m->target.pid = getpid();
+        m->dbus.on_theme_change = &on_theme_change;
+        m->dbus.on_accent_change = &on_accent_change;
+        m->dbus.ud = &m->config;
+        monitor_init(&m->config, &platform_dbus, &m->target, -1);
+#else
+        lua_pushnil(L);
+        lua_pushstring(L, "the module was built without a platform backend");
+        return 2;
+#endif
+    }
+    m->config.binary = 1;
+    monitor_writer_set_sink(&m->config.out, &native_sink, m);
+    m->open = 1;
+
+#ifdef MONITOR_NATIVE_DBUS
+    if (!mock_backend) {
+        if (!platform_dbus_init(&m->dbus, &err)) {
+            native_close(m);
+            lua_pushnil(L);
+            lua_pushstring(L, err.message);
+            return 2;
+        }
+        m->dbus_ready = 1;
+        fields[field_count].name = "portal";
+        fields[field_count++].value = (monitor_now_ns() - start) / 1000;
+    }
+#endif
+
+    if (mock_backend)
+        platform_mock_add_window(&m->mock, &m->config, 1);
+#ifdef MONITOR_NATIVE_DBUS
+    // the backend follows the process, not its windows
+    else
+        monitor_on_window_created(&m->config, (uint64_t) m->target.pid);
+#endif
+
+    monitor_lock(&m->config);
+    if (!m->config.platform->get_dark_mode(m->config.platform_ud, &is_dark, &err)) {
+        monitor_unlock(&m->config);
+        native_close(m);
+        lua_pushnil(L);
+        lua_pushstring(L, err.message);
+        return 2;
+    }
+    m->config.desired.dark_mode = is_dark;
+    fields[field_count].name = "total";
+    fields[field_count++].value = (monitor_now_ns() - start) / 1000;
+    monitor_broadcast_ready(&m->config, fields, field_count);
+    monitor_unlock(&m->config);
+    return 1;
+}
+
+
+/**
+ * Monitor:configure(extend_border, backdrop_type) -> true | nil, error
+ */
+static int l_configure(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    unsigned char payload[2];
+    const unsigned char *content;
+    size_t len;
+    binary_type_e response;
+
+    payload[0] = (unsigned char) lua_toboolean(L, 2);
+    payload[1] = (unsigned char) luaL_checkinteger(L, 3);
+    if (!native_request(L, m, BINARY_CONFIG, payload, sizeof(payload), &response, &content, &len))
+        return 2;
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Monitor:theme() -> true if dark | nil, error
+ */
+static int l_theme(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    const unsigned char *content;
+    size_t len;
+    binary_type_e response;
+
+    if (!native_request(L, m, BINARY_THEME, NULL, 0, &response, &content, &len))
+        return 2;
+    lua_pushboolean(L, len >= 1 && content[0]);
+    return 1;
+}
+
+
+/**
+ * Monitor:accent() -> RGBA, opaque, variants | nil, error
+ */
+static int l_accent(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    const unsigned char *content;
+    size_t len;
+    binary_type_e response;
+
+    if (!native_request(L, m, BINARY_ACCENT, NULL, 0, &response, &content, &len))
+        return 2;
+    push_accent(L, content, len);
+    return 3;
+}
+
+
+/**
+ * Monitor:request(type, payload) -> content | nil, error
+ * Handles any command as a binary record, see monitor_core.h, and returns the payload of the response.
+ */
+static int l_request(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    lua_Integer type = luaL_checkinteger(L, 2);
+    size_t payload_len;
+    const char *payload = luaL_optlstring(L, 3, "", &payload_len);
+    const unsigned char *content;
+    size_t len;
+    binary_type_e response;
+
+    luaL_argcheck(L, type > 0 && type < BINARY_OK && type != BINARY_EXIT, 2, "invalid command type");
+    luaL_argcheck(L, BINARY_HEADER_SIZE + payload_len <= m->config.max_message_size, 3, "payload too long");
+    if (!native_request(L, m, (binary_type_e) type, (const unsigned char *) payload, payload_len,
+                        &response, &content, &len))
+        return 2;
+    return 1;
+}
+
+
+/**
+ * Monitor:poll_events() -> events, error
+ * Every event is a table with a type field:
+ * ready and stats have fields, themechange has dark, error has message,
+ * and accentchange has color, opaque and variants like Monitor:accent().
+ * error is set once the monitor stopped, after which there are no more events.
+ */
+static int l_poll_events(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    window_config_t *config = &m->config;
+    lua_Integer count = 0;
+    size_t pos = 0;
+    int running;
+
+#ifdef MONITOR_NATIVE_DBUS
+    if (m->dbus_ready && config->running) {
+        monitor_error_t err;
+        if (!platform_dbus_dispatch(&m->dbus, &err)) {
+            monitor_lock(config);
+            log_error(config, "%s", err.message);
+            monitor_unlock(config);
+            monitor_stop(config);
+        }
+    }
+#endif
+
+    monitor_lock(config);
+    running = config->running && monitor_apply_pending(config);
+    monitor_unlock(config);
+    if (!running)
+        monitor_stop(config);
+
+    lua_newtable(L);
+    while (pos + BINARY_HEADER_SIZE <= m->len) {
+        const unsigned char *record = m->queue + pos;
+        size_t len = (size_t) record[6] | (size_t) record[7] << 8;
+        const unsigned char *content = record + BINARY_HEADER_SIZE;
+
+        pos += BINARY_HEADER_SIZE + len;
+        // responses that weren't picked up belong to a request that failed halfway
+        if ((int32_t) get_u32(record) != -1)
+            continue;
+
+        lua_newtable(L);
+        switch (record[4]) {
+            case BINARY_READY:
+            case BINARY_STATS_BROADCAST:
+                lua_pushstring(L, record[4] == BINARY_READY ? BROADCAST_READY : BROADCAST_STATS);
+                lua_setfield(L, -2, "type");
+                push_fields(L, content, len);
+                lua_setfield(L, -2, "fields");
+                break;
+            case BINARY_THEMECHANGE:
+                lua_pushstring(L, BROADCAST_THEMECHANGE);
+                lua_setfield(L, -2, "type");
+                lua_pushboolean(L, len >= 1 && content[0]);
+                lua_setfield(L, -2, "dark");
+                break;
+            case BINARY_ACCENTCHANGE:
+                lua_pushstring(L, BROADCAST_ACCENTCHANGE);
+                lua_setfield(L, -2, "type");
+                push_accent(L, content, len);
+                lua_setfield(L, -4, "variants");
+                lua_setfield(L, -3, "opaque");
+                lua_setfield(L, -2, "color");
+                break;
+            default:
+                lua_pushstring(L, BROADCAST_ERROR);
+                lua_setfield(L, -2, "type");
+                lua_pushlstring(L, (const char *) content, len);
+                lua_setfield(L, -2, "message");
+                break;
+        }
+        lua_rawseti(L, -2, ++count);
+    }
+    m->len = 0;
+
+    if (m->dropped) {
+        lua_newtable(L);
+        lua_pushstring(L, BROADCAST_ERROR);
+        lua_setfield(L, -2, "type");
+        lua_pushfstring(L, "dropped %d events", (int) m->dropped);
+        lua_setfield(L, -2, "message");
+        lua_rawseti(L, -2, ++count);
+        m->dropped = 0;
+    }
+
+    if (config->running)
+        return 1;
+    lua_pushstring(L, "the monitor stopped");
+    return 2;
+}
+
+
+static platform_mock_t *check_mock(lua_State *L, native_monitor_t *m) {
+    if (!m->mock_backend)
+        luaL_error(L, "the monitor doesn't use the mock backend");
+    return &m->mock;
+}
+
+
+/**
+ * Monitor:mock_theme(dark)
+ */
+static int l_mock_theme(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    platform_mock_set_theme(check_mock(L, m), &m->config, lua_toboolean(L, 2));
+    return 0;
+}
+
+
+/**
+ * Monitor:mock_accent(rgba, opaque)
+ */
+static int l_mock_accent(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    unsigned long rgba = (unsigned long) (luaL_checkinteger(L, 2) & 0xFFFFFFFF);
+    // the platform reports ARGB, like DWM
+    platform_mock_set_accent(check_mock(L, m), &m->config, (rgba >> 8) | (rgba & 0xFF) << 24, lua_toboolean(L, 3));
+    return 0;
+}
+
+
+/**
+ * Monitor:mock_window(handle, open) -> true | nil, error
+ */
+static int l_mock_window(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    uint64_t handle = (uint64_t) luaL_checkinteger(L, 2);
+    platform_mock_t *mock = check_mock(L, m);
+
+    if (!lua_toboolean(L, 3)) {
+        platform_mock_remove_window(mock, &m->config, handle);
+    } else if (!platform_mock_add_window(mock, &m->config, handle)) {
+        lua_pushnil(L);
+        lua_pushstring(L, "too many windows");
+        return 2;
+    }
+    lua_pushboolean(L, 1);
+    return 1;
+}
+
+
+/**
+ * Monitor:mock_window_state(handle) -> { dark_mode, extend_border, backdrop_type, apply_count } | nil
+ * What the monitor applied to an open window of the mock.
+ */
+static int l_mock_window_state(lua_State *L) {
+    native_monitor_t *m = check_monitor(L);
+    uint64_t handle = (uint64_t) luaL_checkinteger(L, 2);
+    platform_mock_window_t window;
+
+    if (!platform_mock_get_window(check_mock(L, m), handle, &window)) {
+        lua_pushnil(L);
+        return 1;
+    }
+    lua_createtable(L, 0, 4);
+    lua_pushboolean(L, window.dark_mode);
+    lua_setfield(L, -2, "dark_mode");
+    lua_pushboolean(L, window.extend_border);
+    lua_setfield(L, -2, "extend_border");
+    lua_pushinteger(L, window.backdrop_type);
+    lua_setfield(L, -2, "backdrop_type");
+    lua_pushinteger(L, (lua_Integer) window.apply_count);
+    lua_setfield(L, -2, "apply_count");
+    return 1;
+}
+
+
+/**
+ * Monitor:close(), also called when the monitor is collected.
+ */
+static int l_close(lua_State *L) {
+    native_close((native_monitor_t *) luaL_checkudata(L, 1, NATIVE_MONITOR_MT));
+    return 0;
+}
+
+
+static const luaL_Reg monitor_methods[] = {
+    { "configure", &l_configure },
+    { "theme", &l_theme },
+    { "accent", &l_accent },
+    { "request", &l_request },
+    { "poll_events", &l_poll_events },
+    { "mock_theme", &l_mock_theme },
+    { "mock_accent", &l_mock_accent },
+    { "mock_window", &l_mock_window },
+    { "mock_window_state", &l_mock_window_state },
+    { "close", &l_close },
+    { NULL, NULL }
+};
+
+
+static const luaL_Reg module_functions[] = {
+    { "open", &l_open },
+    { NULL, NULL }
+};
+
+
+#ifdef _WIN32
+__declspec(dllexport)
+#endif
+int luaopen_monitor_native(lua_State *L) {
+    luaL_newmetatable(L, NATIVE_MONITOR_MT);
+    luaL_setfuncs(L, monitor_methods, 0);
+    lua_pushvalue(L, -1);
+    lua_setfield(L, -2, "__index");
+    lua_pushcfunction(L, &l_close);
+    lua_setfield(L, -2, "__gc");
+    lua_pushcfunction(L, &l_close);
+    lua_setfield(L, -2, "__close");
+    lua_pop(L, 1);
+
+    luaL_newlib(L, module_functions);
+    return 1;
+}
@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "monitor_reactor.h"
+#include "monitor_trace.h"
+
+
+static int set_flags(int fd, int flags) {
+    int current = fcntl(fd, F_GETFL);
+    return current >= 0 && fcntl(fd, F_SETFL, current | flags) == 0
+            && fcntl(fd, F_SETFD, FD_CLOEXEC) == 0;
+}
+
+
+int monitor_reactor_init(monitor_reactor_t *reactor, window_config_t *config, int in_fd, monitor_error_t *err) {
+    memset(reactor, 0, sizeof(*reactor));
+    reactor->config = config;
+    reactor->in_fd = in_fd;
+    reactor->wake_fd[0] = reactor->wake_fd[1] = -1;
+
+    reactor->size = config->max_message_size + READ_CHUNK_SIZE;
+    reactor->buffer = (char *) malloc(reactor->size);
+    if (!reactor->buffer) {
+        snprintf(err->message, sizeof(err->message), "monitor_reactor_init: out of memory");
+        return 0;
+    }
+    if (pipe(reactor->wake_fd) != 0) {
+        snprintf(err->message, sizeof(err->message), "pipe: %s", strerror(errno));
+        monitor_reactor_destroy(reactor);
+        return 0;
+    }
+    if (!set_flags(reactor->wake_fd[0], O_NONBLOCK) || !set_flags(reactor->wake_fd[1], O_NONBLOCK)) {
+        snprintf(err->message, sizeof(err->message), "fcntl: %s", strerror(errno));
+        monitor_reactor_destroy(reactor);
+        return 0;
+    }
+    return 1;
+}
+
+
+void monitor_reactor_destroy(monitor_reactor_t *reactor) {
+    for (int i = 0; i < 2; i++) {
+        if (reactor->wake_fd[i] >= 0)
+            close(reactor->wake_fd[i]);
+        reactor->wake_fd[i] = -1;
+    }
+    free(reactor->buffer);
+    reactor->buffer = NULL;
+}
+
+
+int monitor_reactor_add(monitor_reactor_t *reactor, int fd, int (*fn)(void *ud, monitor_error_t *err), void *ud) {
+    if (reactor->source_count >= MAX_REACTOR_SOURCES)
+        return 0;
+    reactor->sources[reactor->source_count].fd = fd;
+    reactor->sources[reactor->source_count].fn = fn;
+    reactor->sources[reactor->source_count].ud = ud;
+    reactor->source_count++;
+    return 1;
+}
+
+
+/**
+ * Applies the configuration and runs the timers.
+ * Returns the timeout for poll in milliseconds, or -2 if the reactor should stop.
+ */
+static int reactor_service(monitor_reactor_t *reactor) {
+    window_config_t *config = reactor->config;
+    uint64_t deadline, now;
+    int running;
+
+    monitor_lock(config);
+    running = config->running && monitor_apply_pending(config);
+    deadline = monitor_next_deadline(config);
+    monitor_unlock(config);
+
+    if (!running)
+        return -2;
+    if (!deadline)
+        return -1;
+    now = monitor_now_ns();
+    return deadline <= now ? 0 : (int) ((deadline - now + 999999) / 1000000);
+}
+
+
+/**
+ * Reads whatever is available on the input.
+ * Returns 0 if the reactor should stop.
+ */
+static int reactor_read(monitor_reactor_t *reactor) {
+    window_config_t *config = reactor->config;
+    ssize_t n = read(reactor->in_fd, reactor->buffer + reactor->len, reactor->size - reactor->len);
+    size_t pos;
+    int keep_going;
+
+    if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        return 1;
+    if (n <= 0)
+        return 0;
+    if (config->trace)
+        monitor_trace_record(config->trace, TRACE_INPUT, reactor->buffer + reactor->len, (size_t) n);
+    reactor->len += (size_t) n;
+
+    pos = monitor_handle_input(config, reactor->buffer, reactor->len, &keep_going);
+    memmove(reactor->buffer, reactor->buffer + pos, reactor->len - pos);
+    reactor->len -= pos;
+    return keep_going;
+}
+
+
+void monitor_reactor_run(monitor_reactor_t *reactor) {
+    window_config_t *config = reactor->config;
+    struct pollfd fds[MAX_REACTOR_SOURCES + 2];
+    nfds_t count = 0;
+
+    fds[count].fd = reactor->in_fd;
+    fds[count++].events = POLLIN;
+    fds[count].fd = reactor->wake_fd[0];
+    fds[count++].events = POLLIN;
+    for (int i = 0; i < reactor->source_count; i++) {
+        fds[count].fd = reactor->sources[i].fd;
+        fds[count++].events = POLLIN;
+    }
+
+    for (;;) {
+        int timeout = reactor_service(reactor), stop = 0;
+
+        if (timeout == -2)
+            break;
+        if (poll(fds, count, timeout) < 0) {
+            if (errno == EINTR)
+                continue;
+            monitor_lock(config);
+            log_error(config, "poll: %s", strerror(errno));
+            monitor_unlock(config);
+            break;
+        }
+        reactor->wakeups++;
+
+        if (fds[1].revents) {
+            char buffer[64];
+            while (read(reactor->wake_fd[0], buffer, sizeof(buffer)) > 0);
+        }
+
+        // the platform goes first, so the input sees the latest settings
+        for (int i = 0; i < reactor->source_count && !stop; i++) {
+            monitor_error_t err;
+            if (!fds[i + 2].revents)
+                continue;
+            if (!reactor->sources[i].fn(reactor->sources[i].ud, &err)) {
+                monitor_lock(config);
+                log_error(config, "%s", err.message);
+                monitor_unlock(config);
+                stop = 1;
+            }
+        }
+
+        if (!stop && fds[0].revents && !reactor_read(reactor))
+            stop = 1;
+        if (stop)
+            break;
+    }
+    monitor_stop(config);
+}
+
+
+void monitor_reactor_wake(monitor_reactor_t *reactor) {
+    ssize_t rc;
+    do {
+        rc = write(reactor->wake_fd[1], "", 1);
+        // a full pipe is fine, the loop will wake up anyway
+    } while (rc < 0 && errno == EINTR);
+}
@@ -0,0 +1,66 @@
+#ifndef MONITOR_REACTOR_H
+#define MONITOR_REACTOR_H
+
+#include "monitor_core.h"
+
+
+#define MAX_REACTOR_SOURCES 4
+
+
+/**
+ * A file descriptor watched by the reactor, such as the connection of the platform backend.
+ * fn is called without config->mutex held whenever fd is readable,
+ * and returns 0 and fills err if the monitor should stop.
+ */
+typedef struct monitor_reactor_source_s {
+    int fd;
+    int (*fn)(void *ud, monitor_error_t *err);
+    void *ud;
+} monitor_reactor_source_t;
+
+/**
+ * Runs a monitor from a single thread: one poll waits for input, the platform and the timers,
+ * then the messages are handled and the configuration applied from the same thread.
+ * This replaces the reader and the applier threads of monitor_read_loop and monitor_apply_loop.
+ *
+ * Platform callbacks that run on another thread must call monitor_reactor_wake
+ * after changing the configuration, so the reactor applies it.
+ */
+typedef struct monitor_reactor_s {
+    window_config_t *config;
+    int in_fd;
+    // written to by monitor_reactor_wake
+    int wake_fd[2];
+    monitor_reactor_source_t sources[MAX_REACTOR_SOURCES];
+    int source_count;
+    // room for the longest message the config accepts and a chunk, see monitor_handle_input
+    char *buffer;
+    size_t size, len;
+    // the number of times poll returned, only read once the reactor stopped
+    unsigned long wakeups;
+} monitor_reactor_t;
+
+
+/**
+ * Returns 0 and fills err on failure, in which case reactor doesn't need to be destroyed.
+ */
+int monitor_reactor_init(monitor_reactor_t *reactor, window_config_t *config, int in_fd, monitor_error_t *err);
+void monitor_reactor_destroy(monitor_reactor_t *reactor);
+
+/**
+ * Watches fd until the reactor stops. Returns 0 if there are too many sources.
+ */
+int monitor_reactor_add(monitor_reactor_t *reactor, int fd, int (*fn)(void *ud, monitor_error_t *err), void *ud);
+
+/**
+ * Handles input until EOF, an exit command, the window is gone or the monitor is stopped.
+ * The monitor is stopped when this returns.
+ */
+void monitor_reactor_run(monitor_reactor_t *reactor);
+
+/**
+ * Makes the reactor look at the configuration again. Can be called from any thread.
+ */
+void monitor_reactor_wake(monitor_reactor_t *reactor);
+
+#endif
@@ -0,0 +1,162 @@
+#ifndef _WIN32
+#define _POSIX_C_SOURCE 200809L
+#endif
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+#include "monitor_state.h"
+
+
+#ifdef _WIN32
+
+int monitor_state_create(monitor_state_map_t *map, unsigned long pid, unsigned long id) {
+    char name[MONITOR_STATE_NAME_SIZE];
+
+    memset(map, 0, sizeof(*map));
+    snprintf(name, sizeof(name), MONITOR_STATE_NAME_FORMAT, pid, id);
+    // the mapping goes away with the last handle, so there is nothing left to replace
+    map->mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, sizeof(*map->page), name);
+    if (!map->mapping)
+        return 0;
+    map->page = (monitor_state_page_t *) MapViewOfFile(map->mapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(*map->page));
+    if (!map->page) {
+        DWORD error = GetLastError();
+        CloseHandle(map->mapping);
+        map->mapping = NULL;
+        SetLastError(error);
+        return 0;
+    }
+    // a reader may still hold the mapping of a monitor that is gone
+    memset(map->page, 0, sizeof(*map->page));
+    map->owner = 1;
+    return 1;
+}
+
+
+int monitor_state_open(monitor_state_map_t *map, unsigned long pid, unsigned long id) {
+    char name[MONITOR_STATE_NAME_SIZE];
+
+    memset(map, 0, sizeof(*map));
+    snprintf(name, sizeof(name), MONITOR_STATE_NAME_FORMAT, pid, id);
+    map->mapping = OpenFileMappingA(FILE_MAP_READ, FALSE, name);
+    if (!map->mapping)
+        return 0;
+    map->page = (monitor_state_page_t *) MapViewOfFile(map->mapping, FILE_MAP_READ, 0, 0, sizeof(*map->page));
+    if (!map->page) {
+        DWORD error = GetLastError();
+        CloseHandle(map->mapping);
+        map->mapping = NULL;
+        SetLastError(error);
+        return 0;
+    }
+    return 1;
+}
+
+
+void monitor_state_close(monitor_state_map_t *map) {
+    if (map->page)
+        UnmapViewOfFile(map->page);
+    if (map->mapping)
+        CloseHandle(map->mapping);
+    map->page = NULL;
+    map->mapping = NULL;
+}
+
+#else
+
+/**
+ * Maps the page from a shared memory object, the file descriptor is closed either way.
+ */
+static monitor_state_page_t *map_page(int fd, int prot) {
+    void *page = mmap(NULL, sizeof(monitor_state_page_t), prot, MAP_SHARED, fd, 0);
+    int saved = errno;
+    close(fd);
+    errno = saved;
+    return page == MAP_FAILED ? NULL : (monitor_state_page_t *) page;
+}
+
+
+int monitor_state_create(monitor_state_map_t *map, unsigned long pid, unsigned long id) {
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    snprintf(map->name, sizeof(map->name), MONITOR_STATE_NAME_FORMAT, pid, id);
+    // a page with the same pid belongs to a monitor that is gone
+    fd = shm_open(map->name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return 0;
+    if (ftruncate(fd, sizeof(*map->page)) != 0) {
+        int saved = errno;
+        close(fd);
+        shm_unlink(map->name);
+        errno = saved;
+        return 0;
+    }
+    map->page = map_page(fd, PROT_READ | PROT_WRITE);
+    if (!map->page) {
+        int saved = errno;
+        shm_unlink(map->name);
+        errno = saved;
+        return 0;
+    }
+    // the old page may have been left in the middle of a write
+    memset(map->page, 0, sizeof(*map->page));
+    map->owner = 1;
+    return 1;
+}
+
+
+int monitor_state_open(monitor_state_map_t *map, unsigned long pid, unsigned long id) {
+    struct stat st;
+    int fd;
+
+    memset(map, 0, sizeof(*map));
+    snprintf(map->name, sizeof(map->name), MONITOR_STATE_NAME_FORMAT, pid, id);
+    fd = shm_open(map->name, O_RDONLY, 0);
+    if (fd < 0)
+        return 0;
+    // the monitor may not have sized it yet
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*map->page)) {
+        close(fd);
+        errno = EAGAIN;
+        return 0;
+    }
+    map->page = map_page(fd, PROT_READ);
+    return map->page != NULL;
+}
+
+
+void monitor_state_close(monitor_state_map_t *map) {
+    if (map->page)
+        munmap(map->page, sizeof(*map->page));
+    if (map->page && map->owner)
+        shm_unlink(map->name);
+    map->page = NULL;
+}
+
+#endif
+
+
+void monitor_state_write(monitor_state_page_t *page, const monitor_state_t *state) {
+    uint32_t seq = page->seq;
+
+    // a fresh page is only valid once it has its magic, after the first state
+    monitor_state_store(&page->seq, seq + 1);
+    monitor_state_fence();
+    memcpy(&page->state, state, sizeof(*state));
+    page->size = sizeof(*page);
+    page->magic = MONITOR_STATE_MAGIC;
+    monitor_state_store(&page->seq, seq + 2);
+}
@@ -0,0 +1,140 @@
+#ifndef MONITOR_STATE_H
+#define MONITOR_STATE_H
+
+#include <stdint.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "monitor_color.h"
+
+
+// "ITSP" in little-endian
+#define MONITOR_STATE_MAGIC 0x50535449u
+// readers give up on a page that stays in the middle of a write, such as when the monitor died
+#define MONITOR_STATE_MAX_RETRIES 1000
+#define MONITOR_STATE_NAME_SIZE 64
+
+#ifdef _WIN32
+#define MONITOR_STATE_NAME_FORMAT "Local\\immersive-title.%lu.%lu"
+#else
+#define MONITOR_STATE_NAME_FORMAT "/immersive-title.%lu.%lu"
+#endif
+
+
+// the sequence counter is the only field written and read atomically
+#ifdef _WIN32
+#define monitor_state_load(P) ((uint32_t) InterlockedCompareExchange((volatile LONG *) (P), 0, 0))
+#define monitor_state_store(P, V) ((void) InterlockedExchange((volatile LONG *) (P), (LONG) (V)))
+#define monitor_state_fence() MemoryBarrier()
+#else
+#define monitor_state_load(P) __atomic_load_n((P), __ATOMIC_ACQUIRE)
+#define monitor_state_store(P, V) __atomic_store_n((P), (uint32_t) (V), __ATOMIC_RELEASE)
+#define monitor_state_fence() __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#endif
+
+
+typedef enum {
+    STATE_DARK_MODE = 1,
+    STATE_ACCENT = 2,
+    STATE_APPLIED = 4
+} state_flags_e;
+
+/**
+ * The state of a monitor, as the client would learn it from its responses and broadcasts.
+ */
+typedef struct monitor_state_s {
+    // the values below that are known
+    uint32_t flags;
+    // the topics the client is subscribed to, values of other topics may be stale
+    uint32_t topics;
+    int32_t dark_mode;
+    int32_t opaque;
+    // RGBA
+    uint32_t accent;
+    // for every background set by the contrast command
+    uint32_t variant_count;
+    uint32_t variants[MAX_CONTRAST_COLORS];
+    // the configuration last applied to the window
+    int32_t extend_border;
+    int32_t backdrop_type;
+} monitor_state_t;
+
+/**
+ * A page shared with the client, which reads the state without asking the monitor.
+ * The page is named with MONITOR_STATE_NAME_FORMAT, from the state_pid and state_id fields
+ * of the ready broadcast.
+ *
+ * seq is odd while the monitor writes the state, and changes with every write,
+ * so a copy of the state taken between two equal even values of seq is consistent.
+ */
+typedef struct monitor_state_page_s {
+    uint32_t magic;
+    // sizeof(monitor_state_page_t), for readers built against another layout
+    uint32_t size;
+    uint32_t seq;
+    uint32_t reserved;
+    monitor_state_t state;
+} monitor_state_page_t;
+
+/**
+ * A mapping of the page, created by the monitor or opened by a client.
+ */
+typedef struct monitor_state_map_s {
+    monitor_state_page_t *page;
+    int owner;
+#ifdef _WIN32
+    HANDLE mapping;
+#else
+    char name[MONITOR_STATE_NAME_SIZE];
+#endif
+} monitor_state_map_t;
+
+
+/**
+ * Creates the page of a monitor, replacing one left by a monitor that didn't exit cleanly.
+ * Returns 0 on failure, with the error in errno or GetLastError().
+ */
+int monitor_state_create(monitor_state_map_t *map, unsigned long pid, unsigned long id);
+
+/**
+ * Opens the page of a monitor read-only.
+ * Returns 0 on failure, with the error in errno or GetLastError().
+ */
+int monitor_state_open(monitor_state_map_t *map, unsigned long pid, unsigned long id);
+
+/**
+ * Unmaps the page, and removes it if it was created by this process.
+ * Does nothing if the map was never created or opened.
+ */
+void monitor_state_close(monitor_state_map_t *map);
+
+/**
+ * Publishes state. Only a single thread may write at a time.
+ */
+void monitor_state_write(monitor_state_page_t *page, const monitor_state_t *state);
+
+
+/**
+ * Takes a consistent copy of the state without a syscall.
+ * Returns 0 if the page is invalid or the copy can't be taken.
+ */
+static inline int monitor_state_read(const monitor_state_page_t *page, monitor_state_t *state) {
+    if (page->magic != MONITOR_STATE_MAGIC || page->size != sizeof(*page))
+        return 0;
+
+    for (int i = 0; i < MONITOR_STATE_MAX_RETRIES; i++) {
+        uint32_t seq = monitor_state_load(&page->seq);
+        if (seq & 1)
+            continue;
+        memcpy(state, (const void *) &page->state, sizeof(*state));
+        monitor_state_fence();
+        if (monitor_state_load(&page->seq) == seq)
+            return 1;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,135 @@
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_stats.h"
+
+
+static const char *counter_names[STAT_MAX] = {
+    "messages",
+    "parse_errors",
+    "theme_events",
+    "accent_events",
+    "unsubscribed_events",
+    "broadcasts",
+    "lock_acquires",
+    "lock_wait_ns",
+    "lock_hold_ns",
+    "apply_failures",
+};
+
+static const char *histogram_names[HIST_MAX] = {
+    "event_latency",
+    "lock_wait",
+    "dwm_extend_frame",
+    "dwm_dark_mode",
+    "dwm_backdrop",
+};
+
+
+void monitor_stats_init(monitor_stats_t *stats) {
+    memset((void *) stats, 0, sizeof(*stats));
+}
+
+
+static void counter_max(monitor_counter_t *counter, uint64_t value) {
+    uint64_t current = monitor_counter_get(counter);
+    while (value > current && !monitor_counter_cas(counter, current, value))
+        current = monitor_counter_get(counter);
+}
+
+
+void monitor_stats_record(monitor_stats_t *stats, monitor_histogram_e histogram, uint64_t ns) {
+    monitor_histogram_t *h = &stats->histograms[histogram];
+    int bucket = 0;
+
+    while (bucket < HISTOGRAM_BUCKETS - 1 && ns >= (1ull << (HISTOGRAM_MIN_SHIFT + bucket)))
+        bucket++;
+    monitor_counter_add(&h->buckets[bucket], 1);
+    monitor_counter_add(&h->count, 1);
+    monitor_counter_add(&h->sum_ns, ns);
+    counter_max(&h->max_ns, ns);
+}
+
+
+/**
+ * Gets the upper bound of the bucket that holds the given percentile, or the maximum.
+ */
+static uint64_t percentile(const uint64_t *buckets, uint64_t count, uint64_t max_ns, int percent) {
+    uint64_t target = (count * percent + 99) / 100, seen = 0;
+
+    for (int i = 0; i < HISTOGRAM_BUCKETS - 1; i++) {
+        seen += buckets[i];
+        if (seen >= target) {
+            uint64_t bound = 1ull << (HISTOGRAM_MIN_SHIFT + i);
+            return bound < max_ns ? bound : max_ns;
+        }
+    }
+    return max_ns;
+}
+
+
+/**
+ * Appends a field, with its name formatted into names.
+ */
+static void append_field(monitor_field_t *fields, size_t *count, size_t max_count, char *names, size_t names_size,
+                            size_t *names_len, uint64_t value, const char *fmt, const char *name, unsigned long long bound) {
+    int written;
+
+    if (*count >= max_count || *names_len >= names_size)
+        return;
+    written = snprintf(names + *names_len, names_size - *names_len, fmt, name, bound);
+    if (written < 0 || (size_t) written >= names_size - *names_len)
+        return;
+    fields[*count].name = names + *names_len;
+    fields[*count].value = value;
+    (*count)++;
+    *names_len += (size_t) written + 1;
+}
+
+
+void monitor_stats_fields(monitor_stats_t *stats, monitor_field_t *fields, size_t *count, size_t max_count,
+                            char *names, size_t names_size) {
+    size_t names_len = 0;
+
+    for (int i = 0; i < STAT_MAX && *count < max_count; i++) {
+        fields[*count].name = counter_names[i];
+        fields[*count].value = monitor_counter_get(&stats->counters[i]);
+        (*count)++;
+    }
+
+    for (int i = 0; i < HIST_MAX; i++) {
+        monitor_histogram_t *h = &stats->histograms[i];
+        uint64_t buckets[HISTOGRAM_BUCKETS], total = 0, max_ns = monitor_counter_get(&h->max_ns);
+
+        // the buckets may change while we read them, so count them ourselves
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            buckets[j] = monitor_counter_get(&h->buckets[j]);
+            total += buckets[j];
+        }
+
+        append_field(fields, count, max_count, names, names_size, &names_len,
+                        total, "%s_count", histogram_names[i], 0);
+        if (!total)
+            continue;
+        append_field(fields, count, max_count, names, names_size, &names_len,
+                        monitor_counter_get(&h->sum_ns), "%s_sum_ns", histogram_names[i], 0);
+        append_field(fields, count, max_count, names, names_size, &names_len,
+                        max_ns, "%s_max_ns", histogram_names[i], 0);
+        append_field(fields, count, max_count, names, names_size, &names_len,
+                        percentile(buckets, total, max_ns, 50), "%s_p50_ns", histogram_names[i], 0);
+        append_field(fields, count, max_count, names, names_size, &names_len,
+                        percentile(buckets, total, max_ns, 99), "%s_p99_ns", histogram_names[i], 0);
+        for (int j = 0; j < HISTOGRAM_BUCKETS; j++) {
+            if (!buckets[j])
+                continue;
+            // the last bucket has no upper bound
+            append_field(fields, count, max_count, names, names_size, &names_len, buckets[j],
+                            j == HISTOGRAM_BUCKETS - 1 ? "%s_inf" : "%s_lt_%lluns", histogram_names[i],
+                            1ull << (HISTOGRAM_MIN_SHIFT + j));
+        }
+    }
+}
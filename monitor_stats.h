@@ -0,0 +1,101 @@
+#ifndef MONITOR_STATS_H
+#define MONITOR_STATS_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+
+#define HISTOGRAM_BUCKETS 16
+// the first bucket holds latencies below 2^HISTOGRAM_MIN_SHIFT ns (about 1us), every next one doubles
+#define HISTOGRAM_MIN_SHIFT 10
+#define MAX_STATS_FIELDS 128
+#define STATS_NAMES_SIZE 4096
+
+
+// counters are updated from several threads without taking a lock
+#ifdef _WIN32
+typedef volatile LONG64 monitor_counter_t;
+#define monitor_counter_add(C, V) InterlockedExchangeAdd64((C), (LONG64) (V))
+#define monitor_counter_get(C) ((uint64_t) InterlockedCompareExchange64((C), 0, 0))
+#define monitor_counter_cas(C, OLD, NEW) (InterlockedCompareExchange64((C), (LONG64) (NEW), (LONG64) (OLD)) == (LONG64) (OLD))
+#define monitor_counter_set(C, V) ((void) InterlockedExchange64((C), (LONG64) (V)))
+#else
+typedef uint64_t monitor_counter_t;
+#define monitor_counter_add(C, V) __atomic_fetch_add((C), (uint64_t) (V), __ATOMIC_RELAXED)
+#define monitor_counter_get(C) __atomic_load_n((C), __ATOMIC_RELAXED)
+#define monitor_counter_cas(C, OLD, NEW) __atomic_compare_exchange_n((C), &(OLD), (NEW), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)
+#define monitor_counter_set(C, V) __atomic_store_n((C), (uint64_t) (V), __ATOMIC_RELAXED)
+#endif
+
+
+/**
+ * A named value, such as the duration of a startup phase or a counter.
+ */
+typedef struct monitor_field_s {
+    const char *name;
+    uint64_t value;
+} monitor_field_t;
+
+
+typedef enum {
+    STAT_MESSAGES,
+    STAT_PARSE_ERRORS,
+    STAT_THEME_EVENTS,
+    STAT_ACCENT_EVENTS,
+    // accent events nobody was subscribed to, which were ignored without taking the mutex
+    STAT_UNSUBSCRIBED_EVENTS,
+    STAT_BROADCASTS,
+    STAT_LOCK_ACQUIRES,
+    STAT_LOCK_WAIT_NS,
+    STAT_LOCK_HOLD_NS,
+    // window attributes that failed to apply and were retried
+    STAT_APPLY_FAILURES,
+    STAT_MAX
+} monitor_stat_e;
+
+typedef enum {
+    // from the platform noticing a change to the broadcast, including the debounce window
+    HIST_EVENT_LATENCY,
+    HIST_LOCK_WAIT,
+    HIST_DWM_EXTEND_FRAME,
+    HIST_DWM_DARK_MODE,
+    HIST_DWM_BACKDROP,
+    HIST_MAX
+} monitor_histogram_e;
+
+
+typedef struct monitor_histogram_s {
+    monitor_counter_t count, sum_ns, max_ns;
+    monitor_counter_t buckets[HISTOGRAM_BUCKETS];
+} monitor_histogram_t;
+
+typedef struct monitor_stats_s {
+    monitor_counter_t counters[STAT_MAX];
+    monitor_histogram_t histograms[HIST_MAX];
+} monitor_stats_t;
+
+
+void monitor_stats_init(monitor_stats_t *stats);
+
+#define monitor_stats_count(S, STAT) ((void) monitor_counter_add(&(S)->counters[STAT], 1))
+#define monitor_stats_add(S, STAT, V) ((void) monitor_counter_add(&(S)->counters[STAT], (V)))
+
+/**
+ * Records a latency in a histogram.
+ */
+void monitor_stats_record(monitor_stats_t *stats, monitor_histogram_e histogram, uint64_t ns);
+
+/**
+ * Appends every counter and every histogram to fields, starting at *count.
+ * A histogram is reported as its count, sum, maximum, 50th and 99th percentile
+ * and every bucket that isn't empty, as "name_lt_<upper bound>ns".
+ * The names of the histogram fields are written to names, which must outlive fields.
+ */
+void monitor_stats_fields(monitor_stats_t *stats, monitor_field_t *fields, size_t *count, size_t max_count,
+                            char *names, size_t names_size);
+
+#endif
@@ -0,0 +1,33 @@
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <time.h>
+
+#include "monitor_sync.h"
+
+
+#ifndef _WIN32
+void monitor_cond_init_monotonic(monitor_cond_t *cond) {
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(cond, &attr);
+    pthread_condattr_destroy(&attr);
+}
+#endif
+
+
+void monitor_cond_timedwait(monitor_cond_t *cond, monitor_mutex_t *mutex, uint64_t timeout_ns) {
+#ifdef _WIN32
+    // round up so we never wake up before the deadline
+    SleepConditionVariableCS(cond, mutex, (DWORD) ((timeout_ns + 999999) / 1000000));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    timeout_ns += ts.tv_nsec;
+    ts.tv_sec += timeout_ns / 1000000000ull;
+    ts.tv_nsec = timeout_ns % 1000000000ull;
+    pthread_cond_timedwait(cond, mutex, &ts);
+#endif
+}
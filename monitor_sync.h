@@ -0,0 +1,47 @@
+#ifndef MONITOR_SYNC_H
+#define MONITOR_SYNC_H
+
+#include <stdint.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <pthread.h>
+#endif
+
+
+// a minimal set of synchronization primitives shared by every platform
+#ifdef _WIN32
+typedef CRITICAL_SECTION monitor_mutex_t;
+typedef CONDITION_VARIABLE monitor_cond_t;
+#define monitor_mutex_init(M) InitializeCriticalSection(M)
+#define monitor_mutex_destroy(M) DeleteCriticalSection(M)
+#define monitor_mutex_lock(M) EnterCriticalSection(M)
+#define monitor_mutex_unlock(M) LeaveCriticalSection(M)
+#define monitor_cond_init(C) InitializeConditionVariable(C)
+#define monitor_cond_destroy(C) ((void) (C))
+#define monitor_cond_wait(C, M) SleepConditionVariableCS((C), (M), INFINITE)
+#define monitor_cond_signal(C) WakeConditionVariable(C)
+#define monitor_cond_broadcast(C) WakeAllConditionVariable(C)
+#else
+typedef pthread_mutex_t monitor_mutex_t;
+typedef pthread_cond_t monitor_cond_t;
+#define monitor_mutex_init(M) pthread_mutex_init((M), NULL)
+#define monitor_mutex_destroy(M) pthread_mutex_destroy(M)
+#define monitor_mutex_lock(M) pthread_mutex_lock(M)
+#define monitor_mutex_unlock(M) pthread_mutex_unlock(M)
+#define monitor_cond_init(C) monitor_cond_init_monotonic(C)
+#define monitor_cond_destroy(C) pthread_cond_destroy(C)
+#define monitor_cond_wait(C, M) pthread_cond_wait((C), (M))
+#define monitor_cond_signal(C) pthread_cond_signal(C)
+#define monitor_cond_broadcast(C) pthread_cond_broadcast(C)
+
+void monitor_cond_init_monotonic(monitor_cond_t *cond);
+#endif
+
+/**
+ * Waits on a condition variable for at most timeout_ns.
+ */
+void monitor_cond_timedwait(monitor_cond_t *cond, monitor_mutex_t *mutex, uint64_t timeout_ns);
+
+#endif
@@ -0,0 +1,559 @@
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#if !defined(_WIN32) && !defined(_POSIX_C_SOURCE)
+#define _POSIX_C_SOURCE 200809L
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#endif
+
+#include "monitor_trace.h"
+#include "platform_mock.h"
+
+
+// the first field of the stats, see emit_stats in monitor_core.c
+#define STATS_FIELD "dropped_events"
+
+
+static void put_u32(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xFF;
+    p[1] = (value >> 8) & 0xFF;
+    p[2] = (value >> 16) & 0xFF;
+    p[3] = (value >> 24) & 0xFF;
+}
+
+
+static uint32_t get_u32(const unsigned char *p) {
+    return (uint32_t) p[0] | (uint32_t) p[1] << 8 | (uint32_t) p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+
+int monitor_trace_open(monitor_trace_t *trace, const char *path, monitor_error_t *err) {
+    memset(trace, 0, sizeof(*trace));
+    trace->file = fopen(path, "wb");
+    if (!trace->file) {
+        snprintf(err->message, sizeof(err->message), "fopen: %s: %s", path, strerror(errno));
+        return 0;
+    }
+    monitor_mutex_init(&trace->mutex);
+    return 1;
+}
+
+
+int monitor_trace_attach(monitor_trace_t *trace, window_config_t *config, monitor_error_t *err) {
+    unsigned char header[TRACE_HEADER_SIZE] = { 0 };
+    unsigned long color;
+    int opaque, written;
+
+    monitor_lock(config);
+    if (!config->platform->get_accent(config->platform_ud, &color, &opaque, err)) {
+        monitor_unlock(config);
+        return 0;
+    }
+    put_u32(header, TRACE_MAGIC);
+    header[4] = TRACE_VERSION;
+    header[5] = (config->binary ? TRACE_FLAG_BINARY : 0)
+                | (config->desired.dark_mode ? TRACE_FLAG_DARK_MODE : 0)
+                | (opaque ? TRACE_FLAG_OPAQUE : 0);
+    put_u32(header + 8, (uint32_t) color);
+    put_u32(header + 12, (uint32_t) config->max_message_size);
+
+    monitor_mutex_lock(&trace->mutex);
+    written = fwrite(header, sizeof(header), 1, trace->file) == 1;
+    trace->failed = !written;
+    trace->last_ns = monitor_clock_ns();
+    monitor_mutex_unlock(&trace->mutex);
+    if (!written) {
+        snprintf(err->message, sizeof(err->message), "fwrite: %s", strerror(errno));
+        monitor_unlock(config);
+        return 0;
+    }
+    for (int i = 0; i < config->window_count; i++) {
+        unsigned char payload[8];
+        put_u32(payload, (uint32_t) config->windows[i].handle);
+        put_u32(payload + 4, (uint32_t) (config->windows[i].handle >> 32));
+        monitor_trace_record(trace, TRACE_WINDOW_CREATED, payload, sizeof(payload));
+    }
+    config->trace = trace;
+    monitor_unlock(config);
+    return 1;
+}
+
+
+void monitor_trace_close(monitor_trace_t *trace) {
+    if (!trace->file)
+        return;
+    fclose(trace->file);
+    monitor_mutex_destroy(&trace->mutex);
+    trace->file = NULL;
+}
+
+
+void monitor_trace_record(monitor_trace_t *trace, trace_record_e type, const void *data, size_t len) {
+    unsigned char header[TRACE_RECORD_HEADER_SIZE];
+    uint64_t now, us;
+
+    monitor_mutex_lock(&trace->mutex);
+    if (trace->failed) {
+        monitor_mutex_unlock(&trace->mutex);
+        return;
+    }
+    now = monitor_clock_ns();
+    us = (now - trace->last_ns) / 1000;
+    if (us > UINT32_MAX) {
+        us = UINT32_MAX;
+        trace->last_ns = now;
+    } else {
+        // what is left of the microsecond goes to the next record, so the times don't drift
+        trace->last_ns += us * 1000;
+    }
+    header[0] = (unsigned char) type;
+    put_u32(header + 1, (uint32_t) us);
+    put_u32(header + 5, (uint32_t) len);
+    if (fwrite(header, sizeof(header), 1, trace->file) != 1 || (len && fwrite(data, len, 1, trace->file) != 1))
+        trace->failed = 1;
+    monitor_mutex_unlock(&trace->mutex);
+}
+
+
+void monitor_trace_output(monitor_trace_t *trace, int binary, const void *data, size_t len) {
+    static const char ready_prefix[] = "-1 " BROADCAST_READY " ";
+    const unsigned char *p = (const unsigned char *) data;
+    int ready = binary ? len >= BINARY_HEADER_SIZE && p[4] == BINARY_READY
+                       : len >= sizeof(ready_prefix) - 1 && memcmp(p, ready_prefix, sizeof(ready_prefix) - 1) == 0;
+
+    monitor_trace_record(trace, ready ? TRACE_READY : TRACE_OUTPUT, data, len);
+}
+
+
+/**
+ * A growing buffer, for the output and the latencies of a replay.
+ */
+typedef struct replay_buffer_s {
+    unsigned char *data;
+    size_t len, size;
+} replay_buffer_t;
+
+
+static int buffer_append(replay_buffer_t *buffer, const void *data, size_t len) {
+    if (buffer->len + len > buffer->size) {
+        size_t size = buffer->size ? buffer->size : 4096;
+        unsigned char *p;
+        while (size < buffer->len + len)
+            size *= 2;
+        p = (unsigned char *) realloc(buffer->data, size);
+        if (!p)
+            return 0;
+        buffer->data = p;
+        buffer->size = size;
+    }
+    memcpy(buffer->data + buffer->len, data, len);
+    buffer->len += len;
+    return 1;
+}
+
+
+static int replay_sink(void *ud, const void *data, size_t len) {
+    return buffer_append((replay_buffer_t *) ud, data, len);
+}
+
+
+static uint64_t replay_clock(void *ud) {
+    return *(uint64_t *) ud;
+}
+
+
+/**
+ * Moves the clock of the monitor to until, or sleeps until then in real time.
+ */
+static void replay_wait(uint64_t *now, int realtime, uint64_t until) {
+    uint64_t current;
+
+    if (!realtime) {
+        if (until > *now)
+            *now = until;
+        return;
+    }
+    while ((current = monitor_clock_ns()) < until) {
+#ifdef _WIN32
+        Sleep((DWORD) ((until - current) / 1000000));
+#else
+        struct timespec ts;
+        ts.tv_sec = (time_t) ((until - current) / 1000000000ull);
+        ts.tv_nsec = (long) ((until - current) % 1000000000ull);
+        nanosleep(&ts, NULL);
+#endif
+    }
+}
+
+
+/**
+ * Runs the timers of the monitor that are due by until, at the time they are due.
+ */
+static void replay_timers(window_config_t *config, uint64_t *now, int realtime, uint64_t until) {
+    for (;;) {
+        uint64_t deadline;
+
+        monitor_lock(config);
+        deadline = monitor_next_deadline(config);
+        monitor_unlock(config);
+        if (!deadline || deadline > until)
+            return;
+        replay_wait(now, realtime, deadline);
+        monitor_lock(config);
+        monitor_apply_pending(config);
+        monitor_unlock(config);
+    }
+}
+
+
+/**
+ * The end of the message that starts at pos, in the protocol of the trace.
+ */
+static size_t message_end(const replay_buffer_t *buffer, size_t pos, int binary) {
+    size_t end;
+
+    if (!binary) {
+        const unsigned char *newline = (const unsigned char *) memchr(buffer->data + pos, '\n', buffer->len - pos);
+        return newline ? (size_t) (newline - buffer->data) + 1 : buffer->len;
+    }
+    if (buffer->len - pos < BINARY_HEADER_SIZE)
+        return buffer->len;
+    end = pos + BINARY_HEADER_SIZE + (buffer->data[pos + 6] | (size_t) buffer->data[pos + 7] << 8);
+    return end < buffer->len ? end : buffer->len;
+}
+
+
+static void print_message(FILE *report, const char *label, const unsigned char *p, size_t len, int binary) {
+    fprintf(report, "  %s ", label);
+    if (!len) {
+        fprintf(report, "nothing\n");
+    } else if (!binary) {
+        size_t n = len - (p[len - 1] == '\n');
+        fprintf(report, "\"%.*s\"%s\n", (int) (n < 200 ? n : 200), (const char *) p, n > 200 ? "..." : "");
+    } else {
+        fprintf(report, "serial %ld type 0x%02X payload", len >= 4 ? (long) (int32_t) get_u32(p) : 0L,
+                len > 4 ? p[4] : 0);
+        for (size_t i = BINARY_HEADER_SIZE; i < len && i < BINARY_HEADER_SIZE + 32; i++)
+            fprintf(report, " %02X", p[i]);
+        fprintf(report, "%s\n", len > BINARY_HEADER_SIZE + 32 ? " ..." : "");
+    }
+}
+
+
+/**
+ * Checks if a message holds stats, on its own or in a batch.
+ */
+static int is_stats(const unsigned char *p, size_t len, int binary) {
+    static const char field[] = STATS_FIELD "=";
+
+    if (binary) {
+        // binary stats don't fit in a batch
+        return len >= BINARY_HEADER_SIZE
+            && (p[4] == BINARY_STATS_BROADCAST
+                || (p[4] == BINARY_OK && len > BINARY_HEADER_SIZE + sizeof(STATS_FIELD)
+                    && p[BINARY_HEADER_SIZE] == sizeof(STATS_FIELD) - 1
+                    && memcmp(p + BINARY_HEADER_SIZE + 1, STATS_FIELD, sizeof(STATS_FIELD) - 1) == 0));
+    }
+    for (size_t i = 0; i + sizeof(field) - 1 <= len; i++) {
+        if (memcmp(p + i, field, sizeof(field) - 1) == 0)
+            return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Compares two stats messages with the values of their fields left out.
+ */
+static int same_stats(const unsigned char *a, size_t a_len, const unsigned char *b, size_t b_len, int binary) {
+    size_t i = 0, j = 0;
+
+    if (binary) {
+        // the header holds the serial, the type and the length, which depends on the names only
+        if (a_len != b_len || memcmp(a, b, BINARY_HEADER_SIZE) != 0)
+            return 0;
+        for (i = BINARY_HEADER_SIZE; i < a_len; i += 1 + a[i] + 8) {
+            if (i + 1 + a[i] + 8 > a_len || memcmp(a + i, b + i, 1 + a[i]) != 0)
+                return 0;
+        }
+        return 1;
+    }
+    while (i < a_len && j < b_len) {
+        if (a[i] != b[j])
+            return 0;
+        if (a[i] == '=') {
+            do i++; while (i < a_len && isdigit(a[i]));
+            do j++; while (j < b_len && isdigit(b[j]));
+        } else {
+            i++;
+            j++;
+        }
+    }
+    return i == a_len && j == b_len;
+}
+
+
+/**
+ * Compares the output message by message, and reports the first differences.
+ * Returns the number of messages that differ.
+ */
+static unsigned long compare_output(FILE *report, const replay_buffer_t *expected, const replay_buffer_t *actual, int binary) {
+    size_t pos_expected = 0, pos_actual = 0;
+    unsigned long messages_expected = 0, messages_actual = 0, diffs = 0;
+
+    while (pos_expected < expected->len || pos_actual < actual->len) {
+        size_t end_expected = pos_expected < expected->len ? message_end(expected, pos_expected, binary) : pos_expected;
+        size_t end_actual = pos_actual < actual->len ? message_end(actual, pos_actual, binary) : pos_actual;
+        size_t len_expected = end_expected - pos_expected, len_actual = end_actual - pos_actual;
+        const unsigned char *p_expected = expected->data + pos_expected, *p_actual = actual->data + pos_actual;
+
+        messages_expected += len_expected > 0;
+        messages_actual += len_actual > 0;
+        if ((len_expected != len_actual || memcmp(p_expected, p_actual, len_expected) != 0)
+            && !(is_stats(p_expected, len_expected, binary) && is_stats(p_actual, len_actual, binary)
+                 && same_stats(p_expected, len_expected, p_actual, len_actual, binary))) {
+            if (++diffs <= TRACE_MAX_REPORTED_DIFFS) {
+                fprintf(report, "message %lu differs:\n", messages_expected > messages_actual ? messages_expected : messages_actual);
+                print_message(report, "recorded", p_expected, len_expected, binary);
+                print_message(report, "replayed", p_actual, len_actual, binary);
+            }
+        }
+        pos_expected = end_expected;
+        pos_actual = end_actual;
+    }
+    fprintf(report, "output: %lu messages recorded, %lu replayed, %lu different\n",
+            messages_expected, messages_actual, diffs);
+    return diffs;
+}
+
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+
+/**
+ * Reads the whole file at path, returns NULL and reports why if it can't.
+ */
+static unsigned char *read_file(const char *path, size_t *size, FILE *report) {
+    FILE *file = fopen(path, "rb");
+    unsigned char *data = NULL;
+    long len;
+
+    if (!file) {
+        fprintf(report, "fopen: %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+    if (fseek(file, 0, SEEK_END) != 0 || (len = ftell(file)) < 0 || fseek(file, 0, SEEK_SET) != 0) {
+        fprintf(report, "fseek: %s: %s\n", path, strerror(errno));
+    } else if (!(data = (unsigned char *) malloc(len ? (size_t) len : 1))) {
+        fprintf(report, "read_file: out of memory\n");
+    } else if (len && fread(data, (size_t) len, 1, file) != 1) {
+        fprintf(report, "fread: %s: %s\n", path, ferror(file) ? strerror(errno) : "unexpected end of file");
+        free(data);
+        data = NULL;
+    }
+    fclose(file);
+    *size = (size_t) len;
+    return data;
+}
+
+
+int monitor_trace_replay(const char *path, int realtime, FILE *report) {
+    window_config_t config;
+    platform_mock_t mock;
+    replay_buffer_t expected = { 0 }, actual = { 0 }, latencies = { 0 };
+    unsigned char *trace;
+    char *input = NULL;
+    size_t size, pos, input_size = 0, input_len = 0;
+    unsigned long inputs = 0, theme_events = 0, accent_events = 0, window_events = 0, diffs;
+    uint64_t now, start, at, elapsed, messages;
+    int binary, stopped = 0, status = 2;
+    uint32_t max_message_size;
+
+    trace = read_file(path, &size, report);
+    if (!trace)
+        return 2;
+    if (size < TRACE_HEADER_SIZE || get_u32(trace) != TRACE_MAGIC) {
+        fprintf(report, "%s: not a trace\n", path);
+        free(trace);
+        return 2;
+    }
+    if (trace[4] != TRACE_VERSION) {
+        fprintf(report, "%s: unsupported trace version %d\n", path, trace[4]);
+        free(trace);
+        return 2;
+    }
+    binary = !!(trace[5] & TRACE_FLAG_BINARY);
+    max_message_size = get_u32(trace + 12);
+    if (max_message_size < MIN_MESSAGE_SIZE || max_message_size > MAX_MESSAGE_SIZE) {
+        fprintf(report, "%s: invalid message size: %lu\n", path, (unsigned long) max_message_size);
+        free(trace);
+        return 2;
+    }
+
+    platform_mock_init(&mock);
+    mock.dark_mode = !!(trace[5] & TRACE_FLAG_DARK_MODE);
+    mock.opaque = !!(trace[5] & TRACE_FLAG_OPAQUE);
+    mock.accent = get_u32(trace + 8);
+    monitor_init(&config, &platform_mock, &mock, -1);
+    monitor_writer_set_sink(&config.out, &replay_sink, &actual);
+    config.binary = binary;
+    config.max_message_size = max_message_size;
+    config.desired.dark_mode = mock.dark_mode;
+
+    // the input is buffered like the reader of the monitor does, so every read fits
+    input_size = config.max_message_size + READ_CHUNK_SIZE;
+    input = (char *) malloc(input_size);
+    if (!input) {
+        fprintf(report, "monitor_trace_replay: out of memory\n");
+        goto exit;
+    }
+
+    now = start = at = monitor_clock_ns();
+    if (!realtime)
+        monitor_set_clock(&replay_clock, &now);
+
+    for (pos = TRACE_HEADER_SIZE; pos < size; ) {
+        const unsigned char *payload = trace + pos + TRACE_RECORD_HEADER_SIZE;
+        trace_record_e type;
+        size_t len;
+
+        if (size - pos < TRACE_RECORD_HEADER_SIZE
+            || (len = get_u32(trace + pos + 5)) > size - pos - TRACE_RECORD_HEADER_SIZE) {
+            // the monitor was probably killed while recording
+            fprintf(report, "%s: truncated record at offset %lu, the rest is ignored\n", path, (unsigned long) pos);
+            break;
+        }
+        type = (trace_record_e) trace[pos];
+        at += (uint64_t) get_u32(trace + pos + 1) * 1000;
+        pos += TRACE_RECORD_HEADER_SIZE + len;
+
+        if (type == TRACE_OUTPUT) {
+            if (!buffer_append(&expected, payload, len)) {
+                fprintf(report, "monitor_trace_replay: out of memory\n");
+                goto exit;
+            }
+            continue;
+        }
+        // the monitor would have exited, so only the output that was still recorded matters
+        if (type == TRACE_READY || stopped)
+            continue;
+
+        replay_timers(&config, &now, realtime, at);
+        replay_wait(&now, realtime, at);
+
+        switch (type) {
+        case TRACE_INPUT: {
+            uint64_t handle_start, latency;
+            size_t consumed;
+            int keep_going;
+
+            if (len > input_size - input_len) {
+                fprintf(report, "%s: a read of %lu bytes doesn't fit the input buffer\n", path, (unsigned long) len);
+                goto exit;
+            }
+            memcpy(input + input_len, payload, len);
+            input_len += len;
+
+            handle_start = monitor_clock_ns();
+            consumed = monitor_handle_input(&config, input, input_len, &keep_going);
+            monitor_lock(&config);
+            keep_going = keep_going && config.running && monitor_apply_pending(&config);
+            monitor_unlock(&config);
+            latency = monitor_clock_ns() - handle_start;
+
+            memmove(input, input + consumed, input_len - consumed);
+            input_len -= consumed;
+            if (!buffer_append(&latencies, &latency, sizeof(latency))) {
+                fprintf(report, "monitor_trace_replay: out of memory\n");
+                goto exit;
+            }
+            inputs++;
+            stopped = !keep_going;
+            break;
+        }
+
+        case TRACE_THEME:
+            if (len < 1)
+                break;
+            platform_mock_set_theme(&mock, &config, payload[0]);
+            theme_events++;
+            break;
+
+        case TRACE_ACCENT:
+            if (len < 5)
+                break;
+            platform_mock_set_accent(&mock, &config, get_u32(payload + 1), payload[0]);
+            accent_events++;
+            break;
+
+        case TRACE_WINDOW_CREATED:
+        case TRACE_WINDOW_DESTROYED: {
+            uint64_t handle;
+
+            if (len < 8)
+                break;
+            handle = (uint64_t) get_u32(payload) | ((uint64_t) get_u32(payload + 4) << 32);
+            if (type == TRACE_WINDOW_DESTROYED)
+                platform_mock_remove_window(&mock, &config, handle);
+            else if (!platform_mock_add_window(&mock, &config, handle))
+                log_error(&config, "too many windows, ignoring %llu", (unsigned long long) handle);
+            window_events++;
+            break;
+        }
+
+        default:
+            fprintf(report, "%s: unknown record type 0x%02X at offset %lu\n", path, type,
+                    (unsigned long) (pos - TRACE_RECORD_HEADER_SIZE - len));
+            goto exit;
+        }
+
+        monitor_lock(&config);
+        monitor_apply_pending(&config);
+        monitor_unlock(&config);
+    }
+    // the debounce windows that were still open at the end of the trace
+    if (!stopped)
+        replay_timers(&config, &now, realtime, at);
+    elapsed = monitor_clock_ns() - start;
+
+    messages = monitor_counter_get(&config.stats.counters[STAT_MESSAGES]);
+    fprintf(report, "trace: %lu reads, %lu theme events, %lu accent events, %lu window events over %.3f ms\n",
+            inputs, theme_events, accent_events, window_events, (double) (at - start) / 1e6);
+    fprintf(report, "replay: %llu messages in %.3f ms%s, %.0f messages/s\n",
+            (unsigned long long) messages, (double) elapsed / 1e6, realtime ? " in real time" : "",
+            elapsed ? (double) messages * 1e9 / (double) elapsed : 0.0);
+    if (inputs) {
+        uint64_t *values = (uint64_t *) latencies.data;
+        qsort(values, inputs, sizeof(*values), &compare_u64);
+        fprintf(report, "latency per read: p50 %llu ns, p99 %llu ns, max %llu ns\n",
+                (unsigned long long) values[(inputs - 1) / 2],
+                (unsigned long long) values[(inputs - 1) * 99 / 100],
+                (unsigned long long) values[inputs - 1]);
+    }
+    diffs = compare_output(report, &expected, &actual, binary);
+    status = diffs ? 1 : 0;
+
+exit:
+    monitor_set_clock(NULL, NULL);
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+    free(input);
+    free(expected.data);
+    free(actual.data);
+    free(latencies.data);
+    free(trace);
+    return status;
+}
@@ -0,0 +1,109 @@
+#ifndef MONITOR_TRACE_H
+#define MONITOR_TRACE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "monitor_core.h"
+
+
+// "ITTR" in little-endian
+#define TRACE_MAGIC 0x52545449u
+#define TRACE_VERSION 1
+#define TRACE_HEADER_SIZE 16
+#define TRACE_RECORD_HEADER_SIZE 9
+// the differences printed by a replay, the rest are only counted
+#define TRACE_MAX_REPORTED_DIFFS 5
+
+
+/**
+ * A trace is a little-endian file that starts with a header:
+ * uint32 TRACE_MAGIC, uint8 TRACE_VERSION, uint8 flags (TRACE_FLAG_*), uint16 reserved,
+ * uint32 accent as ARGB, uint32 max_message_size
+ * which holds the state of the platform when recording started, followed by records:
+ * uint8 type, uint32 microseconds since the previous record, uint32 payload length
+ * and the payload.
+ *
+ * Payloads:
+ * TRACE_INPUT: the bytes read from the client, as they were read
+ * TRACE_OUTPUT: a message written to the client, stats are compared without their values
+ * TRACE_READY: the ready broadcast, which holds timings and handles and isn't compared
+ * TRACE_THEME: uint8 dark_mode, as the platform reported it
+ * TRACE_ACCENT: uint8 opaque, uint32 accent as ARGB
+ * TRACE_WINDOW_CREATED, TRACE_WINDOW_DESTROYED: uint64 window handle,
+ *                                              the windows found before recording come first
+ *
+ * Gaps longer than UINT32_MAX microseconds (about 71 minutes) are shortened.
+ */
+typedef enum {
+    TRACE_INPUT = 0x01,
+    TRACE_OUTPUT = 0x02,
+    TRACE_READY = 0x03,
+    TRACE_THEME = 0x04,
+    TRACE_ACCENT = 0x05,
+    TRACE_WINDOW_CREATED = 0x06,
+    TRACE_WINDOW_DESTROYED = 0x07,
+} trace_record_e;
+
+typedef enum {
+    TRACE_FLAG_BINARY = 1,
+    TRACE_FLAG_DARK_MODE = 2,
+    TRACE_FLAG_OPAQUE = 4
+} trace_flags_e;
+
+
+/**
+ * Records what a monitor reads, writes and hears from the platform.
+ * Records can be added from any thread.
+ */
+struct monitor_trace_s {
+    FILE *file;
+    int failed;
+    uint64_t last_ns;
+    monitor_mutex_t mutex;
+};
+
+
+/**
+ * Creates the trace file at path.
+ * Returns 0 and fills err if it can't be created.
+ */
+int monitor_trace_open(monitor_trace_t *trace, const char *path, monitor_error_t *err);
+
+/**
+ * Writes the header with the current state of the platform and the windows found so far,
+ * and starts recording config.
+ * Should be called before the threads are started and the ready broadcast is sent.
+ * Returns 0 and fills err if the header can't be written.
+ */
+int monitor_trace_attach(monitor_trace_t *trace, window_config_t *config, monitor_error_t *err);
+
+/**
+ * Flushes and closes the trace, once nothing can record to it anymore.
+ * Does nothing if it was never opened.
+ */
+void monitor_trace_close(monitor_trace_t *trace);
+
+/**
+ * Adds a record with the len bytes of data as its payload.
+ * A trace that can't be written to is left alone from then on.
+ */
+void monitor_trace_record(monitor_trace_t *trace, trace_record_e type, const void *data, size_t len);
+
+/**
+ * Records a message written to the client, binary tells how to recognize the ready broadcast.
+ */
+void monitor_trace_output(monitor_trace_t *trace, int binary, const void *data, size_t len);
+
+/**
+ * Replays a trace through the mock platform, comparing what the monitor writes with what was recorded.
+ * With realtime, records are replayed with the delays they were recorded with,
+ * otherwise as fast as possible, with the clock of the monitor following the trace.
+ * Writes the throughput, the latency of every read and the differences to report.
+ * Stats hold timings, so only their fields are compared and not the values.
+ * Returns an exit status: 0 if the output is the same, 1 if it differs and 2 if the trace can't be replayed.
+ */
+int monitor_trace_replay(const char *path, int realtime, FILE *report);
+
+#endif
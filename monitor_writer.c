@@ -0,0 +1,158 @@
+#ifndef _CRT_SECURE_NO_WARNINGS
+#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <string.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <unistd.h>
+#endif
+
+#include "monitor_writer.h"
+
+
+void monitor_writer_init(monitor_writer_t *writer, int fd) {
+    writer->fd = fd;
+    writer->flushing = writer->failed = 0;
+    writer->held = 0;
+    writer->pending = 0;
+    writer->len = 0;
+    writer->messages = writer->syscalls = 0;
+    writer->sink = NULL;
+    writer->sink_ud = NULL;
+    monitor_mutex_init(&writer->mutex);
+    monitor_cond_init(&writer->drained);
+}
+
+
+void monitor_writer_destroy(monitor_writer_t *writer) {
+    monitor_cond_destroy(&writer->drained);
+    monitor_mutex_destroy(&writer->mutex);
+}
+
+
+void monitor_writer_set_sink(monitor_writer_t *writer, monitor_writer_sink_t sink, void *ud) {
+    monitor_mutex_lock(&writer->mutex);
+    writer->sink = sink;
+    writer->sink_ud = ud;
+    monitor_mutex_unlock(&writer->mutex);
+}
+
+
+/**
+ * Writes everything in data, returns the number of write calls or -1 on failure.
+ */
+static long write_all(int fd, const char *data, size_t len) {
+    long calls = 0;
+
+    while (len) {
+#ifdef _WIN32
+        int written = _write(fd, data, (unsigned int) len);
+#else
+        ssize_t written = write(fd, data, len);
+        if (written < 0 && errno == EINTR)
+            continue;
+#endif
+        calls++;
+        if (written <= 0)
+            return -1;
+        data += written;
+        len -= (size_t) written;
+    }
+    return calls;
+}
+
+
+/**
+ * Writes the queued messages, and the ones queued in the meantime.
+ * writer->mutex must be held, and no other thread must be writing.
+ */
+static void flush(monitor_writer_t *writer) {
+    writer->flushing = 1;
+    while (writer->len && !writer->failed) {
+        char *buffer = writer->buffers[writer->pending];
+        size_t size = writer->len;
+        long calls;
+
+        writer->pending ^= 1;
+        writer->len = 0;
+        monitor_cond_broadcast(&writer->drained);
+
+        monitor_mutex_unlock(&writer->mutex);
+        if (writer->sink)
+            calls = writer->sink(writer->sink_ud, buffer, size) ? 0 : -1;
+        else
+            calls = write_all(writer->fd, buffer, size);
+        monitor_mutex_lock(&writer->mutex);
+
+        if (calls < 0) {
+            writer->failed = 1;
+            monitor_cond_broadcast(&writer->drained);
+        } else {
+            writer->syscalls += calls;
+        }
+    }
+    writer->flushing = 0;
+}
+
+
+int monitor_writer_write(monitor_writer_t *writer, const void *data, size_t len) {
+    int ok;
+
+    if (len > WRITER_BUFFER_SIZE)
+        len = WRITER_BUFFER_SIZE;
+
+    monitor_mutex_lock(&writer->mutex);
+    while (writer->len + len > WRITER_BUFFER_SIZE && !writer->failed) {
+        // a full buffer is written even during a hold, otherwise wait for the writing thread to make some room
+        if (!writer->flushing)
+            flush(writer);
+        else
+            monitor_cond_wait(&writer->drained, &writer->mutex);
+    }
+
+    if (!writer->failed) {
+        memcpy(writer->buffers[writer->pending] + writer->len, data, len);
+        writer->len += len;
+        writer->messages++;
+    }
+
+    // if another thread is writing, it will pick up our message
+    if (!writer->flushing && !writer->held)
+        flush(writer);
+    ok = !writer->failed;
+    monitor_mutex_unlock(&writer->mutex);
+    return ok;
+}
+
+
+void monitor_writer_hold(monitor_writer_t *writer) {
+    monitor_mutex_lock(&writer->mutex);
+    writer->held++;
+    monitor_mutex_unlock(&writer->mutex);
+}
+
+
+int monitor_writer_release(monitor_writer_t *writer) {
+    int ok;
+
+    monitor_mutex_lock(&writer->mutex);
+    if (!--writer->held && !writer->flushing)
+        flush(writer);
+    ok = !writer->failed;
+    monitor_mutex_unlock(&writer->mutex);
+    return ok;
+}
+
+
+int monitor_writer_failed(monitor_writer_t *writer) {
+    int failed;
+
+    monitor_mutex_lock(&writer->mutex);
+    failed = writer->failed;
+    monitor_mutex_unlock(&writer->mutex);
+    return failed;
+}
@@ -0,0 +1,77 @@
+#ifndef MONITOR_WRITER_H
+#define MONITOR_WRITER_H
+
+#include <stddef.h>
+
+#include "monitor_sync.h"
+
+
+#define WRITER_BUFFER_SIZE 16384
+
+
+/**
+ * Called instead of writing to the file descriptor, without the mutex held,
+ * with one or more whole messages. Returns 0 if it can't take any more.
+ */
+typedef int (*monitor_writer_sink_t)(void *ud, const void *data, size_t len);
+
+/**
+ * Writes whole messages to a file descriptor.
+ *
+ * Every message is copied into a buffer and written with a single write,
+ * so messages from different threads are never interleaved.
+ * While a thread is writing, messages from other threads are queued
+ * and written together by the same thread once it is done.
+ * Messages written during a hold are only queued, and written together when it ends.
+ * A non-blocking file descriptor that would block counts as failed, the rest of the message is lost.
+ */
+typedef struct monitor_writer_s {
+    int fd, flushing, failed;
+    // the number of holds that haven't been released
+    int held;
+    // the buffer that messages are appended to, the other one is being written
+    int pending;
+    size_t len;
+    unsigned long messages, syscalls;
+    monitor_writer_sink_t sink;
+    void *sink_ud;
+    char buffers[2][WRITER_BUFFER_SIZE];
+    monitor_cond_t drained;
+    monitor_mutex_t mutex;
+} monitor_writer_t;
+
+
+void monitor_writer_init(monitor_writer_t *writer, int fd);
+void monitor_writer_destroy(monitor_writer_t *writer);
+
+/**
+ * Hands the messages to sink instead of writing them,
+ * for a monitor that runs in the same process as its client.
+ */
+void monitor_writer_set_sink(monitor_writer_t *writer, monitor_writer_sink_t sink, void *ud);
+
+/**
+ * Writes a message, which must not be larger than WRITER_BUFFER_SIZE.
+ * During a hold, the message is only queued, unless the buffer is full.
+ * Returns 0 if the file descriptor can no longer be written to.
+ */
+int monitor_writer_write(monitor_writer_t *writer, const void *data, size_t len);
+
+/**
+ * Holds back the messages written from now on, so a burst of them costs a single write.
+ * Holds can be nested and taken by several threads.
+ */
+void monitor_writer_hold(monitor_writer_t *writer);
+
+/**
+ * Ends a hold, and writes the queued messages once no hold is left.
+ * Returns 0 if the file descriptor can no longer be written to.
+ */
+int monitor_writer_release(monitor_writer_t *writer);
+
+/**
+ * Returns 1 if the file descriptor can no longer be written to.
+ */
+int monitor_writer_failed(monitor_writer_t *writer);
+
+#endif
@@ -0,0 +1,365 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include "platform_dbus.h"
+
+
+#define DBUS_CALL_TIMEOUT_MS 1000
+
+#define SETTING_COLOR_SCHEME "color-scheme"
+#define SETTING_ACCENT_COLOR "accent-color"
+
+#define COLOR_SCHEME_PREFER_DARK 1
+
+
+typedef enum {
+    SETTING_THEME = 1 << 0,
+    SETTING_ACCENT = 1 << 1,
+} setting_changed_e;
+
+
+static int dbus_fail(monitor_error_t *err, const char *function_name, DBusError *error) {
+    snprintf(err->message, sizeof(err->message), "%s: %s", function_name,
+                dbus_error_is_set(error) ? error->message : "unknown error");
+    dbus_error_free(error);
+    return 0;
+}
+
+
+/**
+ * Converts a component of a freedesktop color, which is a fraction from 0 to 1.
+ * Returns 0 if the component is out of range, which means that there is no accent color.
+ */
+static int color_component(double value, unsigned long *component) {
+    if (!(value >= 0.0 && value <= 1.0))
+        return 0;
+    *component = (unsigned long) (value * 255.0 + 0.5);
+    return 1;
+}
+
+
+/**
+ * Reads a setting from the appearance namespace into dbus.
+ * The value may be wrapped in several variants, as Read wraps it twice.
+ * Returns the settings that changed. dbus->mutex must be held.
+ */
+static int read_setting(platform_dbus_t *dbus, const char *key, DBusMessageIter *value) {
+    DBusMessageIter inner;
+
+    while (dbus_message_iter_get_arg_type(value) == DBUS_TYPE_VARIANT) {
+        dbus_message_iter_recurse(value, &inner);
+        *value = inner;
+    }
+
+    if (strcmp(key, SETTING_COLOR_SCHEME) == 0) {
+        dbus_uint32_t scheme;
+        int dark_mode;
+
+        if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_UINT32)
+            return 0;
+        dbus_message_iter_get_basic(value, &scheme);
+        // no preference counts as light, like the registry default on Windows
+        dark_mode = scheme == COLOR_SCHEME_PREFER_DARK;
+        if (dark_mode == dbus->dark_mode)
+            return 0;
+        dbus->dark_mode = dark_mode;
+        return SETTING_THEME;
+    }
+
+    if (strcmp(key, SETTING_ACCENT_COLOR) == 0) {
+        unsigned long rgb[3], accent = DEFAULT_ACCENT;
+        int i;
+
+        if (dbus_message_iter_get_arg_type(value) != DBUS_TYPE_STRUCT)
+            return 0;
+        dbus_message_iter_recurse(value, &inner);
+        for (i = 0; i < 3 && dbus_message_iter_get_arg_type(&inner) == DBUS_TYPE_DOUBLE; i++) {
+            double component;
+            dbus_message_iter_get_basic(&inner, &component);
+            if (!color_component(component, &rgb[i]))
+                break;
+            dbus_message_iter_next(&inner);
+        }
+        if (i == 3)
+            accent = 0xFF000000ul | rgb[0] << 16 | rgb[1] << 8 | rgb[2];
+        if (accent == dbus->accent)
+            return 0;
+        dbus->accent = accent;
+        return SETTING_ACCENT;
+    }
+    return 0;
+}
+
+
+/**
+ * Calls method on the Settings portal with the namespace and key.
+ * Returns NULL and fills error on failure.
+ */
+static DBusMessage *call_settings(platform_dbus_t *dbus, const char *method, const char *key, DBusError *error) {
+    DBusMessage *msg, *reply;
+    const char *namespace = APPEARANCE_NAMESPACE;
+
+    msg = dbus_message_new_method_call(PORTAL_SERVICE, PORTAL_PATH, PORTAL_SETTINGS_INTERFACE, method);
+    if (!msg) {
+        dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, "out of memory");
+        return NULL;
+    }
+    if (!dbus_message_append_args(msg, DBUS_TYPE_STRING, &namespace, DBUS_TYPE_STRING, &key, DBUS_TYPE_INVALID)) {
+        dbus_message_unref(msg);
+        dbus_set_error_const(error, DBUS_ERROR_NO_MEMORY, "out of memory");
+        return NULL;
+    }
+    reply = dbus_connection_send_with_reply_and_block(dbus->conn, msg, DBUS_CALL_TIMEOUT_MS, error);
+    dbus_message_unref(msg);
+    return reply;
+}
+
+
+/**
+ * Reads the current value of a setting.
+ * A setting that the desktop doesn't have keeps its default.
+ */
+static int query_setting(platform_dbus_t *dbus, const char *key, monitor_error_t *err) {
+    DBusError error;
+    DBusMessage *reply;
+    DBusMessageIter iter;
+
+    dbus_error_init(&error);
+    reply = call_settings(dbus, "ReadOne", key, &error);
+    if (!reply && dbus_error_has_name(&error, DBUS_ERROR_UNKNOWN_METHOD)) {
+        // portals older than version 2 only have Read
+        dbus_error_free(&error);
+        reply = call_settings(dbus, "Read", key, &error);
+    }
+    if (!reply) {
+        if (dbus_error_has_name(&error, "org.freedesktop.portal.Error.NotFound")) {
+            dbus_error_free(&error);
+            return 1;
+        }
+        return dbus_fail(err, key, &error);
+    }
+
+    if (dbus_message_iter_init(reply, &iter)) {
+        monitor_mutex_lock(&dbus->mutex);
+        read_setting(dbus, key, &iter);
+        monitor_mutex_unlock(&dbus->mutex);
+    }
+    dbus_message_unref(reply);
+    return 1;
+}
+
+
+static DBusHandlerResult on_message(DBusConnection *conn, DBusMessage *msg, void *ud) {
+    platform_dbus_t *dbus = (platform_dbus_t *) ud;
+    DBusMessageIter iter;
+    const char *namespace, *key;
+    unsigned long accent;
+    int changed;
+    (void) conn;
+
+    if (!dbus_message_is_signal(msg, PORTAL_SETTINGS_INTERFACE, "SettingChanged")
+        || !dbus_message_iter_init(msg, &iter)
+        || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    dbus_message_iter_get_basic(&iter, &namespace);
+    if (strcmp(namespace, APPEARANCE_NAMESPACE) != 0
+        || !dbus_message_iter_next(&iter)
+        || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_STRING)
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    dbus_message_iter_get_basic(&iter, &key);
+    if (!dbus_message_iter_next(&iter))
+        return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    monitor_mutex_lock(&dbus->mutex);
+    changed = read_setting(dbus, key, &iter);
+    accent = dbus->accent;
+    monitor_mutex_unlock(&dbus->mutex);
+
+    if (changed & SETTING_THEME)
+        dbus->on_theme_change(dbus->ud);
+    if (changed & SETTING_ACCENT)
+        dbus->on_accent_change(dbus->ud, accent, 1);
+    return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+
+int platform_dbus_init(platform_dbus_t *dbus, monitor_error_t *err) {
+    DBusError error;
+
+    dbus->conn = NULL;
+    dbus->wake_fd[0] = dbus->wake_fd[1] = -1;
+    dbus->dark_mode = 0;
+    dbus->accent = DEFAULT_ACCENT;
+    monitor_mutex_init(&dbus->mutex);
+
+    dbus_error_init(&error);
+    dbus->conn = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+    if (!dbus->conn) {
+        dbus_fail(err, "dbus_bus_get_private", &error);
+        goto fail;
+    }
+    // a lost session bus is reported by platform_dbus_run instead
+    dbus_connection_set_exit_on_disconnect(dbus->conn, FALSE);
+
+    if (pipe(dbus->wake_fd) < 0) {
+        snprintf(err->message, sizeof(err->message), "pipe: %s", strerror(errno));
+        goto fail;
+    }
+
+    // subscribe before reading, so a change in between isn't lost
+    dbus_bus_add_match(dbus->conn,
+                        "type='signal',interface='" PORTAL_SETTINGS_INTERFACE "',"
+                        "member='SettingChanged',arg0='" APPEARANCE_NAMESPACE "'",
+                        &error);
+    if (dbus_error_is_set(&error)) {
+        dbus_fail(err, "dbus_bus_add_match", &error);
+        goto fail;
+    }
+    if (!dbus_connection_add_filter(dbus->conn, &on_message, dbus, NULL)) {
+        snprintf(err->message, sizeof(err->message), "dbus_connection_add_filter: out of memory");
+        goto fail;
+    }
+
+    if (query_setting(dbus, SETTING_COLOR_SCHEME, err) && query_setting(dbus, SETTING_ACCENT_COLOR, err))
+        return 1;
+
+fail:
+    platform_dbus_destroy(dbus);
+    return 0;
+}
+
+
+void platform_dbus_destroy(platform_dbus_t *dbus) {
+    if (dbus->conn) {
+        // does nothing if the filter was never added
+        dbus_connection_remove_filter(dbus->conn, &on_message, dbus);
+        dbus_connection_close(dbus->conn);
+        dbus_connection_unref(dbus->conn);
+        dbus->conn = NULL;
+    }
+    for (int i = 0; i < 2; i++) {
+        if (dbus->wake_fd[i] >= 0)
+            close(dbus->wake_fd[i]);
+        dbus->wake_fd[i] = -1;
+    }
+    monitor_mutex_destroy(&dbus->mutex);
+}
+
+
+int platform_dbus_fd(platform_dbus_t *dbus) {
+    int fd;
+    return dbus_connection_get_unix_fd(dbus->conn, &fd) ? fd : -1;
+}
+
+
+int platform_dbus_dispatch(void *ud, monitor_error_t *err) {
+    platform_dbus_t *dbus = (platform_dbus_t *) ud;
+
+    if (!dbus_connection_read_write(dbus->conn, 0) || !dbus_connection_get_is_connected(dbus->conn)) {
+        snprintf(err->message, sizeof(err->message), "the session bus disconnected");
+        return 0;
+    }
+    while (dbus_connection_dispatch(dbus->conn) == DBUS_DISPATCH_DATA_REMAINS);
+    return 1;
+}
+
+
+int platform_dbus_run(platform_dbus_t *dbus, monitor_error_t *err) {
+    struct pollfd fds[2];
+
+    fds[0].fd = platform_dbus_fd(dbus);
+    fds[0].events = POLLIN;
+    fds[1].fd = dbus->wake_fd[0];
+    fds[1].events = POLLIN;
+    if (fds[0].fd < 0) {
+        snprintf(err->message, sizeof(err->message), "dbus_connection_get_unix_fd: no file descriptor");
+        return 0;
+    }
+
+    // signals may have been read along with the replies in platform_dbus_init
+    while (dbus_connection_dispatch(dbus->conn) == DBUS_DISPATCH_DATA_REMAINS);
+
+    for (;;) {
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            snprintf(err->message, sizeof(err->message), "poll: %s", strerror(errno));
+            return 0;
+        }
+        if (fds[1].revents)
+            return 1;
+        if (!platform_dbus_dispatch(dbus, err))
+            return 0;
+    }
+}
+
+
+void platform_dbus_stop(platform_dbus_t *dbus) {
+    char c = 0;
+    while (write(dbus->wake_fd[1], &c, 1) < 0 && errno == EINTR);
+}
+
+
+static int dbus_is_window(void *ud) {
+    platform_dbus_target_t *target = (platform_dbus_target_t *) ud;
+    return kill(target->pid, 0) == 0 || errno == EPERM;
+}
+
+
+static int dbus_supports_backdrop(void *ud, window_backdrop_e type, monitor_error_t *err) {
+    (void) ud;
+    (void) type;
+    (void) err;
+    // nothing is applied, so there is nothing to refuse
+    return 1;
+}
+
+
+static int dbus_get_dark_mode(void *ud, int *is_dark, monitor_error_t *err) {
+    platform_dbus_t *dbus = ((platform_dbus_target_t *) ud)->dbus;
+    (void) err;
+
+    monitor_mutex_lock(&dbus->mutex);
+    *is_dark = dbus->dark_mode;
+    monitor_mutex_unlock(&dbus->mutex);
+    return 1;
+}
+
+
+static int dbus_get_accent(void *ud, unsigned long *color, int *opaque, monitor_error_t *err) {
+    platform_dbus_t *dbus = ((platform_dbus_target_t *) ud)->dbus;
+    (void) err;
+
+    monitor_mutex_lock(&dbus->mutex);
+    *color = dbus->accent;
+    monitor_mutex_unlock(&dbus->mutex);
+    *opaque = 1;
+    return 1;
+}
+
+
+static int dbus_apply(void *ud, uint64_t window, const window_attrs_t *attrs, config_changed_e mask, monitor_error_t *err) {
+    (void) ud;
+    (void) window;
+    (void) attrs;
+    (void) mask;
+    (void) err;
+    return 1;
+}
+
+
+const monitor_platform_t platform_dbus = {
+    &dbus_is_window,
+    &dbus_supports_backdrop,
+    &dbus_get_dark_mode,
+    &dbus_get_accent,
+    &dbus_apply,
+};
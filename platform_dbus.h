@@ -0,0 +1,76 @@
+#ifndef PLATFORM_DBUS_H
+#define PLATFORM_DBUS_H
+
+#include <sys/types.h>
+#include <dbus/dbus.h>
+
+#include "monitor_core.h"
+
+
+#define PORTAL_SERVICE "org.freedesktop.portal.Desktop"
+#define PORTAL_PATH "/org/freedesktop/portal/desktop"
+#define PORTAL_SETTINGS_INTERFACE "org.freedesktop.portal.Settings"
+#define APPEARANCE_NAMESPACE "org.freedesktop.appearance"
+
+// the accent reported when the desktop doesn't have one, in ARGB
+#define DEFAULT_ACCENT 0xFF3584E4ul
+
+
+/**
+ * A platform backend for Linux desktops that reads the theme and the accent color
+ * from the freedesktop Settings portal on the session bus.
+ *
+ * The settings are read once and then kept up to date from SettingChanged signals,
+ * which are waited for in platform_dbus_run.
+ * There is no window attribute to set, so applying a configuration does nothing.
+ */
+typedef struct platform_dbus_s {
+    DBusConnection *conn;
+    // written to by platform_dbus_stop
+    int wake_fd[2];
+    // called from platform_dbus_run, without the mutex held; set before platform_dbus_init
+    void (*on_theme_change)(void *ud);
+    void (*on_accent_change)(void *ud, unsigned long color, int opaque);
+    void *ud;
+    // protects the settings below
+    monitor_mutex_t mutex;
+    int dark_mode;
+    unsigned long accent;
+} platform_dbus_t;
+
+/**
+ * The userdata of the platform: the editor process whose settings are followed.
+ * The window is gone when the process is.
+ */
+typedef struct platform_dbus_target_s {
+    platform_dbus_t *dbus;
+    pid_t pid;
+} platform_dbus_target_t;
+
+extern const monitor_platform_t platform_dbus;
+
+/**
+ * Connects to the session bus (DBUS_SESSION_BUS_ADDRESS) and reads the current settings.
+ * Returns 0 and fills err on failure, in which case dbus doesn't need to be destroyed.
+ */
+int platform_dbus_init(platform_dbus_t *dbus, monitor_error_t *err);
+void platform_dbus_destroy(platform_dbus_t *dbus);
+
+/**
+ * Waits for settings changes and calls the callbacks until platform_dbus_stop is called.
+ * Returns 0 and fills err if the connection is lost.
+ */
+int platform_dbus_run(platform_dbus_t *dbus, monitor_error_t *err);
+void platform_dbus_stop(platform_dbus_t *dbus);
+
+/**
+ * For callers that wait on the connection themselves, such as the reactor, instead of platform_dbus_run.
+ * platform_dbus_fd returns the file descriptor of the connection, or -1.
+ * platform_dbus_dispatch reads from it and calls the callbacks, it takes a platform_dbus_t
+ * and returns 0 and fills err if the connection is lost.
+ * It should be called once before waiting, for the signals read in platform_dbus_init.
+ */
+int platform_dbus_fd(platform_dbus_t *dbus);
+int platform_dbus_dispatch(void *ud, monitor_error_t *err);
+
+#endif
@@ -0,0 +1,188 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "platform_mock.h"
+
+
+static int mock_is_window(void *ud) {
+    return ((platform_mock_t *) ud)->window_valid;
+}
+
+
+static int mock_supports_backdrop(void *ud, window_backdrop_e type, monitor_error_t *err) {
+    (void) ud;
+    if (type < BACKDROP_DEFAULT || type >= BACKDROP_MAX) {
+        snprintf(err->message, sizeof(err->message), "mock_supports_backdrop: unknown backdrop type %d", (int) type);
+        return 0;
+    }
+    return 1;
+}
+
+
+static int mock_get_dark_mode(void *ud, int *is_dark, monitor_error_t *err) {
+    (void) err;
+    *is_dark = ((platform_mock_t *) ud)->dark_mode;
+    return 1;
+}
+
+
+static int mock_get_accent(void *ud, unsigned long *color, int *opaque, monitor_error_t *err) {
+    platform_mock_t *mock = (platform_mock_t *) ud;
+    if (mock->accent_failing) {
+        snprintf(err->message, sizeof(err->message), "mock_get_accent: failing");
+        return 0;
+    }
+    *color = mock->accent;
+    *opaque = mock->opaque;
+    return 1;
+}
+
+
+static platform_mock_window_t *find_window(platform_mock_t *mock, uint64_t handle) {
+    for (int i = 0; i < mock->window_count; i++) {
+        if (mock->windows[i].handle == handle)
+            return &mock->windows[i];
+    }
+    return NULL;
+}
+
+
+static int mock_apply(void *ud, uint64_t handle, const window_attrs_t *attrs, config_changed_e mask, monitor_error_t *err) {
+    platform_mock_t *mock = (platform_mock_t *) ud;
+    platform_mock_window_t *window;
+
+    monitor_mutex_lock(&mock->mutex);
+    window = find_window(mock, handle);
+    if (!window) {
+        monitor_mutex_unlock(&mock->mutex);
+        snprintf(err->message, sizeof(err->message), "mock_apply: no window %llu", (unsigned long long) handle);
+        return 0;
+    }
+    if (mask & window->failing) {
+        window->fail_count++;
+        monitor_mutex_unlock(&mock->mutex);
+        snprintf(err->message, sizeof(err->message), "mock_apply: failing %d on %llu", (int) mask, (unsigned long long) handle);
+        return 0;
+    }
+    if (mask & CONFIG_DARK_MODE)
+        window->dark_mode = attrs->dark_mode;
+    if (mask & CONFIG_EXTEND_BORDER)
+        window->extend_border = attrs->extend_border;
+    if (mask & CONFIG_BACKDROP_TYPE)
+        window->backdrop_type = attrs->backdrop_type;
+    window->apply_count++;
+    mock->apply_count++;
+    monitor_mutex_unlock(&mock->mutex);
+    return 1;
+}
+
+
+const monitor_platform_t platform_mock = {
+    &mock_is_window,
+    &mock_supports_backdrop,
+    &mock_get_dark_mode,
+    &mock_get_accent,
+    &mock_apply,
+};
+
+
+void platform_mock_init(platform_mock_t *mock) {
+    memset(mock, 0, sizeof(*mock));
+    mock->window_valid = 1;
+    mock->accent = 0xC40078D4;
+    monitor_mutex_init(&mock->mutex);
+}
+
+
+void platform_mock_destroy(platform_mock_t *mock) {
+    monitor_mutex_destroy(&mock->mutex);
+}
+
+
+void platform_mock_set_theme(platform_mock_t *mock, window_config_t *config, int dark_mode) {
+    monitor_lock(config);
+    mock->dark_mode = dark_mode;
+    monitor_unlock(config);
+    monitor_on_theme_change(config);
+}
+
+
+void platform_mock_set_accent(platform_mock_t *mock, window_config_t *config, unsigned long color, int opaque) {
+    monitor_lock(config);
+    mock->accent = color;
+    mock->opaque = opaque;
+    monitor_unlock(config);
+    monitor_on_accent_change(config, color, opaque);
+}
+
+
+int platform_mock_add_window(platform_mock_t *mock, window_config_t *config, uint64_t handle) {
+    monitor_mutex_lock(&mock->mutex);
+    if (!find_window(mock, handle)) {
+        if (mock->window_count == MAX_WINDOWS) {
+            monitor_mutex_unlock(&mock->mutex);
+            return 0;
+        }
+        memset(&mock->windows[mock->window_count], 0, sizeof(*mock->windows));
+        mock->windows[mock->window_count++].handle = handle;
+    }
+    monitor_mutex_unlock(&mock->mutex);
+    if (config)
+        monitor_on_window_created(config, handle);
+    return 1;
+}
+
+
+void platform_mock_remove_window(platform_mock_t *mock, window_config_t *config, uint64_t handle) {
+    platform_mock_window_t *window;
+
+    monitor_mutex_lock(&mock->mutex);
+    window = find_window(mock, handle);
+    if (window) {
+        *window = mock->windows[mock->window_count - 1];
+        mock->window_count--;
+    }
+    monitor_mutex_unlock(&mock->mutex);
+    if (config)
+        monitor_on_window_destroyed(config, handle);
+}
+
+
+int platform_mock_fail(platform_mock_t *mock, uint64_t handle, config_changed_e failing) {
+    platform_mock_window_t *window;
+
+    monitor_mutex_lock(&mock->mutex);
+    window = find_window(mock, handle);
+    if (window)
+        window->failing = failing;
+    monitor_mutex_unlock(&mock->mutex);
+    return window != NULL;
+}
+
+
+int platform_mock_get_window(platform_mock_t *mock, uint64_t handle, platform_mock_window_t *window) {
+    platform_mock_window_t *found;
+
+    monitor_mutex_lock(&mock->mutex);
+    found = find_window(mock, handle);
+    if (found)
+        *window = *found;
+    monitor_mutex_unlock(&mock->mutex);
+    return found != NULL;
+}
+
+
+void platform_mock_storm(platform_mock_t *mock, window_config_t *config, unsigned long count, uint64_t interval_ns) {
+    uint64_t next = monitor_now_ns();
+
+    for (unsigned long i = 0; i < count; i++) {
+        // sleeping is far too coarse for the intervals we want, so spin
+        while (monitor_now_ns() < next);
+        next += interval_ns;
+
+        if (i % 8 == 7)
+            platform_mock_set_theme(mock, config, !mock->dark_mode);
+        else
+            platform_mock_set_accent(mock, config, 0xFF000000ul | ((i * 0x010203ul) & 0xFFFFFFul), 1);
+    }
+}
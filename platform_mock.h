@@ -0,0 +1,84 @@
+#ifndef PLATFORM_MOCK_H
+#define PLATFORM_MOCK_H
+
+#include "monitor_core.h"
+
+
+/**
+ * A window of the mock, and what apply did to it.
+ */
+typedef struct platform_mock_window_s {
+    uint64_t handle;
+    int dark_mode, extend_border;
+    window_backdrop_e backdrop_type;
+    unsigned long apply_count;
+    // apply fails on these attributes, see platform_mock_fail
+    config_changed_e failing;
+    unsigned long fail_count;
+} platform_mock_window_t;
+
+/**
+ * A platform backend that stands in for DWM and the registry.
+ * Every field is protected by the mutex of the config it is attached to,
+ * except for the windows, which are protected by mock->mutex since apply runs without the other one.
+ */
+typedef struct platform_mock_s {
+    int window_valid;
+    int dark_mode, opaque;
+    unsigned long accent;
+    // get_accent fails while this is set
+    int accent_failing;
+    // the open windows, apply fails on any other
+    monitor_mutex_t mutex;
+    platform_mock_window_t windows[MAX_WINDOWS];
+    int window_count;
+    unsigned long apply_count;
+} platform_mock_t;
+
+extern const monitor_platform_t platform_mock;
+
+void platform_mock_init(platform_mock_t *mock);
+void platform_mock_destroy(platform_mock_t *mock);
+
+/**
+ * Changes the system theme and notifies the monitor, like WM_SETTINGCHANGE would.
+ */
+void platform_mock_set_theme(platform_mock_t *mock, window_config_t *config, int dark_mode);
+
+/**
+ * Changes the accent color and notifies the monitor, like WM_DWMCOLORIZATIONCOLORCHANGED would.
+ */
+void platform_mock_set_accent(platform_mock_t *mock, window_config_t *config, unsigned long color, int opaque);
+
+/**
+ * Opens a window and notifies the monitor, like EVENT_OBJECT_CREATE would.
+ * config can be NULL if the monitor is told about the window some other way.
+ * Returns 0 if the mock has MAX_WINDOWS windows already.
+ */
+int platform_mock_add_window(platform_mock_t *mock, window_config_t *config, uint64_t handle);
+
+/**
+ * Closes a window and notifies the monitor, like EVENT_OBJECT_DESTROY would.
+ * config can be NULL, like for platform_mock_add_window.
+ */
+void platform_mock_remove_window(platform_mock_t *mock, window_config_t *config, uint64_t handle);
+
+/**
+ * Makes apply fail on the attributes of the window selected by failing, until it is called again.
+ * Returns 0 if the window isn't open.
+ */
+int platform_mock_fail(platform_mock_t *mock, uint64_t handle, config_changed_e failing);
+
+/**
+ * Copies what apply did to the window.
+ * Returns 0 if it isn't open.
+ */
+int platform_mock_get_window(platform_mock_t *mock, uint64_t handle, platform_mock_window_t *window);
+
+/**
+ * Injects count events, interval_ns apart, like dragging the accent slider would.
+ * Every 8th event flips the theme, the rest change the accent color.
+ */
+void platform_mock_storm(platform_mock_t *mock, window_config_t *config, unsigned long count, uint64_t interval_ns);
+
+#endif
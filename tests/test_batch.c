@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_core.h"
+#include "platform_mock.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+
+static int failures;
+static platform_mock_t mock;
+static window_config_t config;
+// everything the monitor wrote since the last message
+static unsigned char output[BINARY_HEADER_SIZE + BATCH_BUFFER_SIZE];
+static size_t output_len;
+
+
+static int capture(void *ud, const void *data, size_t len) {
+    (void) ud;
+    if (len > sizeof(output) - 1 - output_len)
+        len = sizeof(output) - 1 - output_len;
+    memcpy(output + output_len, data, len);
+    output_len += len;
+    output[output_len] = '\0';
+    return 1;
+}
+
+
+/**
+ * Handles a text message, returns what monitor_handle_message did.
+ */
+static int send_message(const char *msg) {
+    char buffer[OUTPUT_MESSAGE_SIZE];
+    int keep_going;
+
+    output_len = 0;
+    snprintf(buffer, sizeof(buffer), "%s", msg);
+    monitor_lock(&config);
+    keep_going = monitor_handle_message(&config, buffer);
+    monitor_unlock(&config);
+    return keep_going;
+}
+
+
+/**
+ * Handles a binary batch, returns what monitor_handle_record did.
+ */
+static int send_batch(const unsigned char *payload, size_t len) {
+    int keep_going;
+
+    output_len = 0;
+    monitor_lock(&config);
+    keep_going = monitor_handle_record(&config, 7, BINARY_BATCH, payload, len);
+    monitor_unlock(&config);
+    return keep_going;
+}
+
+
+/**
+ * Handles raw input, returns how many bytes monitor_handle_input consumed.
+ */
+static size_t send_input(char *buffer, size_t len) {
+    int keep_going;
+
+    output_len = 0;
+    return monitor_handle_input(&config, buffer, len, &keep_going);
+}
+
+
+/**
+ * Checks that the output is a single error record for serial with message.
+ */
+static int is_error_record(unsigned char serial, const char *message) {
+    size_t len = strlen(message);
+    return output_len == BINARY_HEADER_SIZE + len && output[0] == serial && output[4] == BINARY_ERROR
+            && output[6] == len && memcmp(output + BINARY_HEADER_SIZE, message, len) == 0;
+}
+
+
+static int desired_is(int extend_border, window_backdrop_e backdrop_type) {
+    return config.desired.extend_border == extend_border && config.desired.backdrop_type == backdrop_type;
+}
+
+
+int main(void) {
+    char msg[OUTPUT_MESSAGE_SIZE], too_long[64];
+    unsigned char payload[BINARY_MAX_PAYLOAD];
+    size_t len;
+
+    platform_mock_init(&mock);
+    monitor_init(&config, &platform_mock, &mock, -1);
+    monitor_writer_set_sink(&config.out, &capture, NULL);
+
+    CHECK(send_message("1 batch config 11\tunsubscribe 2"));
+    CHECK(strcmp((char *) output, "1 ok ok \tok 1\n") == 0);
+    CHECK(desired_is(1, BACKDROP_NONE));
+
+    // one command too many, nothing runs, not even the exit
+    len = (size_t) snprintf(msg, sizeof(msg), "2 batch config 02\tsubscribe 3");
+    for (int i = 2; i < MAX_BATCH_SIZE; i++)
+        len += (size_t) snprintf(msg + len, sizeof(msg) - len, "\ttheme ");
+    len += (size_t) snprintf(msg + len, sizeof(msg) - len, "\texit ");
+    CHECK(send_message(msg));
+    CHECK(strcmp((char *) output, "2 error batch too large\n") == 0);
+    CHECK(desired_is(1, BACKDROP_NONE));
+    CHECK(monitor_counter_get(&config.topics) == EVENT_THEME);
+
+    config.binary = 1;
+    // the second command is cut short
+    memcpy(payload, "\x01\x02\x00\x02" "\x09\x01\x03" "\x01\x05\x00", 10);
+    CHECK(send_batch(payload, 10));
+    CHECK(is_error_record(7, "invalid batch"));
+    CHECK(desired_is(1, BACKDROP_NONE));
+    CHECK(monitor_counter_get(&config.topics) == EVENT_THEME);
+
+    // a byte that can't be a command
+    CHECK(send_batch(payload, 5));
+    CHECK(is_error_record(7, "invalid batch"));
+    CHECK(desired_is(1, BACKDROP_NONE));
+
+    memcpy(payload, "\x01\x02\x00\x02", 4);
+    for (len = 4; len < 4 + MAX_BATCH_SIZE * 2; len += 2)
+        memcpy(payload + len, "\x04\x00", 2);
+    CHECK(send_batch(payload, len));
+    CHECK(is_error_record(7, "batch too large"));
+    CHECK(desired_is(1, BACKDROP_NONE));
+
+    CHECK(send_batch(payload, 4));
+    CHECK(output_len == BINARY_HEADER_SIZE + 2 && output[4] == BINARY_OK && output[8] == BINARY_OK);
+    CHECK(desired_is(0, BACKDROP_MICA));
+
+    config.max_message_size = MIN_MESSAGE_SIZE;
+    snprintf(too_long, sizeof(too_long), "message too long: more than %d bytes", MIN_MESSAGE_SIZE);
+    // a record one byte over the limit, header included, is answered and skipped even if it ends in a later read
+    memset(msg, 0, sizeof(msg));
+    memcpy(msg, "\x08\x00\x00\x00\x01\x00", 6);
+    msg[6] = (char) ((MIN_MESSAGE_SIZE - BINARY_HEADER_SIZE + 1) & 0xFF);
+    msg[7] = (char) ((MIN_MESSAGE_SIZE - BINARY_HEADER_SIZE + 1) >> 8);
+    CHECK(send_input(msg, 100) == 100);
+    CHECK(is_error_record(8, too_long));
+    len = MIN_MESSAGE_SIZE + 1 - 100;
+    memcpy(msg + 100 + len, "\x09\x00\x00\x00\x01\x00\x02\x00\x01\x01", 10);
+    CHECK(send_input(msg + 100, len + 10) == len + 10);
+    CHECK(output_len == BINARY_HEADER_SIZE && output[0] == 9 && output[4] == BINARY_OK);
+    CHECK(desired_is(1, BACKDROP_NONE));
+
+    // a line fits only if its newline does too
+    config.binary = 0;
+    memset(msg, 'x', MIN_MESSAGE_SIZE);
+    memcpy(msg, "10 config 02 ", 13);
+    msg[MIN_MESSAGE_SIZE - 1] = '\n';
+    CHECK(send_input(msg, MIN_MESSAGE_SIZE) == MIN_MESSAGE_SIZE);
+    CHECK(!strstr((char *) output, too_long));
+    // the line was cut up by the parser
+    memset(msg, 'x', MIN_MESSAGE_SIZE);
+    memcpy(msg, "10 config 02 ", 13);
+    msg[MIN_MESSAGE_SIZE] = '\n';
+    CHECK(send_input(msg, MIN_MESSAGE_SIZE + 1) == MIN_MESSAGE_SIZE + 1);
+    CHECK(strncmp((char *) output, "10 error ", 9) == 0 && strstr((char *) output, too_long));
+
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,92 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_core.h"
+#include "platform_mock.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+
+static int failures;
+static platform_mock_t mock;
+static window_config_t config;
+// everything the monitor wrote since the last message
+static char output[OUTPUT_MESSAGE_SIZE];
+static size_t output_len;
+
+
+static int capture(void *ud, const void *data, size_t len) {
+    (void) ud;
+    if (len > sizeof(output) - 1 - output_len)
+        len = sizeof(output) - 1 - output_len;
+    memcpy(output + output_len, data, len);
+    output_len += len;
+    output[output_len] = '\0';
+    return 1;
+}
+
+
+/**
+ * Handles a text message, returns what monitor_handle_message did.
+ */
+static int send_message(const char *msg) {
+    char buffer[BUFFER_SIZE];
+    int keep_going;
+
+    output_len = 0;
+    snprintf(buffer, sizeof(buffer), "%s", msg);
+    monitor_lock(&config);
+    keep_going = monitor_handle_message(&config, buffer);
+    monitor_unlock(&config);
+    return keep_going;
+}
+
+
+/**
+ * Checks that a contrast command is refused and leaves the backgrounds alone.
+ */
+static int is_refused(const char *msg) {
+    return send_message(msg) && strstr(output, " error invalid contrast") && config.contrast_count == 1
+            && config.contrast_ratio == 450 && config.contrast_colors[0] == 0xFFFFFFFFul;
+}
+
+
+int main(void) {
+    platform_mock_init(&mock);
+    monitor_init(&config, &platform_mock, &mock, -1);
+    monitor_writer_set_sink(&config.out, &capture, NULL);
+
+    CHECK(send_message("1 contrast 450 4294967295"));
+    CHECK(strncmp(output, "1 ok ", 5) == 0);
+    CHECK(config.contrast_count == 1 && config.contrast_ratio == 450 && config.contrast_colors[0] == 0xFFFFFFFFul);
+
+    // only plain decimal numbers that fit in 32 bits are colors
+    CHECK(is_refused("2 contrast 450 -5"));
+    CHECK(is_refused("3 contrast 450 +5"));
+    CHECK(is_refused("4 contrast 450 4294967296"));
+    CHECK(is_refused("5 contrast 450 18446744073709551617"));
+    CHECK(is_refused("6 contrast 450  5"));
+    CHECK(is_refused("7 contrast -450 5"));
+    CHECK(is_refused("8 contrast  450 5"));
+
+    // without an accent to answer with, the monitor keeps going and the backgrounds stay
+    mock.accent_failing = 1;
+    CHECK(send_message("9 contrast 700 255"));
+    CHECK(strcmp(output, "9 error mock_get_accent: failing\n") == 0);
+    CHECK(config.contrast_count == 1 && config.contrast_ratio == 450 && config.contrast_colors[0] == 0xFFFFFFFFul);
+    mock.accent_failing = 0;
+    CHECK(send_message("10 contrast 0"));
+    CHECK(strncmp(output, "10 ok ", 6) == 0 && config.contrast_count == 0);
+
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
@@ -0,0 +1,58 @@
+-- Runs the native module against the mock backend, like the plugin would from the editor.
+-- usage: lua test_native.lua <path to monitor_native>
+
+local path = assert(arg[1], "usage: lua test_native.lua <path to monitor_native>")
+local native = assert(package.loadlib(path, "luaopen_monitor_native"))()
+local BINARY_WINDOWS = 0x0C
+
+local m = assert(native.open { mock = true })
+
+
+---Runs the timers of the monitor and returns the broadcasts since the last call.
+---@return table[]
+local function events()
+  local list, err = m:poll_events()
+  return assert(list, err)
+end
+
+
+local list = events()
+assert(#list == 1 and list[1].type == "ready", "the ready broadcast should come first")
+assert(list[1].fields.total, "the ready broadcast should have its timings")
+
+-- the first window only needs the theme, the rest already matches
+assert(m:mock_window_state(1).apply_count == 1)
+assert(m:configure(true, 2))
+events()
+local state = m:mock_window_state(1)
+assert(state.extend_border and state.backdrop_type == 2 and state.apply_count == 3)
+assert(m:configure(true, 2))
+events()
+assert(m:mock_window_state(1).apply_count == 3, "a window that looks right should be skipped")
+
+m:mock_theme(true)
+list = events()
+assert(#list == 1 and list[1].type == "themechange" and list[1].dark)
+assert(m:theme() == true)
+assert(m:mock_window_state(1).dark_mode and m:mock_window_state(1).apply_count == 4)
+
+m:mock_accent(0x3366CCFF, true)
+list = events()
+assert(#list == 1 and list[1].type == "accentchange")
+assert(list[1].color == 0x3366CCFF and list[1].opaque)
+local color, opaque = m:accent()
+assert(color == 0x3366CCFF and opaque)
+
+-- windows opened later get everything, and closed ones are forgotten
+assert(m:mock_window(7, true))
+events()
+assert(m:mock_window_state(7).apply_count == 3)
+assert(m:mock_window(1, false))
+events()
+assert(m:mock_window_state(1) == nil)
+local windows = assert(m:request(BINARY_WINDOWS))
+assert(#windows == 8 and string.unpack("<I8", windows) == 7)
+
+m:close()
+assert(not pcall(m.theme, m), "a closed monitor should raise")
+print("ok")
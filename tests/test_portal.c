@@ -0,0 +1,311 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <dbus/dbus.h>
+
+#include "monitor_core.h"
+#include "platform_dbus.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+// how long a broadcast may take to come through the bus
+#define BROADCAST_TIMEOUT_MS 5000
+
+
+/**
+ * A Settings portal that serves the appearance settings from its own connection,
+ * like xdg-desktop-portal would.
+ */
+typedef struct portal_s {
+    DBusConnection *conn;
+    pthread_t thread;
+    int running;
+    // color-scheme, 1 for dark and 2 for light, and accent-color
+    uint32_t scheme;
+    double rgb[3];
+    pthread_mutex_t mutex;
+} portal_t;
+
+
+static int failures;
+static portal_t portal;
+static platform_dbus_t dbus;
+static platform_dbus_target_t target;
+static window_config_t config;
+// everything the monitor wrote so far
+static char output[16384];
+static size_t output_len;
+
+
+static int capture(void *ud, const void *data, size_t len) {
+    (void) ud;
+    if (len > sizeof(output) - 1 - output_len)
+        len = sizeof(output) - 1 - output_len;
+    memcpy(output + output_len, data, len);
+    output_len += len;
+    output[output_len] = '\0';
+    return 1;
+}
+
+
+/**
+ * Starts a session bus and points DBUS_SESSION_BUS_ADDRESS at it.
+ * Returns the pid of the bus, or -1.
+ */
+static pid_t start_bus(const char *daemon) {
+    char address[512], arg[32];
+    size_t len = 0;
+    int fds[2];
+    pid_t pid;
+
+    if (pipe(fds) != 0)
+        return -1;
+    pid = fork();
+    if (pid == 0) {
+        close(fds[0]);
+        snprintf(arg, sizeof(arg), "--print-address=%d", fds[1]);
+        execlp(daemon, daemon, "--session", "--nofork", arg, (char *) NULL);
+        _exit(127);
+    }
+    close(fds[1]);
+    while (pid > 0 && len < sizeof(address) - 1) {
+        ssize_t n = read(fds[0], address + len, 1);
+        if (n <= 0 || address[len] == '\n')
+            break;
+        len++;
+    }
+    close(fds[0]);
+    address[len] = '\0';
+    if (pid < 0 || !len) {
+        fprintf(stderr, "%s didn't start\n", daemon);
+        return -1;
+    }
+    setenv("DBUS_SESSION_BUS_ADDRESS", address, 1);
+    return pid;
+}
+
+
+static void append_setting(DBusMessageIter *iter, const char *key) {
+    DBusMessageIter variant, rgb;
+
+    pthread_mutex_lock(&portal.mutex);
+    if (strcmp(key, "color-scheme") == 0) {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "u", &variant);
+        dbus_message_iter_append_basic(&variant, DBUS_TYPE_UINT32, &portal.scheme);
+    } else {
+        dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, "(ddd)", &variant);
+        dbus_message_iter_open_container(&variant, DBUS_TYPE_STRUCT, NULL, &rgb);
+        for (int i = 0; i < 3; i++)
+            dbus_message_iter_append_basic(&rgb, DBUS_TYPE_DOUBLE, &portal.rgb[i]);
+        dbus_message_iter_close_container(&variant, &rgb);
+    }
+    dbus_message_iter_close_container(iter, &variant);
+    pthread_mutex_unlock(&portal.mutex);
+}
+
+
+/**
+ * Answers ReadOne until the portal is stopped.
+ */
+static void *portal_proc(void *ud) {
+    (void) ud;
+    while (__atomic_load_n(&portal.running, __ATOMIC_ACQUIRE) && dbus_connection_read_write(portal.conn, 50)) {
+        DBusMessage *msg;
+
+        while ((msg = dbus_connection_pop_message(portal.conn))) {
+            const char *namespace, *key;
+            DBusMessage *reply = NULL;
+            DBusMessageIter iter;
+
+            if (dbus_message_is_method_call(msg, PORTAL_SETTINGS_INTERFACE, "ReadOne")
+                && dbus_message_get_args(msg, NULL, DBUS_TYPE_STRING, &namespace, DBUS_TYPE_STRING, &key, DBUS_TYPE_INVALID)) {
+                if (strcmp(namespace, APPEARANCE_NAMESPACE) != 0
+                    || (strcmp(key, "color-scheme") != 0 && strcmp(key, "accent-color") != 0)) {
+                    reply = dbus_message_new_error(msg, "org.freedesktop.portal.Error.NotFound", key);
+                } else {
+                    reply = dbus_message_new_method_return(msg);
+                    dbus_message_iter_init_append(reply, &iter);
+                    append_setting(&iter, key);
+                }
+            } else if (dbus_message_get_type(msg) == DBUS_MESSAGE_TYPE_METHOD_CALL) {
+                reply = dbus_message_new_error(msg, DBUS_ERROR_UNKNOWN_METHOD, dbus_message_get_member(msg));
+            }
+            if (reply) {
+                dbus_connection_send(portal.conn, reply, NULL);
+                dbus_message_unref(reply);
+            }
+            dbus_message_unref(msg);
+        }
+    }
+    return NULL;
+}
+
+
+static int start_portal(void) {
+    DBusError error;
+
+    dbus_error_init(&error);
+    portal.scheme = 1;
+    portal.rgb[0] = 1.0;
+    portal.rgb[1] = portal.rgb[2] = 0.0;
+    pthread_mutex_init(&portal.mutex, NULL);
+    portal.conn = dbus_bus_get_private(DBUS_BUS_SESSION, &error);
+    if (!portal.conn
+        || dbus_bus_request_name(portal.conn, PORTAL_SERVICE, DBUS_NAME_FLAG_DO_NOT_QUEUE, &error)
+            != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+        fprintf(stderr, "cannot own %s: %s\n", PORTAL_SERVICE, dbus_error_is_set(&error) ? error.message : "taken");
+        dbus_error_free(&error);
+        return 0;
+    }
+    portal.running = 1;
+    return pthread_create(&portal.thread, NULL, &portal_proc, NULL) == 0;
+}
+
+
+static void stop_portal(void) {
+    __atomic_store_n(&portal.running, 0, __ATOMIC_RELEASE);
+    pthread_join(portal.thread, NULL);
+    dbus_connection_close(portal.conn);
+    dbus_connection_unref(portal.conn);
+    pthread_mutex_destroy(&portal.mutex);
+}
+
+
+/**
+ * Emits SettingChanged for key with the current value of the portal.
+ */
+static void emit_setting(const char *key) {
+    DBusMessage *signal = dbus_message_new_signal(PORTAL_PATH, PORTAL_SETTINGS_INTERFACE, "SettingChanged");
+    const char *namespace = APPEARANCE_NAMESPACE;
+    DBusMessageIter iter;
+
+    dbus_message_iter_init_append(signal, &iter);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &namespace);
+    dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &key);
+    append_setting(&iter, key);
+    dbus_connection_send(portal.conn, signal, NULL);
+    dbus_connection_flush(portal.conn);
+    dbus_message_unref(signal);
+}
+
+
+static void on_theme_change(void *ud) {
+    monitor_on_theme_change((window_config_t *) ud);
+}
+
+
+static void on_accent_change(void *ud, unsigned long color, int opaque) {
+    monitor_on_accent_change((window_config_t *) ud, color, opaque);
+}
+
+
+/**
+ * Reads the bus like the monitor does until broadcast was written.
+ * Returns 0 if it wasn't in time.
+ */
+static int wait_for(const char *broadcast) {
+    struct pollfd fd;
+    monitor_error_t err;
+
+    fd.fd = platform_dbus_fd(&dbus);
+    fd.events = POLLIN;
+    for (int waited = 0; !strstr(output, broadcast); waited += 50) {
+        if (waited >= BROADCAST_TIMEOUT_MS) {
+            fprintf(stderr, "no \"%s\" in:\n%s", broadcast, output);
+            return 0;
+        }
+        if (poll(&fd, 1, 50) < 0 && errno != EINTR)
+            return 0;
+        if (!platform_dbus_dispatch(&dbus, &err)) {
+            fprintf(stderr, "%s\n", err.message);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+
+int main(int argc, char **argv) {
+    monitor_error_t err;
+    int is_dark = 0;
+    pid_t bus;
+
+    if (argc != 2) {
+        fprintf(stderr, "usage: %s <dbus-daemon>\n", argv[0]);
+        return 2;
+    }
+    dbus_threads_init_default();
+    bus = start_bus(argv[1]);
+    if (bus < 0)
+        return 1;
+    if (!start_portal()) {
+        kill(bus, SIGTERM);
+        waitpid(bus, NULL, 0);
+        return 1;
+    }
+
+    target.dbus = &dbus;
+    target.pid = getpid();
+    dbus.on_theme_change = &on_theme_change;
+    dbus.on_accent_change = &on_accent_change;
+    dbus.ud = &config;
+    monitor_init(&config, &platform_dbus, &target, -1);
+    monitor_writer_set_sink(&config.out, &capture, NULL);
+    if (!platform_dbus_init(&dbus, &err)) {
+        fprintf(stderr, "%s\n", err.message);
+        failures++;
+        goto exit;
+    }
+
+    // the settings are read from the portal at startup
+    CHECK(platform_dbus.get_dark_mode(&target, &is_dark, &err) && is_dark);
+    monitor_lock(&config);
+    config.desired.dark_mode = is_dark;
+    monitor_unlock(&config);
+
+    pthread_mutex_lock(&portal.mutex);
+    portal.scheme = 2;
+    pthread_mutex_unlock(&portal.mutex);
+    emit_setting("color-scheme");
+    CHECK(wait_for("-1 " BROADCAST_THEMECHANGE " 0\n"));
+
+    pthread_mutex_lock(&portal.mutex);
+    portal.scheme = 1;
+    pthread_mutex_unlock(&portal.mutex);
+    emit_setting("color-scheme");
+    CHECK(wait_for("-1 " BROADCAST_THEMECHANGE " 1\n"));
+
+    // 0.2, 0.4, 0.6 is 0x336699FF as RGBA
+    pthread_mutex_lock(&portal.mutex);
+    portal.rgb[0] = 0.2;
+    portal.rgb[1] = 0.4;
+    portal.rgb[2] = 0.6;
+    pthread_mutex_unlock(&portal.mutex);
+    emit_setting("accent-color");
+    CHECK(wait_for("-1 " BROADCAST_ACCENTCHANGE " 1 862362111"));
+
+    platform_dbus_destroy(&dbus);
+exit:
+    monitor_destroy(&config);
+    stop_portal();
+    kill(bus, SIGTERM);
+    waitpid(bus, NULL, 0);
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}
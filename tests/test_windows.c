@@ -0,0 +1,219 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "monitor_core.h"
+#include "platform_mock.h"
+
+
+#define CHECK(cond) do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: %s\n", __FILE__, __LINE__, #cond); \
+            failures++; \
+        } \
+    } while (0)
+
+
+static int failures;
+static platform_mock_t mock;
+static window_config_t config;
+// everything the monitor wrote since the last message or apply
+static char output[4096];
+static size_t output_len;
+// the time of the monitor, so retries happen when the test says so
+static uint64_t now_ns = 1000000000ull;
+
+
+static int capture(void *ud, const void *data, size_t len) {
+    (void) ud;
+    if (len > sizeof(output) - 1 - output_len)
+        len = sizeof(output) - 1 - output_len;
+    memcpy(output + output_len, data, len);
+    output_len += len;
+    output[output_len] = '\0';
+    return 1;
+}
+
+
+static uint64_t fake_clock(void *ud) {
+    (void) ud;
+    return now_ns;
+}
+
+
+/**
+ * Handles a message and applies what it changed, like the client and the apply loop would.
+ */
+static void send_message(const char *msg) {
+    char buffer[BUFFER_SIZE];
+
+    output_len = 0;
+    output[0] = '\0';
+    snprintf(buffer, sizeof(buffer), "%s", msg);
+    monitor_lock(&config);
+    monitor_handle_message(&config, buffer);
+    monitor_apply_pending(&config);
+    monitor_unlock(&config);
+}
+
+
+static void apply(void) {
+    output_len = 0;
+    output[0] = '\0';
+    monitor_lock(&config);
+    monitor_apply_pending(&config);
+    monitor_unlock(&config);
+}
+
+
+/**
+ * Returns the number of apply calls the window got, or -1 if it isn't open.
+ */
+static long apply_count(uint64_t handle) {
+    platform_mock_window_t window;
+    return platform_mock_get_window(&mock, handle, &window) ? (long) window.apply_count : -1;
+}
+
+
+static platform_mock_window_t get_window(uint64_t handle) {
+    platform_mock_window_t window = { 0 };
+    CHECK(platform_mock_get_window(&mock, handle, &window));
+    return window;
+}
+
+
+static uint64_t next_deadline(void) {
+    uint64_t deadline;
+
+    monitor_lock(&config);
+    deadline = monitor_next_deadline(&config);
+    monitor_unlock(&config);
+    return deadline;
+}
+
+
+int main(void) {
+    platform_mock_window_t window;
+
+    monitor_set_clock(&fake_clock, NULL);
+    platform_mock_init(&mock);
+    mock.dark_mode = 1;
+    monitor_init(&config, &platform_mock, &mock, -1);
+    monitor_writer_set_sink(&config.out, &capture, NULL);
+    config.desired.dark_mode = 1;
+
+    // new windows only need the theme, the rest already matches
+    for (uint64_t handle = 1000; handle <= 3000; handle += 1000)
+        CHECK(platform_mock_add_window(&mock, &config, handle));
+    apply();
+    CHECK(config.window_count == 3);
+    CHECK(apply_count(1000) == 1 && apply_count(2000) == 1 && apply_count(3000) == 1);
+    CHECK(get_window(2000).dark_mode == 1);
+    CHECK(mock.apply_count == 3);
+
+    apply();
+    CHECK(mock.apply_count == 3);
+
+    send_message("1 config 12");
+    CHECK(strcmp(output, "1 ok \n") == 0);
+    CHECK(apply_count(1000) == 3 && apply_count(2000) == 3 && apply_count(3000) == 3);
+    window = get_window(3000);
+    CHECK(window.extend_border == 1 && window.backdrop_type == 2 && window.dark_mode == 1);
+
+    // the windows already look like this
+    send_message("2 config 12");
+    CHECK(mock.apply_count == 9);
+
+    // only the overridden attributes of that window change
+    send_message("3 override 2000 0-0");
+    CHECK(strncmp(output, "3 ok", 4) == 0);
+    CHECK(apply_count(1000) == 3 && apply_count(2000) == 5 && apply_count(3000) == 3);
+    window = get_window(2000);
+    CHECK(window.extend_border == 0 && window.backdrop_type == 2 && window.dark_mode == 0);
+
+    send_message("4 override 2000 ---");
+    CHECK(apply_count(2000) == 7);
+    window = get_window(2000);
+    CHECK(window.extend_border == 1 && window.dark_mode == 1);
+
+    // a window opened later gets everything
+    CHECK(platform_mock_add_window(&mock, &config, 4000));
+    apply();
+    CHECK(apply_count(4000) == 3);
+    CHECK(mock.apply_count == 16);
+
+    platform_mock_remove_window(&mock, &config, 1000);
+    apply();
+    CHECK(config.window_count == 3);
+    CHECK(apply_count(1000) == -1);
+    send_message("5 windows ");
+    CHECK(strstr(output, "5 ok ") == output);
+    CHECK(!strstr(output, "1000") && strstr(output, "2000") && strstr(output, "3000") && strstr(output, "4000"));
+
+    // a theme change reaches every window, but only the dark mode is set
+    platform_mock_set_theme(&mock, &config, 0);
+    apply();
+    CHECK(apply_count(2000) == 8 && apply_count(3000) == 4 && apply_count(4000) == 4);
+    CHECK(get_window(4000).dark_mode == 0);
+
+    // a window with its own theme doesn't follow the system
+    send_message("6 override 3000 --1");
+    CHECK(apply_count(3000) == 5 && get_window(3000).dark_mode == 1);
+    platform_mock_set_theme(&mock, &config, 1);
+    platform_mock_set_theme(&mock, &config, 0);
+    apply();
+    CHECK(apply_count(3000) == 5);
+
+    send_message("7 override 5000 1--");
+    CHECK(strstr(output, "7 error") == output);
+
+    // a failing attribute backs off on its own, the other windows and attributes don't wait for it
+    CHECK(platform_mock_fail(&mock, 2000, CONFIG_DARK_MODE));
+    platform_mock_set_theme(&mock, &config, 1);
+    apply();
+    CHECK(get_window(2000).fail_count == 1 && get_window(2000).dark_mode == 0);
+    CHECK(strstr(output, "mock_apply: failing") && !strstr(output, "not retried"));
+    CHECK(get_window(4000).dark_mode == 1);
+    CHECK(next_deadline() == now_ns + APPLY_RETRY_MIN_MS * 1000000ull);
+
+    send_message("8 config 01");
+    CHECK(apply_count(2000) == 10 && apply_count(3000) == 7 && apply_count(4000) == 7);
+    window = get_window(2000);
+    CHECK(window.extend_border == 0 && window.backdrop_type == BACKDROP_NONE && window.fail_count == 1);
+
+    // the delay doubles with every attempt, until the attribute is given up on
+    now_ns = next_deadline();
+    apply();
+    CHECK(get_window(2000).fail_count == 2);
+    CHECK(next_deadline() == now_ns + APPLY_RETRY_MIN_MS * 2 * 1000000ull);
+    for (int attempt = 3; attempt <= APPLY_RETRY_MAX_ATTEMPTS; attempt++) {
+        now_ns = next_deadline();
+        apply();
+    }
+    CHECK(get_window(2000).fail_count == APPLY_RETRY_MAX_ATTEMPTS);
+    CHECK(strstr(output, "not retried until the configuration changes"));
+    CHECK(next_deadline() == 0);
+
+    // another window gets every attempt even if one was given up on
+    CHECK(platform_mock_fail(&mock, 4000, CONFIG_DARK_MODE));
+    platform_mock_set_theme(&mock, &config, 0);
+    apply();
+    CHECK(get_window(4000).fail_count == 1 && !strstr(output, "not retried"));
+    CHECK(next_deadline() == now_ns + APPLY_RETRY_MIN_MS * 1000000ull);
+    CHECK(platform_mock_fail(&mock, 4000, 0) && platform_mock_fail(&mock, 2000, 0));
+    now_ns = next_deadline();
+    apply();
+    CHECK(get_window(4000).dark_mode == 0 && get_window(4000).fail_count == 1);
+    CHECK(next_deadline() == 0);
+
+    // the value given up on is tried again once the target moved away from it
+    platform_mock_set_theme(&mock, &config, 1);
+    apply();
+    CHECK(get_window(2000).dark_mode == 1 && get_window(4000).dark_mode == 1);
+    CHECK(get_window(2000).fail_count == APPLY_RETRY_MAX_ATTEMPTS);
+
+    monitor_destroy(&config);
+    platform_mock_destroy(&mock);
+    if (failures)
+        fprintf(stderr, "%d checks failed\n", failures);
+    return failures != 0;
+}